@@ -30,8 +30,12 @@
 #include "a1fs.h"
 #include "fs_ctx.h"
 #include "options.h"
-#include "map.h"
+#include "bdev.h"
 #include "helper.h"
+#include "fs_core.h"
+#include "dcache.h"
+#include "dirty.h"
+#include "journal.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -61,11 +65,29 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 	// Nothing to initialize if only printing help or version
 	if (opts->help || opts->version) return true;
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image) return false;
+	fs->bdev = bdev_open(opts->img_path, opts);
+	if (!fs->bdev) return false;
 
-	return fs_ctx_init(fs, image, size, opts);
+	return fs_ctx_init(fs, fs->bdev->image, fs->bdev->size, opts);
+}
+
+/**
+ * Start the background flusher (see dirty.h), and finish setting up the I/O
+ * backend (see bdev.h).
+ *
+ * Called by FUSE once it runs, after it has daemonized; a thread started in
+ * a1fs_init() would not survive the fork, and /proc/self/pagemap opened there
+ * would describe the parent.
+ */
+static void *a1fs_start(struct fuse_conn_info *conn)
+{
+	(void)conn;// unused
+	fs_ctx *fs = (fs_ctx*)fuse_get_context()->private_data;
+	if (fs->image) bdev_start(fs->bdev);
+	if (fs->image && !dirty_start_flusher(fs)) {
+		fprintf(stderr, "Failed to start the flusher, changes are synced by fsync() only\n");
+	}
+	return fs;
 }
 
 /**
@@ -78,10 +100,34 @@ static void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
 	if (fs->image) {
-		if (fs->opts->sync && (msync(fs->image, fs->size, MS_SYNC) < 0)) {
-			perror("msync");
+		dirty_stop_flusher(fs);
+		if (fs->opts->verbose) {
+			a1fs_dcache *dcache = fs->dcache;
+			uint64_t lookups = dcache->hits + dcache->negative_hits + dcache->misses;
+			fprintf(stderr, "dcache: %lu hits, %lu negative hits, %lu misses (%.1f%% hit rate)\n",
+			        dcache->hits, dcache->negative_hits, dcache->misses,
+			        lookups ? 100.0 * (dcache->hits + dcache->negative_hits) / lookups : 0.0);
+			fprintf(stderr, "writeback: %lu msync() calls over %lu blocks\n",
+			        fs->writeback->msyncs, fs->writeback->synced_blocks);
+		}
+		core_flush_all(fs);
+		// a clean unmount leaves nothing to replay
+		if (fs->journal && journal_checkpoint(fs) < 0) {
+			fprintf(stderr, "Failed to checkpoint the journal\n");
+		}
+		if (fs->opts->verbose && fs->journal) {
+			fprintf(stderr, "journal: %lu commits of %lu blocks, %lu checkpoints\n",
+			        fs->journal->commits, fs->journal->logged_blocks, fs->journal->checkpoints);
+		}
+		if (fs->opts->verbose) {
+			a1fs_bdev *bd = fs->bdev;
+			fprintf(stderr, "io: %s, %lu syncs over %lu blocks, %lu releases of %lu pages\n",
+			        bd->ops->name, bd->syncs, bd->synced_blocks, bd->releases, bd->released_pages);
 		}
-		munmap(fs->image, fs->size);
+		if (bdev_close(fs->bdev, fs->opts->sync) < 0) {
+			fprintf(stderr, "Failed to write the image\n");
+		}
+		fs->bdev = NULL;
 		fs_ctx_destroy(fs);
 	}
 }
@@ -110,64 +156,15 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path;// unused
 	fs_ctx *fs = get_fs();
-
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
-	//TODO: fill in the rest of required fields based on the information stored
-	// in the superblock
-	st->f_blocks = fs->size / st->f_frsize;
-
-	struct a1fs_superblock *sp = (struct a1fs_superblock*)fs->image;
-
-	st->f_bfree	 = 	sp->free_blocks_count;
-	st->f_bavail = 	sp->free_blocks_count;
-	st->f_files	 = 	sp->inodes_count;
-	st->f_ffree	 = 	sp->free_inodes_count;
-	st->f_favail = 	sp->free_inodes_count;
-
-	st->f_namemax = A1FS_NAME_MAX;
-	
+	core_statfs(fs, st);
 	return 0;
 }
 
 
-/**
- * Given the inode for a directory
- * Given the name of the dentry that we are looking for
- *
- * Return the order of that file/directory in its parent data
- * Update pos to be the pointer pointing to dentry
- * Return -1 if the dentry of that file/directory is not found
- */
-int find_dentry_from_inode(a1fs_inode* p_inode, a1fs_dentry** result_dentry, char* name) {
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    int num_dentries_searched = 0;
-    int total_num_dentries = (int) (p_inode->size / sizeof(a1fs_dentry));
-    a1fs_extent *extent = (a1fs_extent*)((void*)sp + A1FS_BLOCK_SIZE * (p_inode->extents).start);
-    a1fs_dentry *dentry = (a1fs_dentry*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
-    while (num_dentries_searched < total_num_dentries) {
-        // iterate through the extents of p_inode to find the dentry
-        if (strcmp(name, dentry->name) == 0) {
-            *result_dentry = dentry;
-            return num_dentries_searched;
-            }
-        dentry += 1;
-        if ((a1fs_dentry*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == dentry) {
-            // the current extent is already searched completely
-            // Forward to the next extent
-            extent += 1;
-        }
-        num_dentries_searched += 1;
-    }
-    return -1;
-}
-
-
 /**
  * Get the inode of the file indicated by the givenpath
  * If success, result should be the pointer to the inode of the file on return
+ * Results, including paths that do not exist, are cached (see dcache.h)
  *
  * Errors:
  *   ENAMETOOLONG  the path or one of its components is too long.
@@ -182,256 +179,57 @@ int find_dentry_from_inode(a1fs_inode* p_inode, a1fs_dentry** result_dentry, cha
 int find_inode_from_path(const char* path, a1fs_inode** result) {
     if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
     fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    uint32_t hash = dcache_hash(path);
+    uint64_t generation = dcache_generation(fs);
+    long ino = dcache_lookup(fs, path, hash);
+    if (ino == 0) return -ENOENT;
+    if (ino > 0) {
+        *result = get_inode(fs, ino);
+        return 0;
+    }
     char path_copy[A1FS_PATH_MAX];
 	strncpy(path_copy, path, A1FS_PATH_MAX);
 	path_copy[A1FS_PATH_MAX-1] = '\0';
-	char *name = strtok(path_copy, "/");
-    a1fs_dentry *curr_dentry;
+	char *saveptr;
+	char *name = strtok_r(path_copy, "/", &saveptr);
     int error_result;
     // starting from root
-    a1fs_inode *curr_inode = (a1fs_inode*)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table + sizeof(a1fs_inode));
+    a1fs_inode *curr_inode = get_inode(fs, 1);
     while (name) {
-        // after each iteraton, curr_dentry and curr_inode should be corresponding to the same file
-        if (strlen(name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+        // after each iteraton, curr_inode should be corresponding to name
         if (!S_ISDIR(curr_inode->mode)) return -ENOTDIR;
-        error_result = find_dentry_from_inode(curr_inode, &curr_dentry, name);
-        if (error_result < 0) return -ENOENT;
-        curr_inode = (a1fs_inode*) ((void*)sp + sp->inode_table * A1FS_BLOCK_SIZE + curr_dentry->ino * sizeof(a1fs_inode));
-        name = strtok(NULL, "/");
+        error_result = core_lookup(fs, curr_inode, name, &curr_inode);
+        if (error_result == -ENOENT) dcache_insert(fs, path, hash, 0, generation);
+        if (error_result < 0) return error_result;
+        name = strtok_r(NULL, "/", &saveptr);
     }
     // Now curr_dir should be the file that we are looking for
+    dcache_insert(fs, path, hash, get_ino(fs, curr_inode), generation);
     *result = curr_inode;
     return 0;
 }
 
 
 /**
- *  Find the pointer pointing to the file offset from the beginning by size
- *  On return:
- *  ptr should be pointing to the byte right after the offset
- *  extent should be pointing to the extent where the actual last bit of the file is in
- *
- * Assumption:
- *      file is not empty
- *      0 <= size <= file size
- *
- *  @param inode the inode that we are interested in
- */
-void find_ptr_at_size(a1fs_inode *inode, size_t size, char **ptr, a1fs_extent **last_extent) {
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    int byte_searched = 0;
-    a1fs_extent *extent = (a1fs_extent*) ((void*)sp + inode->extents.start * A1FS_BLOCK_SIZE);
-    char * curr_ptr = (char*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
-    while (byte_searched < (int) size) {
-        if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == curr_ptr) {
-            // the current extent is already searched completely
-            // Forward to the next extent
-            extent += 1;
-            curr_ptr = (char*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
-        }
-        byte_searched += 1;
-        curr_ptr += 1;
-    }
-    *ptr = curr_ptr;
-    *last_extent = extent;
-}
-
-
-/**
- * initialize a new extent at required pos
- *
- * @param pos where we want to add the extent
- * @Return the pointer to the first bit of the data block of the new extent
- */
-void* add_extent(a1fs_extent* pos) {
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    a1fs_blk_t new_extent_start = find_first_free_block_num(sp);
-    char *block_bitmap = (char*) ((void*)sp + sp->block_bitmap * A1FS_BLOCK_SIZE);
-    set_bitmap(block_bitmap, new_extent_start);
-    sp->free_blocks_count -= 1;
-    sp->blocks_count += 1;
-    pos->start = new_extent_start;
-    pos->count = 1;
-    void* result = (void*) ((void*)sp + new_extent_start * A1FS_BLOCK_SIZE);
-    return result;
-}
-
-
-/**
- * Allocate data space of required size for p_inode
- * pos pointed to the first byte of the new allocated space on return
- * pos should be only used on success return
- *
- * Errors:
- *  ENOSPC not enough free space in the file system
+ * Get the inode of an open file and the extent cursor of its handle
+ * Files opened without a handle (fi->fh is 0) are resolved from path and get
+ * no cursor
  *
- *  @param p_inode the pointer to the inode of the parent
- *  @param pos pointer pointing to the new allocated space
- *  @param size the size of the new allocated space
+ * @param fi the file info passed to the operation; may be NULL
+ * @return 0 on success; -errnor on errors (see find_inode_from_path());
  */
-int add_data(a1fs_inode *p_inode, char** pos, size_t size) {
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    char *curr_ptr;
-    a1fs_extent* extent;
-    if (p_inode->size == 0) {
-        // We need to initialize the extents(indirect) of p_inode and one direct extent
-        if (sp->free_blocks_count < 2) return -ENOSPC;
-        extent = (a1fs_extent*) add_extent(&(p_inode->extents));
-        curr_ptr = (char*) add_extent(extent);
-        p_inode->blocks += 2;
-    } else find_ptr_at_size(p_inode, p_inode->size, &curr_ptr, &extent);
-    *pos = curr_ptr;
-    // Now increase length of extents or allocate new extents if needed
-    uint64_t byte_searched = 0;
-    while (byte_searched < size) {
-        if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == curr_ptr) {
-            // the current extent is already searched completely and we need to use more blocks
-            // check if we have enough space
-            if (sp->blocks_count >= sp->max_block_count) return -ENOSPC;
-            char *block_bitmap = (char*) ((void*)sp + sp->block_bitmap * A1FS_BLOCK_SIZE);
-            int index = extent->start + extent->count;
-            if (!read_bitmap(block_bitmap, index)) {
-                // extent the extent if we can
-                set_bitmap(block_bitmap, index);
-                sp->free_blocks_count -= 1;
-                sp->blocks_count += 1;
-                extent->count += 1;
-            } else {
-                // else we need to allocate a new extent
-                // check if we have already allocated 512 extents for this file
-                if ((int)(((void*)extent - (void*)sp - (p_inode->extents).start * A1FS_BLOCK_SIZE) / sizeof(a1fs_extent)) >= 512) return -ENOSPC;
-                extent += 1;
-                // add one more extent after the previous extent position
-                curr_ptr = (char*) add_extent(extent);
-            }
-            p_inode->blocks += 1;
-        }
-        *curr_ptr = '\0';
-        byte_searched += 1;
-        curr_ptr += 1;
+int find_open_inode(const char *path, struct fuse_file_info *fi, a1fs_inode **result, a1fs_cursor **cursor) {
+    a1fs_handle *handle = fi ? (a1fs_handle*)(uintptr_t)fi->fh : NULL;
+    if (handle) {
+        *result = handle->inode;
+        *cursor = &handle->cursor;
+        return 0;
     }
-    p_inode->size += size;
-    clock_gettime(CLOCK_REALTIME, &p_inode->mtime);
-    return 0;
-}
-
-
-/**
- * Create a new inode for the file specified by dentry
- * Update file_inode to be the created new inode
- * Set size, blocks, mtime for the new inode
- * Need to set mode and links for the new inode
- *
- *
- * Errors:
- *   ENOSPC  not enough free space in the file system.
- *
- * @param file_inode the address of the pointer to the new created inode
- * @param dentry the dentry of the file whose inode need to be created
- * @return 0 on success, -errnor on error
- */
-int make_inode(a1fs_inode** file_inode, a1fs_dentry* dentry) {
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    if (sp->inodes_count >= sp->max_inodes_count) return -ENOSPC;
-    // create file_inode
-    char *inode_bitmap = (char*) ((void*)sp + sp->inode_bitmap * A1FS_BLOCK_SIZE);
-    int ino = find_first_free_inode_num(sp);
-    if (ino < 0 ) return -ENOSPC;
-    set_bitmap(inode_bitmap, ino);
-    sp->inodes_count += 1;
-    sp->free_inodes_count -= 1;
-    dentry->ino = ino;
-    *file_inode = (a1fs_inode*) ((void*)sp + sp->inode_table * A1FS_BLOCK_SIZE + ino * sizeof(a1fs_inode));
-    (*file_inode)->size = 0;
-    clock_gettime(CLOCK_REALTIME, &(*file_inode)->mtime);
-    (*file_inode)->blocks = 0;
-    return 0;
+    *cursor = NULL;
+    return find_inode_from_path(path, result);
 }
 
 
-/**
-* Delete data starting from offset i.e., deleted data region is [offset, offset+size]
-* offset should be pointeing to somewhere inside a data block
-* size should be valid, i.e., 0 <= size <= left space starting from offset
-*
-* @param inode the inode of the file whose data need to be deleted
-* @param offset the offset from begining of the file to the position of the data that need to deleted
-* @param size the size of the data region that need to be deleted
-*/
-void delete_data (a1fs_inode* inode, uint64_t offset, uint64_t size) {
-    assert(offset + size <= inode->size);
-    fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    // get the to_ptr pointing at offset and from_ptr pointing at offset+size
-    char *to_ptr;
-    a1fs_extent* to_extent;
-    find_ptr_at_size(inode, offset, &to_ptr, &to_extent);
-    char *from_ptr;
-    a1fs_extent *from_extent;
-    find_ptr_at_size(inode, offset+size, &from_ptr, &from_extent);
-    uint64_t byte_searched = 0;
-    // Now copy data from from_ptr to to_ptr
-    // In total <filesize - (offset + size)> bytes data should be copied
-    // uint64_t cpy_amt_once;
-    while (byte_searched < (inode->size - offset - size)) {
-         if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (from_extent->start + from_extent->count)) == from_ptr) {
-             from_extent += 1;
-             from_ptr = (char*) ((void*)sp + A1FS_BLOCK_SIZE * from_extent->start);
-             }
-         if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (to_extent->start + to_extent->count)) == to_ptr) {
-             to_extent += 1;
-             to_ptr = (char*) ((void*)sp + A1FS_BLOCK_SIZE * to_extent->start);
-            }
-        *to_ptr = *from_ptr;
-        to_ptr += 1;
-        from_ptr += 1;
-        byte_searched += 1;
-    }
-    // Now we need to check if we need to deallocate any data bitmap
-    // Check if we need to decrease length of the new last extent
-    a1fs_extent *new_last_extent = to_extent;
-    a1fs_blk_t new_last_extent_count = to_extent->count;
-    a1fs_blk_t block_index = (a1fs_blk_t) (((void*)to_ptr - (void*)sp) / A1FS_BLOCK_SIZE);
-    if (to_extent->start <= block_index && block_index < to_extent->start + to_extent->count - 1) {
-        new_last_extent_count =  block_index + 1 - to_extent->start;
-    }
-    // we starting from <off_set>, copied <filesize-offset-size> bytes data
-    // need to check <size> bytes more data to iterate through the whole file/directory
-    // Forward ptr to the starting byte of next block since we are only checking if we need to free bitmap
-    byte_searched = (uint64_t) ((void*)sp + (new_last_extent->start + new_last_extent_count) * A1FS_BLOCK_SIZE - (void*)to_ptr);
-    to_ptr = (char*) ((void*)sp + (new_last_extent->start + new_last_extent_count) * A1FS_BLOCK_SIZE);
-    char *block_bitmap = (char*) ((void*)sp + sp->block_bitmap * A1FS_BLOCK_SIZE);
-    while (byte_searched < size) {
-        if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (to_extent->start + to_extent->count)) == to_ptr) {
-            to_extent += 1;
-            to_ptr = (char*) ((void*)sp + to_extent -> start * A1FS_BLOCK_SIZE);
-        }
-        block_index = (a1fs_blk_t) (((void*)to_ptr - (void*)sp) / A1FS_BLOCK_SIZE);
-        free_bitmap(block_bitmap, block_index);
-        inode->blocks -= 1;
-        sp->blocks_count -= 1;
-        sp->free_blocks_count += 1;
-        to_extent = (a1fs_extent*) ((void*)sp + to_extent->start * A1FS_BLOCK_SIZE);
-        byte_searched += A1FS_BLOCK_SIZE;
-        to_ptr = (char*) ((void*)to_ptr + A1FS_BLOCK_SIZE);
-    }
-    new_last_extent->count = new_last_extent_count;
-    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-    inode->size -= size;
-    // if the file after deletion is empty, we should delete its indirect extent
-    if (inode->size == 0) {
-        inode->blocks = 0;
-        free_bitmap(block_bitmap, (inode->extents).start);
-        sp->blocks_count -= 1;
-        sp->free_blocks_count += 1;
-    }
-}
-
 /**
  * Given the full path
  * On return:
@@ -461,21 +259,20 @@ void find_parent_path(const char* path, char *p_path, char *name) {
  */
 void update_time_for_family(const char *path) {
     fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
     char path_copy[A1FS_PATH_MAX];
 	strncpy(path_copy, path, A1FS_PATH_MAX);
 	path_copy[A1FS_PATH_MAX-1] = '\0';
-	char *name = strtok(path_copy, "/");
-    a1fs_dentry *curr_dentry;
+	char *saveptr;
+	char *name = strtok_r(path_copy, "/", &saveptr);
     // starting from root
-    a1fs_inode *curr_inode = (a1fs_inode*)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table + sizeof(a1fs_inode));
-    clock_gettime(CLOCK_REALTIME, &(curr_inode->mtime));
+    a1fs_inode *curr_inode = get_inode(fs, 1);
+    core_set_mtime(fs, curr_inode, NULL);
     while (name) {
-        // after each iteraton, curr_dentry and curr_inode should be corresponding to the same file
-        find_dentry_from_inode(curr_inode, &curr_dentry, name);
-        curr_inode = (a1fs_inode*) ((void*)sp + sp->inode_table * A1FS_BLOCK_SIZE + curr_dentry->ino * sizeof(a1fs_inode));
-        name = strtok(NULL, "/");
-        clock_gettime(CLOCK_REALTIME, &(curr_inode->mtime));
+        // after each iteraton, curr_inode should be corresponding to name
+        // another thread may have removed it in the meantime
+        if (core_lookup(fs, curr_inode, name, &curr_inode) < 0) return;
+        name = strtok_r(NULL, "/", &saveptr);
+        core_set_mtime(fs, curr_inode, NULL);
     }
 }
 
@@ -501,31 +298,11 @@ void update_time_for_family(const char *path) {
  */
 static int a1fs_getattr(const char *path, struct stat *st)
 {
-    memset(st, 0, sizeof(*st));
+    fs_ctx *fs = get_fs();
     a1fs_inode* file_inode;
     int result = find_inode_from_path(path, &file_inode);
     if(result != 0) { return result; }
-    st->st_nlink = file_inode->links;
-    st->st_mode = file_inode->mode | 0777;
-    st->st_size = file_inode->size;
-    st->st_blocks = file_inode->blocks * A1FS_BLOCK_SIZE / 512;
-    st->st_mtim = file_inode->mtime;
-    
-    // set up for ino can be ignored
-    char p_path[A1FS_PATH_MAX];
-    char name[A1FS_NAME_MAX];
-    find_parent_path(path, p_path, name);
-    a1fs_inode *p_inode;
-    find_inode_from_path(p_path, &p_inode);
-    a1fs_dentry *pos;
-    result = find_dentry_from_inode(p_inode, &pos, name);
-    if(result < 0){
-        st->st_ino = 1;//root
-    }else
-    {
-        int ino = ((a1fs_dentry*)pos)->ino;
-        st->st_ino = ino;
-    }
+    core_getattr(fs, file_inode, st);
     return 0;
 }
 
@@ -547,38 +324,36 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * @param filler  function that needs to be called for each directory entry.
  *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
  * @param offset  unused.
- * @param fi      unused.
+ * @param fi      directory handle set by a1fs_open().
  * @return        0 on success; -errno on error.
  */
+/** Arguments of the filler() passed to a1fs_readdir(). */
+typedef struct readdir_buf {
+    void *buf;
+    fuse_fill_dir_t filler;
+} readdir_buf;
+
+/** Pass one directory entry to the FUSE filler() of a1fs_readdir(). */
+static int readdir_fill(void *buf, const a1fs_dirent *dirent)
+{
+    readdir_buf *rb = (readdir_buf*)buf;
+    return rb->filler(rb->buf, dirent->name, NULL, 0);
+}
+
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
     (void)offset;// unused
-    (void)fi;// unused
     fs_ctx *fs = get_fs();
-    //TODO: lookup the directory inode for given path and iterate through its
-    // directory entries
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
     // get the file inode
     a1fs_inode* file_inode;
-    find_inode_from_path(path, &file_inode);
-    int num_dentries_searched = 0;
-    int total_num_dentries = file_inode->size / sizeof(a1fs_dentry);
-    a1fs_extent *extent = (a1fs_extent*) ((void*)sp + (file_inode->extents).start * A1FS_BLOCK_SIZE);
-    a1fs_dentry *dentry = (a1fs_dentry*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
+    a1fs_cursor *cursor;
+    int result = find_open_inode(path, fi, &file_inode, &cursor);
+    if (result < 0) return result;
     if (filler(buf, ".", NULL, 0) != 0) { return -ENOMEM; }
     if (filler(buf, "..", NULL, 0) != 0) { return -ENOMEM; }
-    while (num_dentries_searched < total_num_dentries) {
-        if (filler(buf, dentry->name, NULL, 0) != 0) { return -ENOMEM; }
-        dentry += 1;
-        if ((a1fs_dentry*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == dentry) {
-            // the current extent is already searched completely
-            // Forward to the next extent
-            extent += 1;
-            dentry = (a1fs_dentry*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
-        }
-        num_dentries_searched += 1;
-    }
+    readdir_buf rb = { buf, filler };
+    if (core_readdir(fs, file_inode, cursor, 0, readdir_fill, &rb) != 0) { return -ENOMEM; }
     return 0;
 }
 
@@ -608,29 +383,18 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int a1fs_mkdir(const char *path, mode_t mode)
 {
 	fs_ctx *fs = get_fs();
-
-	//TODO: create a directory at given path with given mode
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    if (sp->blocks_count > sp->max_block_count) return -ENOSPC;
     char p_path[A1FS_PATH_MAX];
     char name[A1FS_NAME_MAX];
     find_parent_path(path, p_path, name);
     a1fs_inode* p_inode;
     a1fs_inode* new_inode;
-    a1fs_dentry* new_dentry;
-    find_inode_from_path(p_path, &p_inode);
-    int result = add_data(p_inode, (char**)&new_dentry, sizeof(a1fs_dentry));
+    int result = find_inode_from_path(p_path, &p_inode);
+    if (result < 0) return result;
+    // the path may be cached as missing
+    dcache_remove(fs, path);
+    result = core_mknod(fs, p_inode, name, mode | S_IFDIR, &new_inode);
+    dcache_done(fs);
     if (result < 0) return result;
-    result = make_inode(&new_inode, new_dentry);
-    if (result < 0) {
-        delete_data(p_inode, p_inode->size - sizeof(a1fs_dentry), sizeof(a1fs_dentry));
-        return result;
-    }
-    strncpy(new_dentry->name, name, A1FS_NAME_MAX);
-    new_dentry->name[A1FS_NAME_MAX - 1] = '\0';
-    p_inode->links += 1;
-    new_inode->links = 2;
-    new_inode->mode = mode | S_IFDIR;
     update_time_for_family(path);
     return 0;
 }
@@ -652,26 +416,19 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 static int a1fs_rmdir(const char *path)
 {
 	fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    a1fs_inode *file_inode;
-    find_inode_from_path(path, &file_inode);
-    if (file_inode->size != 0) return -ENOTEMPTY;
-    // We are going to remove the directory after checking
-    update_time_for_family(path);
+    // We are going to remove the directory, its parents are modified
     char p_path[A1FS_PATH_MAX];
     char name[A1FS_NAME_MAX];
     find_parent_path(path, p_path, name);
     a1fs_inode *p_inode;
-    find_inode_from_path(p_path, &p_inode);
-    p_inode->links -= 1;
-    a1fs_dentry *pos;
-    int order = find_dentry_from_inode(p_inode, &pos, name);
-    int ino = ((a1fs_dentry*)pos)->ino;
-    char* inode_bitmap = (char*) ((void*)sp + sp->inode_bitmap * A1FS_BLOCK_SIZE);
-    sp->inodes_count -= 1;
-    sp->free_inodes_count += 1;
-    free_bitmap(inode_bitmap, ino);
-    delete_data(p_inode, sizeof(a1fs_dentry) * order, sizeof(a1fs_dentry));
+    int result = find_inode_from_path(p_path, &p_inode);
+    if (result < 0) return result;
+    // nothing may find the inode while it is freed
+    dcache_remove(fs, path);
+    result = core_rmdir(fs, p_inode, name);
+    dcache_done(fs);
+    if (result < 0) return result;
+    update_time_for_family(p_path);
     return 0;
 }
 
@@ -691,35 +448,27 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    receives the file handle (see a1fs_open()).
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    if (sp->blocks_count > sp->max_block_count) return -ENOSPC;
     char p_path[A1FS_PATH_MAX]; // path to the parent of the file that required to be created
     char name[A1FS_NAME_MAX];   // name of the file
     find_parent_path(path, p_path, name);
     a1fs_inode* p_inode;
     a1fs_inode* new_inode;
-    a1fs_dentry* new_dentry;
-    find_inode_from_path(p_path, &p_inode);
-    int result = add_data(p_inode, (char**) &new_dentry, sizeof(a1fs_dentry));
+    int result = find_inode_from_path(p_path, &p_inode);
+    if (result < 0) return result;
+    // the path may be cached as missing
+    dcache_remove(fs, path);
+    result = core_mknod(fs, p_inode, name, mode | S_IFREG, &new_inode);
+    dcache_done(fs);
     if (result < 0) return result;
-    result = make_inode(&new_inode, new_dentry);
-    if (result < 0) {
-        delete_data(p_inode, p_inode->size - sizeof(a1fs_dentry), sizeof(a1fs_dentry));
-        return result;
-    }
-    strncpy(new_dentry->name, name, A1FS_NAME_MAX);
-    new_dentry->name[A1FS_NAME_MAX - 1] = '\0';
-    new_inode->links = 1;
-    new_inode->mode = mode | S_IFREG;
     update_time_for_family(path);
+    fi->fh = (uintptr_t)core_open(fs, new_inode);
     return 0;
 }
 
@@ -737,23 +486,18 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 static int a1fs_unlink(const char *path)
 {
 	fs_ctx *fs = get_fs();
-	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
-    update_time_for_family(path);
-    a1fs_inode *file_inode;
-    find_inode_from_path(path, &file_inode);
     char p_path[A1FS_PATH_MAX];
     char name[A1FS_NAME_MAX];
     find_parent_path(path, p_path, name);
     a1fs_inode* p_inode;
-    find_inode_from_path(p_path, &p_inode);
-    a1fs_dentry *pos;
-    int order = find_dentry_from_inode(p_inode, &pos, name);
-    int ino = pos->ino;
-    char* inode_bitmap = (char*) ((void*)sp + sp->inode_bitmap * A1FS_BLOCK_SIZE);
-    sp->inodes_count -= 1;
-    sp->free_inodes_count += 1;
-    free_bitmap(inode_bitmap, ino);
-    delete_data(p_inode, sizeof(a1fs_dentry) * order, sizeof(a1fs_dentry));
+    int result = find_inode_from_path(p_path, &p_inode);
+    if (result < 0) return result;
+    // nothing may find the inode while it is freed
+    dcache_remove(fs, path);
+    result = core_unlink(fs, p_inode, name);
+    dcache_done(fs);
+    if (result < 0) return result;
+    update_time_for_family(p_path);
     return 0;
 }
 
@@ -784,59 +528,28 @@ static int a1fs_unlink(const char *path)
  */
 static int a1fs_rename(const char *from, const char *to)
 {
-	//TODO: move the inode (file or directory) at given source path to the
-	// destination path, according to the description above
-    a1fs_inode *inode_from, *inode_to;
-    a1fs_dentry *dentry_from, *dentry_to;
+    fs_ctx *fs = get_fs();
     a1fs_inode *inode_parent_from, *inode_parent_to;
-    char path_parent_from[A1FS_PATH_MAX], dentry_name[A1FS_NAME_MAX];
-    char path_parent_to[A1FS_PATH_MAX];
+    char path_parent_from[A1FS_PATH_MAX], name_from[A1FS_NAME_MAX];
+    char path_parent_to[A1FS_PATH_MAX], name_to[A1FS_NAME_MAX];
     int result;
 
-    // find the orignial inode
-    result = find_inode_from_path(from, &inode_from);
-    if(result != 0 ){ return result;}
-
-    // find the orignial parent inode
-    find_parent_path(from, path_parent_from,dentry_name);
+    // find the orignial and the desternation parent inode
+    find_parent_path(from, path_parent_from, name_from);
     result = find_inode_from_path(path_parent_from, &inode_parent_from);
     if(result != 0 ){ return result;}
-
-    //find the dentry in orignial parent inode, free this dentry, copy it's info to new dentry
-    int from_order = find_dentry_from_inode(inode_parent_from, &dentry_from, dentry_name);
-
-    // find the desternation parent inode
-    find_parent_path(to, path_parent_to, dentry_name);
-    if (strcmp(path_parent_to, path_parent_from) == 0){
-        // if parent directory are same, only need to change the dentry's name
-        strcpy(dentry_from->name, dentry_name);
-        return 0;
-    }
-
-    // if parent directory are different, we need to move the file/dir
+    find_parent_path(to, path_parent_to, name_to);
     result = find_inode_from_path(path_parent_to, &inode_parent_to);
     if(result != 0 ){ return result;}
-    //find the dentry in desternation parent inode
-    find_dentry_from_inode(inode_parent_to, &dentry_to, dentry_name);
-    if(dentry_to){ 
-        result = find_inode_from_path(to, &inode_to);
-        if(result != 0 ){ return result;}
-        // remove dentry and inode in the path <to>
-        // create a new dentry
-        if(S_ISDIR(inode_to->mode)) { 
-            a1fs_rmdir(to);
-        }else { 
-            a1fs_unlink(to); 
-        }
-    }
 
-    //dentry does not exist, create a new dentry in parent_inode_tp
-    result = add_data(inode_parent_to, (char**) &dentry_to, sizeof(a1fs_dentry));
+    // cached paths below both names (including missing ones) become stale,
+    // and a replaced file is freed
+    dcache_invalidate(fs, from);
+    dcache_invalidate(fs, to);
+    result = core_rename(fs, inode_parent_from, name_from, inode_parent_to, name_to);
+    dcache_done(fs);
+    dcache_done(fs);
     if(result != 0 ){ return result;}
-    dentry_to->ino = dentry_from->ino;
-    strcpy(dentry_to->name, dentry_name);
-    delete_data(inode_parent_from, from_order * sizeof(a1fs_dentry), sizeof(a1fs_dentry));
-    inode_parent_from->links -= 1;
     update_time_for_family(path_parent_from);
     update_time_for_family(to);
     return 0;
@@ -864,15 +577,14 @@ static int a1fs_utimens(const char *path, const struct timespec tv[2])
     if(result != 0){ return result;}
     if(tv[1].tv_nsec == UTIME_NOW){ 
         // current time
-        clock_gettime(CLOCK_REALTIME, &inode->mtime);
+        core_set_mtime(get_fs(), inode, NULL);
         return 0;
     }else if (tv[1].tv_nsec == UTIME_OMIT){
         //igore time
         return 0;
     }
     // set time
-    inode->mtime.tv_sec = tv[1].tv_sec;
-    inode->mtime.tv_nsec = tv[1].tv_nsec;
+    core_set_mtime(get_fs(), inode, &tv[1]);
     return 0;
 }
 
@@ -897,22 +609,17 @@ static int a1fs_utimens(const char *path, const struct timespec tv[2])
  */
 static int a1fs_truncate(const char *path, off_t size)
 {
-	//TODO: set new file size, possibly "zeroing out" the uninitialized range
+	fs_ctx *fs = get_fs();
     a1fs_inode * inode;
     int result = find_inode_from_path(path, &inode);
     if(result != 0){ return result; }
     assert(S_ISREG(inode->mode));
-    if((uint64_t) size < inode->size){
-        // deallocate 
-        size_t remaning = inode->size - size;
-        delete_data(inode, size, remaning);
-    }else if((uint64_t) size> inode->size) {
-        // allocate space with 0s
-        size_t remaning = size - inode->size;
-        char *ptr;
-        int result = add_data(inode, &ptr, remaning);
-        if(result != 0){ return result;}
-    } else return 0;
+    // the size includes appends that are still buffered
+    struct stat st;
+    core_getattr(fs, inode, &st);
+    if (size == st.st_size) return 0;
+    result = core_truncate(fs, inode, size);
+    if(result != 0){ return result;}
     update_time_for_family(path);
 	return 0;
 }
@@ -933,43 +640,18 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      file handle set by a1fs_open().
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
-
-	//TODO: read data from the file at given offset into the buffer
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
     a1fs_inode* inode;
-    int result = find_inode_from_path(path, &inode);
+    a1fs_cursor *cursor;
+    int result = find_open_inode(path, fi, &inode, &cursor);
     if (result < 0) return result;
-    if ((uint64_t) offset > inode->size) return 0;
-    a1fs_extent *extent;
-    char *curr_ptr;
-    find_ptr_at_size(inode, offset, &curr_ptr, &extent);
-    // Now curr_ptr should point to the bit offset from the beginning
-    uint64_t buf_index = 0;
-    uint64_t byte_searched = 0;
-    // uint64_t cpy_amt_once;
-    while (buf_index < size && byte_searched < inode->size-offset) {
-        if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == curr_ptr) {
-            // the current extent is already searched completely
-            // Forward to the next extent
-            extent += 1;
-        }
-        buf[buf_index] = *curr_ptr;
-        buf_index += 1;
-        curr_ptr += 1;
-        byte_searched += 1;
-    }
-    for (uint64_t i=buf_index; i < size; i++) {
-        buf[i] = '\0'; 
-    }
-    return buf_index;
+    return core_read(fs, inode, cursor, buf, size, offset);
 }
 
 /**
@@ -987,56 +669,138 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset, str
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      file handle set by a1fs_open().
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
-	// write data from the buffer into the file at given offset, possibly
-    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    a1fs_inode* inode;
+    a1fs_cursor *cursor;
+    int result = find_open_inode(path, fi, &inode, &cursor);
+    if (result < 0) return result;
+    // core_write() updates the mtime of the file; its directories don't change
+    return core_write(fs, inode, cursor, buf, size, offset);
+}
+
+/**
+ * Open a file or directory.
+ *
+ * Implements the open() and opendir() system calls. The resolved inode and an
+ * extent cursor are kept in fi->fh, so that reads and writes through the file
+ * descriptor neither walk the path nor look up the extent where the previous
+ * request ended. If there is no memory for the handle, fi->fh is left 0 and
+ * the path is resolved on every request instead.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists.
+ *
+ * @param path  path to the file or directory to open.
+ * @param fi    receives the file handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
     a1fs_inode* inode;
     int result = find_inode_from_path(path, &inode);
     if (result < 0) return result;
-    // "zeroing out" the uninitialized range
-    a1fs_truncate(path, (size_t)offset + size);
+    fi->fh = (uintptr_t)core_open(fs, inode);
+    return 0;
+}
 
-    char *curr_ptr;
-    a1fs_extent * extent;
-    find_ptr_at_size(inode, offset, &curr_ptr, &extent);
-    size_t byte_written = 0;
-    // write one byte each time
-    while (byte_written < size) {
-        if ((char*) ((void*)sp + A1FS_BLOCK_SIZE * (extent->start + extent->count)) == curr_ptr) {
-            // Forward to the next extent
-            extent += 1;
-            curr_ptr = (char*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE);
-        }
-        *curr_ptr = buf[byte_written];
-        byte_written += 1;
-        curr_ptr += 1;
-    }
-    update_time_for_family(path);
-    return byte_written;
+/**
+ * Close a file or directory.
+ *
+ * Implements the last close() of a file descriptor, and closedir().
+ *
+ * @param path  unused.
+ * @param fi    file handle set by a1fs_open().
+ * @return      0.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	a1fs_handle *handle = (a1fs_handle*)(uintptr_t)fi->fh;
+	if (handle) core_release(get_fs(), handle);
+	return 0;
+}
+
+/**
+ * Write out the data of a file.
+ *
+ * Implements close() (flush). Appends are buffered in memory (see dalloc.h);
+ * this is where they get their blocks, so that close() can report that there
+ * is no space for them. With --sync, the changes to the file are also synced
+ * to disk, as by fsync().
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EIO     the data could not be written.
+ *
+ * @param path  path to the file.
+ * @param fi    file handle set by a1fs_open().
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+    a1fs_inode* inode;
+    a1fs_cursor *cursor;
+    int result = find_open_inode(path, fi, &inode, &cursor);
+    if (result < 0) return result;
+    return fs->opts->sync ? core_fsync(fs, inode) : core_flush(fs, inode);
+}
+
+/**
+ * Sync the changes to a file or directory to disk.
+ *
+ * Implements fsync() and, for a directory, fsyncdir(). Only the blocks the
+ * inode changed are synced, with the metadata (see dirty.h).
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EIO     the data could not be written.
+ *
+ * @param path      path to the file or directory.
+ * @param datasync  ignored; the metadata is needed to find the data anyway.
+ * @param fi        file handle set by a1fs_open().
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	a1fs_inode* inode;
+	a1fs_cursor *cursor;
+	int result = find_open_inode(path, fi, &inode, &cursor);
+	if (result < 0) return result;
+	return core_fsync(get_fs(), inode);
 }
 
 
 static struct fuse_operations a1fs_ops = {
-	.destroy  = a1fs_destroy, 
-	.statfs   = a1fs_statfs,
-	.getattr  = a1fs_getattr,
-	.readdir  = a1fs_readdir,
-	.mkdir    = a1fs_mkdir,
-	.rmdir    = a1fs_rmdir,
-	.create   = a1fs_create,
-	.unlink   = a1fs_unlink,
-	.rename   = a1fs_rename,
-	.utimens  = a1fs_utimens,
-	.truncate = a1fs_truncate,
-	.read     = a1fs_read,
-	.write    = a1fs_write,
+	.init       = a1fs_start,
+	.destroy    = a1fs_destroy, 
+	.statfs     = a1fs_statfs,
+	.getattr    = a1fs_getattr,
+	.readdir    = a1fs_readdir,
+	.mkdir      = a1fs_mkdir,
+	.rmdir      = a1fs_rmdir,
+	.create     = a1fs_create,
+	.unlink     = a1fs_unlink,
+	.rename     = a1fs_rename,
+	.utimens    = a1fs_utimens,
+	.truncate   = a1fs_truncate,
+	.read       = a1fs_read,
+	.write      = a1fs_write,
+	.open       = a1fs_open,
+	.release    = a1fs_release,
+	.flush      = a1fs_flush,
+	.fsync      = a1fs_fsync,
+	.opendir    = a1fs_open,
+	.releasedir = a1fs_release,
+	.fsyncdir   = a1fs_fsync,
 };
 
 int main(int argc, char *argv[])
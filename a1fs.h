@@ -19,6 +19,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -44,12 +45,27 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/** Directories use compact variable-length records (a1fs_cdentry) instead of a1fs_dentry. */
+#define A1FS_FEATURE_COMPACT_DIRS 0x1
+/** Large directories have an on-disk name index (a1fs_hnode); a1fs_inode::dir_index is valid. */
+#define A1FS_FEATURE_DIR_INDEX 0x2
+/** a1fs_inode::extent_depth is valid; set on every image when it is mounted (see extree.h). */
+#define A1FS_FEATURE_EXTENT_TREE 0x4
+/** Inodes are inode_size bytes and small files keep their data in them, see a1fs_inode. */
+#define A1FS_FEATURE_INLINE_DATA 0x8
+/** Only the first itable_zeroed blocks of the inode table are zeroed; the rest are zeroed as inodes get there. */
+#define A1FS_FEATURE_LAZY_ITABLE 0x10
+/** The image is divided into block groups with their own bitmaps and inode tables, see a1fs_group_desc. */
+#define A1FS_FEATURE_BLOCK_GROUPS 0x20
+/** Metadata changes go through a write-ahead journal first, see a1fs_journal_super. */
+#define A1FS_FEATURE_JOURNAL 0x40
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	uint64_t 	magic;					/** Must match A1FS_MAGIC. */
 	uint64_t 	size;					/** File system size in bytes. */
 	a1fs_blk_t 	first_data_block; 		/* Block Number(Pointer) to First Data Block excluding superblock, bitmaps and inode table*/
-	uint32_t 	inode_size;        		/* size of inode structure */
+	uint32_t 	inode_size;        		/* size of an inode table slot; sizeof(a1fs_inode) unless A1FS_FEATURE_INLINE_DATA */
 	uint32_t 	state;             		/* File system state */
 	a1fs_blk_t 	block_bitmap;      		/* Block Number(Pointer) to Blocks bitmap block */
 	a1fs_blk_t 	inode_bitmap;      		/* Block Number(Pointer) to Inodes bitmap block */
@@ -60,6 +76,14 @@ typedef struct a1fs_superblock {
 	uint32_t 	free_inodes_count; 		/* Free inodes count */
 	size_t 		max_inodes_count;    	/* Maximum inodes count */
 	size_t 		max_block_count;
+	uint32_t 	features;				/* Optional format features, see A1FS_FEATURE_* */
+	uint32_t 	itable_zeroed;			/* Number of leading inode table blocks that are zeroed, if A1FS_FEATURE_LAZY_ITABLE */
+	uint32_t 	blocks_per_group;		/* Blocks in a group (the last one may have fewer), if A1FS_FEATURE_BLOCK_GROUPS */
+	uint32_t 	inodes_per_group;		/* Inodes in a group, if A1FS_FEATURE_BLOCK_GROUPS */
+	uint32_t 	groups_count;			/* Number of groups, if A1FS_FEATURE_BLOCK_GROUPS */
+	a1fs_blk_t 	group_desc;				/* Block Number(Pointer) to the group descriptor table, if A1FS_FEATURE_BLOCK_GROUPS */
+	a1fs_blk_t 	journal_start;			/* Block Number(Pointer) to the journal superblock, if A1FS_FEATURE_JOURNAL */
+	uint32_t 	journal_blocks;			/* Number of blocks of the journal, its superblock included, if A1FS_FEATURE_JOURNAL */
 	// below are not used
 	// struct timespec mtime;           /* Mount time */
 	// struct timespec wtime;          	/* Write time */
@@ -71,14 +95,111 @@ static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
 
+/**
+ * Block group descriptor.
+ *
+ * With A1FS_FEATURE_BLOCK_GROUPS, group g is the blocks_per_group blocks from
+ * block g * blocks_per_group on, and inodes g * inodes_per_group onwards. It
+ * starts with its block bitmap (one bit for each block of the group), its
+ * inode bitmap and its inode table; group 0 has the superblock and the
+ * descriptor table before them. The superblock points to the ones of group 0.
+ */
+typedef struct a1fs_group_desc {
+	a1fs_blk_t 	block_bitmap;			/* Block Number(Pointer) to the block bitmap of the group */
+	a1fs_blk_t 	inode_bitmap;			/* Block Number(Pointer) to the inode bitmap of the group */
+	a1fs_blk_t 	inode_table;			/* Block Number(Pointer) to the inode table of the group */
+	uint32_t 	free_blocks_count;		/* Free blocks count */
+	uint32_t 	free_inodes_count;		/* Free inodes count */
+	uint32_t 	itable_zeroed;			/* Number of leading inode table blocks that are zeroed, if A1FS_FEATURE_LAZY_ITABLE */
+	uint32_t 	padding[2];
+} a1fs_group_desc;
+
+/** Most blocks in a group: as many as one bitmap block has bits. */
+#define A1FS_MAX_GROUP_BLOCKS (A1FS_BLOCK_SIZE * 8)
+
+static_assert(sizeof(a1fs_group_desc) == 32, "invalid group descriptor size");
+
+
+/** Magic value of the journal superblock and of every journal record header. */
+#define A1FS_JOURNAL_MAGIC 0xA1F5104A0C5C369Aul
+
+/**
+ * Journal superblock, the first of the journal_blocks blocks from
+ * journal_start on, with A1FS_FEATURE_JOURNAL.
+ *
+ * The rest of the journal is a circular log of transactions; a log offset n
+ * is block journal_start + 1 + n % (journal_blocks - 1). A transaction is one
+ * or more descriptor blocks, each followed by the copies of the blocks it
+ * lists, and a commit block; every header of a transaction has its sequence
+ * number, and each transaction has the number after the one before. The
+ * transactions from head on, up to the first one that is missing or torn,
+ * are copied to their blocks when the image is mounted (see journal.h).
+ */
+typedef struct a1fs_journal_super {
+	uint64_t 	magic;					/* Must match A1FS_JOURNAL_MAGIC */
+	uint64_t 	head;					/* Log offset of the first transaction not yet written in place */
+	uint64_t 	head_seq;				/* Sequence number of that transaction */
+} a1fs_journal_super;
+
+/** Type of a journal block that lists the blocks of a transaction. */
+#define A1FS_JOURNAL_DESC 1
+/** Type of the journal block that ends a transaction. */
+#define A1FS_JOURNAL_COMMIT 2
+
+/** Header of a journal descriptor or commit block. */
+typedef struct a1fs_journal_header {
+	uint64_t 	magic;					/* Must match A1FS_JOURNAL_MAGIC */
+	uint64_t 	seq;					/* Sequence number of the transaction */
+	uint32_t 	type;					/* A1FS_JOURNAL_DESC or A1FS_JOURNAL_COMMIT */
+	uint32_t 	count;					/* Descriptor: number of block copies after it; commit: number of log blocks before it */
+	uint32_t 	revokes;				/* Descriptor: number of revoked blocks listed after the copied ones */
+	uint32_t 	checksum;				/* Commit: checksum of the log blocks before it, see journal.c */
+	/**
+	 * Descriptor: the blocks the copies go to, then the revoked blocks, whose
+	 * copies in this and earlier transactions must not be written: they were
+	 * freed, and may hold file data by now.
+	 */
+	a1fs_blk_t 	blocks[];
+} a1fs_journal_header;
+
+/** Number of blocks a journal descriptor lists. */
+#define A1FS_JOURNAL_ENTRIES ((A1FS_BLOCK_SIZE - sizeof(a1fs_journal_header)) / sizeof(a1fs_blk_t))
+
+static_assert(sizeof(a1fs_journal_header) == 32, "invalid journal header size");
+
+
 /** Extent - a contiguous range of blocks. */
 typedef struct a1fs_extent {
 	a1fs_blk_t start;	/** Starting block of the extent. */
 	a1fs_blk_t count;	/** Number of blocks in the extent. */
 } a1fs_extent;
 
+/** Maximum number of direct extents in the indirect extent block. */
+#define A1FS_MAX_EXTENTS (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
 
-/** a1fs inode. */
+/**
+ * Entry of an index node of an extent tree (see extree.h): a child node and
+ * the first logical block of the file it maps.
+ */
+typedef struct a1fs_extent_index {
+	a1fs_blk_t lblk;	/** First logical block mapped by the child. */
+	a1fs_blk_t child;	/** Block of the child node. */
+} a1fs_extent_index;
+
+/** Number of children of an extent tree index node. */
+#define A1FS_EXTENT_FANOUT (A1FS_BLOCK_SIZE / sizeof(a1fs_extent_index))
+
+static_assert(A1FS_EXTENT_FANOUT == A1FS_MAX_EXTENTS, "invalid extent index size");
+
+
+/**
+ * a1fs inode.
+ *
+ * Inodes are sp->inode_size bytes apart in the inode table. With
+ * A1FS_FEATURE_INLINE_DATA, that is more than sizeof(a1fs_inode), and a file or
+ * directory with no blocks keeps its data, up to the rest of the slot, right
+ * after the inode instead. It moves to a data block once it grows past that.
+ */
 typedef struct a1fs_inode {
 	/** File mode. */
 	mode_t mode;
@@ -94,15 +215,25 @@ typedef struct a1fs_inode {
 	
 	/**
 	 * This is an indirect extent
-	 * It points to a block containing direct extents.
+	 * It points to a block containing direct extents, or to the root index
+	 * node of an extent tree if extent_depth is not 0.
 	 * */
     struct a1fs_extent extents;
 
     /* total number of blocks used by this inode */
 	uint32_t blocks; 
 
+	/* number of direct extents in use in the indirect extent block, or in all leaves of the extent tree */
+	uint32_t extent_count;
+
+	/* root block of the on-disk name index of a directory, 0 if it has none (see htree.h) */
+	a1fs_blk_t dir_index;
+
+	/* number of index levels above the direct extents; 0 for a single indirect extent block */
+	uint32_t extent_depth;
+
 	/* padding at the end of the struct in order to satisfy the assertion below. */
-	char padding[16]; // make the struct 64 bytes
+	char padding[4]; // make the struct 64 bytes
 
 	// blew are not used
 	// struct timespec   i_atime;      /* Access time */
@@ -124,9 +255,9 @@ static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 /** Maximum file path length. Includes the null terminator. */
 #define A1FS_PATH_MAX PATH_MAX
 
-/** Fixed size directory entry structure. */
+/** Fixed size directory entry structure. An entry with inode number 0 is unused; the last one is always used. */
 typedef struct a1fs_dentry {
-	/** Inode number. */
+	/** Inode number; 0 if the entry is unused. */
 	a1fs_ino_t ino;
 	/** File name. A null-terminated string. */
 	char name[A1FS_NAME_MAX];
@@ -134,3 +265,83 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+
+/**
+ * Variable-length directory entry, used when the superblock has
+ * A1FS_FEATURE_COMPACT_DIRS.
+ *
+ * Records are 4-byte aligned and never cross a block boundary. The record
+ * length covers any slack up to the next record, so the records of a block
+ * add up to exactly one block; inline records (see a1fs_inode) add up to the
+ * size of the directory. A record with inode number 0 is unused; only
+ * the first record of a block can be unused, any other record that is removed
+ * is merged into the one before it. A block may be left without entries,
+ * but the last block of a directory holds at least one, so an empty directory
+ * has size 0 in both formats.
+ */
+typedef struct a1fs_cdentry {
+	/** Inode number; 0 if the record is unused. */
+	a1fs_ino_t ino;
+	/** Length of the record in bytes, including the slack after the name. */
+	uint16_t rec_len;
+	/** Length of the name, not including the null terminator. */
+	uint8_t name_len;
+	/** Unused. */
+	uint8_t pad;
+	/** File name. A null-terminated string. */
+	char name[];
+
+} a1fs_cdentry;
+
+/** Smallest record that holds a name of name_len characters. */
+#define A1FS_CDENTRY_LEN(name_len) ((sizeof(a1fs_cdentry) + (name_len) + 1 + 3) & ~(size_t)3)
+
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX && A1FS_CDENTRY_LEN(A1FS_NAME_MAX - 1) <= A1FS_BLOCK_SIZE,
+              "invalid compact dentry size");
+
+
+/** Key of an on-disk directory index entry: name hash, then position of the entry. */
+typedef struct a1fs_hkey {
+	/** Hash of the entry name, see dindex_hash(). */
+	uint32_t hash;
+	/** Byte offset of the entry record in the directory. */
+	uint32_t pos;
+
+} a1fs_hkey;
+
+/** Number of keys in an index leaf. */
+#define A1FS_HNODE_KEYS ((A1FS_BLOCK_SIZE - 8) / sizeof(a1fs_hkey))
+
+/** Number of children of an inner index node. */
+#define A1FS_HNODE_CHILDREN ((A1FS_BLOCK_SIZE - 8) / (sizeof(a1fs_hkey) + sizeof(a1fs_blk_t)))
+
+/**
+ * One block of the on-disk name index of a directory, a B+tree of a1fs_hkey,
+ * used when the superblock has A1FS_FEATURE_DIR_INDEX.
+ *
+ * Keys are ordered by hash, then by position. Child i of an inner node holds
+ * the keys from children[i].key up to children[i + 1].key; the key of the
+ * first child is not used. Leaves are linked in key order, so the keys with
+ * the same hash can be walked across leaves.
+ */
+typedef struct a1fs_hnode {
+	/** Height of the node above the leaves; 0 for a leaf. */
+	uint16_t level;
+	/** Number of keys or children in use. */
+	uint16_t count;
+	/** Leaves: the next leaf; 0 for the last one. */
+	a1fs_blk_t next;
+	union {
+		/** Leaves: the keys, sorted. */
+		a1fs_hkey keys[A1FS_HNODE_KEYS];
+		/** Inner nodes: the children, sorted by key. */
+		struct {
+			a1fs_hkey key;
+			a1fs_blk_t child;
+		} children[A1FS_HNODE_CHILDREN];
+	};
+
+} a1fs_hnode;
+
+static_assert(sizeof(a1fs_hnode) <= A1FS_BLOCK_SIZE, "invalid index node size");
@@ -0,0 +1,570 @@
+/**
+ * a1fs driver using the FUSE low-level API.
+ *
+ * Requests name files by inode number (a parent directory inode and a name for
+ * lookups), so unlike a1fs.c no path is ever resolved again. The kernel caches
+ * the entries and attributes we reply with for A1FS_LL_TIMEOUT seconds.
+ *
+ * Every inode returned by lookup(), mkdir() or create() is referenced by the
+ * kernel until it sends forget(). An inode that is unlinked while referenced
+ * stays allocated until its last reference is forgotten (see fs_core.h).
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "fs_core.h"
+#include "options.h"
+#include "bdev.h"
+#include "dirty.h"
+#include "journal.h"
+
+/**
+ * Number of seconds the kernel may cache entries and attributes.
+ * Nothing but this driver modifies a mounted image.
+ */
+#define A1FS_LL_TIMEOUT 1.0
+
+
+/**
+ * Initialize the file system.
+ *
+ * NOTE: we are not using the FUSE init() callback since it doesn't support
+ * returning errors. This function must be called explicitly before the session
+ * is created.
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
+{
+	// Nothing to initialize if only printing help or version
+	if (opts->help || opts->version) return true;
+
+	fs->bdev = bdev_open(opts->img_path, opts);
+	if (!fs->bdev) return false;
+
+	return fs_ctx_init(fs, fs->bdev->image, fs->bdev->size, opts);
+}
+
+/**
+ * Start the background flusher (see dirty.h), and finish setting up the I/O
+ * backend (see bdev.h).
+ *
+ * Called once the session runs, after it has daemonized; a thread started in
+ * a1fs_init() would not survive the fork, and /proc/self/pagemap opened there
+ * would describe the parent.
+ */
+static void a1fs_ll_start(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)conn;// unused
+	fs_ctx *fs = (fs_ctx*)userdata;
+	if (fs->image) bdev_start(fs->bdev);
+	if (fs->image && !dirty_start_flusher(fs)) {
+		fprintf(stderr, "Failed to start the flusher, changes are synced by fsync() only\n");
+	}
+}
+
+/**
+ * Cleanup the file system.
+ *
+ * Called when the file system is unmounted. The kernel does not forget the
+ * inodes it still references, so unlinked inodes are freed here.
+ */
+static void a1fs_ll_destroy(void *userdata)
+{
+	fs_ctx *fs = (fs_ctx*)userdata;
+	if (fs->image) {
+		dirty_stop_flusher(fs);
+		core_forget_all(fs);
+		core_flush_all(fs);
+		// a clean unmount leaves nothing to replay
+		if (fs->journal && journal_checkpoint(fs) < 0) {
+			fprintf(stderr, "Failed to checkpoint the journal\n");
+		}
+		if (bdev_close(fs->bdev, fs->opts->sync) < 0) {
+			fprintf(stderr, "Failed to write the image\n");
+		}
+		fs->bdev = NULL;
+		fs_ctx_destroy(fs);
+	}
+}
+
+/** Get file system context. */
+static fs_ctx *get_fs(fuse_req_t req)
+{
+	return (fs_ctx*)fuse_req_userdata(req);
+}
+
+/** Get the extent cursor of the handle in fi; NULL if there is no handle. */
+static a1fs_cursor *get_cursor(struct fuse_file_info *fi)
+{
+	a1fs_handle *handle = fi ? (a1fs_handle*)(uintptr_t)fi->fh : NULL;
+	return handle ? &handle->cursor : NULL;
+}
+
+/** Reply with inode as a new entry; core_lookup() or core_mknod() counted the reference. */
+static void reply_entry(fuse_req_t req, a1fs_inode *inode, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = get_ino(fs, inode);
+	e.attr_timeout = A1FS_LL_TIMEOUT;
+	e.entry_timeout = A1FS_LL_TIMEOUT;
+	core_getattr(fs, inode, &e.attr);
+	if (fi) {
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+
+/**
+ * Look up a directory entry by name.
+ *
+ * A missing entry is replied as a negative entry, so the kernel also caches
+ * that the name does not exist.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name is too long.
+ */
+static void a1fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_inode *inode;
+	int result = core_lookup(fs, get_inode(fs, parent), name, &inode);
+	if (result == -ENOENT) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = A1FS_LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	reply_entry(req, inode, NULL);
+}
+
+/** Drop nlookup kernel references to inode ino. */
+static void a1fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	core_forget(get_fs(req), ino, nlookup);
+	fuse_reply_none(req);
+}
+
+/** Drop kernel references to several inodes. */
+static void a1fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	fs_ctx *fs = get_fs(req);
+	for (size_t i = 0; i < count; i++) {
+		core_forget(fs, forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+/**
+ * Get file or directory attributes.
+ *
+ * Implements the stat() system call.
+ */
+static void a1fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	struct stat st;
+	core_getattr(fs, get_inode(fs, ino), &st);
+	fuse_reply_attr(req, &st, A1FS_LL_TIMEOUT);
+}
+
+/**
+ * Change the size or the modification time of a file or directory.
+ *
+ * Implements the truncate() and utimensat() system calls. Like a1fs.c, only
+ * the size and mtime can be set.
+ *
+ * Errors:
+ *   ENOSYS  changing the mode or owner is not supported.
+ *   EISDIR  the size of a directory can't be changed.
+ *   ENOSPC  not enough free space in the file system.
+ */
+static void a1fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_inode *inode = get_inode(fs, ino);
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (S_ISDIR(inode->mode)) {
+			fuse_reply_err(req, EISDIR);
+			return;
+		}
+		int result = core_truncate(fs, inode, attr->st_size);
+		if (result < 0) {
+			fuse_reply_err(req, -result);
+			return;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+		core_set_mtime(fs, inode, (to_set & FUSE_SET_ATTR_MTIME_NOW) ? NULL : &attr->st_mtim);
+	}
+	struct stat st;
+	core_getattr(fs, inode, &st);
+	fuse_reply_attr(req, &st, A1FS_LL_TIMEOUT);
+}
+
+
+/** Buffer that a1fs_ll_readdir() fills with directory entries. */
+typedef struct ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} ll_dirbuf;
+
+/**
+ * Add an entry to db; off is the offset of the entry that follows it.
+ * Return non-zero if db is full.
+ */
+static int dirbuf_add(ll_dirbuf *db, const char *name, a1fs_ino_t ino, mode_t mode, off_t off)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, &st, off);
+	if (len > db->size - db->used) return 1;
+	db->used += len;
+	return 0;
+}
+
+/** Add one directory entry to the ll_dirbuf in buf. */
+static int dirbuf_fill(void *buf, const a1fs_dirent *dirent)
+{
+	ll_dirbuf *db = (ll_dirbuf*)buf;
+	a1fs_inode *inode = get_inode(get_fs(db->req), dirent->ino);
+	// offsets 1 and 2 follow "." and ".."
+	return dirbuf_add(db, dirent->name, dirent->ino, inode->mode, (off_t)dirent->next + 2);
+}
+
+/**
+ * Read a directory.
+ *
+ * Replies with as many entries starting at off as fit in size bytes. Offset 0
+ * is ".", 1 is "..", and n + 2 is the entry at position n (see dir.h).
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void a1fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	ll_dirbuf db = { req, malloc(size), size, 0 };
+	if (!db.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	// the parent of a directory is not recorded; the kernel resolves ".." itself
+	int full = 0;
+	if (off < 1) full = dirbuf_add(&db, ".", ino, S_IFDIR, 1);
+	if (!full && off < 2) full = dirbuf_add(&db, "..", ino, S_IFDIR, 2);
+	if (!full) core_readdir(fs, get_inode(fs, ino), get_cursor(fi), off < 2 ? 0 : off - 2, dirbuf_fill, &db);
+	fuse_reply_buf(req, db.buf, db.used);
+	free(db.buf);
+}
+
+/**
+ * Create a directory.
+ *
+ * Implements the mkdir() system call.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name is too long.
+ *   ENOSPC        not enough free space in the file system.
+ */
+static void a1fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_inode *inode;
+	int result = core_mknod(fs, get_inode(fs, parent), name, mode | S_IFDIR, &inode);
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	reply_entry(req, inode, NULL);
+}
+
+/**
+ * Remove a directory.
+ *
+ * Implements the rmdir() system call.
+ *
+ * Errors:
+ *   ENOTEMPTY  the directory is not empty.
+ */
+static void a1fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_ctx *fs = get_fs(req);
+	fuse_reply_err(req, -core_rmdir(fs, get_inode(fs, parent), name));
+}
+
+/**
+ * Create and open a file.
+ *
+ * Implements the open()/creat() system call.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name is too long.
+ *   ENOSPC        not enough free space in the file system.
+ */
+static void a1fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_inode *inode;
+	int result = core_mknod(fs, get_inode(fs, parent), name, (mode & ~S_IFMT) | S_IFREG, &inode);
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fi->fh = (uintptr_t)core_open(fs, inode);
+	reply_entry(req, inode, fi);
+}
+
+/**
+ * Remove a file.
+ *
+ * Implements the unlink() system call.
+ */
+static void a1fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_ctx *fs = get_fs(req);
+	fuse_reply_err(req, -core_unlink(fs, get_inode(fs, parent), name));
+}
+
+/**
+ * Rename a file or directory.
+ *
+ * Implements the rename() system call.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the new name is too long.
+ *   ENOTEMPTY     destination is a non-empty directory.
+ *   ENOSPC        not enough free space in the file system.
+ */
+static void a1fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname)
+{
+	fs_ctx *fs = get_fs(req);
+	fuse_reply_err(req, -core_rename(fs, get_inode(fs, parent), name,
+	                                 get_inode(fs, newparent), newname));
+}
+
+/**
+ * Read data from a file.
+ *
+ * Implements the pread() system call. Replies with fewer bytes than
+ * requested only at EOF.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory.
+ */
+static void a1fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	char *buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int result = core_read(fs, get_inode(fs, ino), get_cursor(fi), buf, size, off);
+	fuse_reply_buf(req, buf, result);
+	free(buf);
+}
+
+/**
+ * Write data to a file.
+ *
+ * Implements the pwrite() system call.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ */
+static void a1fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	int result = core_write(fs, get_inode(fs, ino), get_cursor(fi), buf, size, off);
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_write(req, result);
+}
+
+/**
+ * Open a file or directory.
+ *
+ * Implements the open() and opendir() system calls. The handle in fi->fh
+ * keeps an extent cursor, so that sequential reads and writes resume from
+ * the extent where the previous request ended. If there is no memory for the
+ * handle, fi->fh is left 0 and requests go without a cursor.
+ */
+static void a1fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	fi->fh = (uintptr_t)core_open(fs, get_inode(fs, ino));
+	fuse_reply_open(req, fi);
+}
+
+/**
+ * Close a file or directory.
+ *
+ * Implements the last close() of a file descriptor, and closedir().
+ */
+static void a1fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	a1fs_handle *handle = (a1fs_handle*)(uintptr_t)fi->fh;
+	if (handle) core_release(get_fs(req), handle);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * Write out the data of a file.
+ *
+ * Implements close() (flush). Appends are buffered in memory (see dalloc.h)
+ * and get their blocks here, so that close() can report that there is no
+ * space for them. With --sync, the changes to the file are also synced to
+ * disk, as by fsync().
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EIO     the data could not be written.
+ */
+static void a1fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_inode *inode = get_inode(fs, ino);
+	fuse_reply_err(req, -(fs->opts->sync ? core_fsync(fs, inode) : core_flush(fs, inode)));
+}
+
+/**
+ * Sync the changes to a file or directory to disk.
+ *
+ * Implements fsync() and, for a directory, fsyncdir(). Only the blocks the
+ * inode changed are synced, with the metadata (see dirty.h); datasync is
+ * ignored, since the metadata is needed to find the data anyway.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EIO     the data could not be written.
+ */
+static void a1fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	fuse_reply_err(req, -core_fsync(fs, get_inode(fs, ino)));
+}
+
+/**
+ * Get file system statistics.
+ *
+ * Implements the statvfs() system call.
+ */
+static void a1fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino;// unused
+	struct statvfs st;
+	core_statfs(get_fs(req), &st);
+	fuse_reply_statfs(req, &st);
+}
+
+
+static struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init         = a1fs_ll_start,
+	.destroy      = a1fs_ll_destroy,
+	.lookup       = a1fs_ll_lookup,
+	.forget       = a1fs_ll_forget,
+	.forget_multi = a1fs_ll_forget_multi,
+	.getattr      = a1fs_ll_getattr,
+	.setattr      = a1fs_ll_setattr,
+	.readdir      = a1fs_ll_readdir,
+	.mkdir        = a1fs_ll_mkdir,
+	.rmdir        = a1fs_ll_rmdir,
+	.create       = a1fs_ll_create,
+	.unlink       = a1fs_ll_unlink,
+	.rename       = a1fs_ll_rename,
+	.read         = a1fs_ll_read,
+	.write        = a1fs_ll_write,
+	.statfs       = a1fs_ll_statfs,
+	.open         = a1fs_ll_open,
+	.release      = a1fs_ll_release,
+	.flush        = a1fs_ll_flush,
+	.fsync        = a1fs_ll_fsync,
+	.opendir      = a1fs_ll_open,
+	.releasedir   = a1fs_ll_release,
+	.fsyncdir     = a1fs_ll_fsync,
+};
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0};// defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts)) return 1;
+
+	fs_ctx fs = {0};
+	if (!a1fs_init(&fs, &opts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	// count kernel references, so that unlinked inodes live until forgotten
+	fs.track_lookups = true;
+
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0) return 1;
+	if (opts.help || opts.version) return 0;
+
+	int err = 1;
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	if (ch) {
+		struct fuse_session *se = fuse_lowlevel_new(&args, &a1fs_ll_ops, sizeof(a1fs_ll_ops), &fs);
+		if (se) {
+			if ((fuse_daemonize(foreground) != -1) && (fuse_set_signal_handlers(se) != -1)) {
+				fuse_session_add_chan(se, ch);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "map.h"
+
+
+/** Cache size when the --cache option is not given, in MiB. */
+#define A1FS_DEFAULT_CACHE_MB 256
+/** Flush interval of the pwrite backend when the --flush option is not given, in ms. */
+#define A1FS_PWRITE_FLUSH_MS 5000
+/** Number of writes the uring backend submits at once. */
+#define A1FS_URING_ENTRIES 64
+
+
+static int mmap_sync(a1fs_bdev *bd, size_t from, size_t to){
+	return msync((char*)bd->image + from, to - from, MS_SYNC) < 0 ? -errno : 0;
+}
+
+static const a1fs_bdev_ops mmap_ops = {
+	.name = "mmap",
+	.map_flags = MAP_SHARED,
+	.sync = mmap_sync,
+	.release = NULL,
+	.ring = false,
+};
+
+
+/** Write bytes [from, to) of the image to the file, without syncing it. */
+static int write_range(a1fs_bdev *bd, size_t from, size_t to){
+	while (from < to){
+		ssize_t written = pwrite(bd->fd, (char*)bd->image + from, to - from, from);
+		if (written < 0){
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		from += written;
+	}
+	return 0;
+}
+
+/** Count the pages [first, end) as written, and drop their private copies if drop is set. */
+static int written(a1fs_bdev *bd, size_t first, size_t end, bool drop){
+	bd->written_pages += end - first;
+	// the file has what they hold; the next access reads it back
+	if (drop){
+		if (madvise((char*)bd->image + first * bd->page, (end - first) * bd->page, MADV_DONTNEED) < 0) return -errno;
+		bd->released_pages += end - first;
+	}
+	return 0;
+}
+
+/** Wait for the writes queued on the ring, then count them as written(). */
+static int flush_ring(a1fs_bdev *bd, bool drop){
+	int result = uring_wait(bd->ring);
+	for (size_t i = 0; i < bd->queued && result == 0; i++){
+		result = written(bd, bd->queue[i][0], bd->queue[i][1], drop);
+	}
+	bd->queued = 0;
+	return result;
+}
+
+/**
+ * Write the pages [first, end) to the file, and drop their private copies if
+ * drop is set. With a ring, the write is only queued; flush_ring() finishes it.
+ */
+static int write_pages(a1fs_bdev *bd, size_t first, size_t end, bool drop){
+	size_t page = bd->page;
+	size_t from = first * page, to = end * page < bd->size ? end * page : bd->size;
+	if (bd->ring){
+		if (uring_full(bd->ring) || bd->queued == A1FS_URING_ENTRIES){
+			int result = flush_ring(bd, drop);
+			if (result < 0) return result;
+		}
+		uring_write(bd->ring, bd->fd, (char*)bd->image + from, to - from, from);
+		bd->queue[bd->queued][0] = first;
+		bd->queue[bd->queued][1] = end;
+		bd->queued += 1;
+		return 0;
+	}
+	int result = write_range(bd, from, to);
+	return result < 0 ? result : written(bd, first, end, drop);
+}
+
+/**
+ * Bits of a /proc/self/pagemap entry: the page is present, or swapped out,
+ * and it is backed by the file, rather than a private copy.
+ */
+#define PAGEMAP_PRESENT (1ull << 63)
+#define PAGEMAP_SWAPPED (1ull << 62)
+#define PAGEMAP_FILE    (1ull << 61)
+
+/**
+ * Write the pages of [first, end) that have private copies, the only ones
+ * that may have changed, and drop the copies if drop is set. Every page is
+ * written if the page map can't tell which ones they are.
+ */
+static int write_private(a1fs_bdev *bd, size_t first, size_t end, bool drop){
+	if (bd->pagemap < 0) return write_pages(bd, first, end, drop);
+	uint64_t entries[512];
+	// start of the run of private pages being found; end if there is none
+	size_t run = end;
+	for (size_t p = first; p < end;){
+		size_t count = end - p < 512 ? end - p : 512;
+		off_t at = ((uintptr_t)bd->image / bd->page + p) * sizeof(uint64_t);
+		if (pread(bd->pagemap, entries, count * sizeof(uint64_t), at) != (ssize_t)(count * sizeof(uint64_t))){
+			// write whatever is left
+			return write_pages(bd, run < p ? run : p, end, drop);
+		}
+		for (size_t i = 0; i < count; i++){
+			bool private = (entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) && !(entries[i] & PAGEMAP_FILE);
+			if (private && run == end){
+				run = p + i;
+			} else if (!private && run != end){
+				int result = write_pages(bd, run, p + i, drop);
+				if (result < 0) return result;
+				run = end;
+			}
+		}
+		p += count;
+	}
+	return run != end ? write_pages(bd, run, end, drop) : 0;
+}
+
+/** write_private(), and wait for the writes if they went on the ring. */
+static int write_all_private(a1fs_bdev *bd, size_t first, size_t end, bool drop){
+	int result = write_private(bd, first, end, drop);
+	if (bd->ring){
+		// the queued writes read the image, so they are waited for even on failure
+		int flushed = flush_ring(bd, drop && result == 0);
+		if (result == 0) result = flushed;
+	}
+	return result;
+}
+
+static int pwrite_sync(a1fs_bdev *bd, size_t from, size_t to){
+	pthread_mutex_lock(&bd->lock);
+	uint64_t written = bd->written_pages;
+	int result = write_all_private(bd, from / bd->page, (to + bd->page - 1) / bd->page, false);
+	bd->cached += bd->written_pages - written;
+	pthread_mutex_unlock(&bd->lock);
+	if (result == 0 && fdatasync(bd->fd) < 0) result = -errno;
+	return result;
+}
+
+static int pwrite_release(a1fs_bdev *bd){
+	pthread_mutex_lock(&bd->lock);
+	int result = write_all_private(bd, 0, (bd->size + bd->page - 1) / bd->page, true);
+	if (result == 0) bd->cached = 0;
+	pthread_mutex_unlock(&bd->lock);
+	if (result == 0 && fdatasync(bd->fd) < 0) result = -errno;
+	return result;
+}
+
+static const a1fs_bdev_ops pwrite_ops = {
+	.name = "pwrite",
+	.map_flags = MAP_PRIVATE,
+	.sync = pwrite_sync,
+	.release = pwrite_release,
+	.ring = false,
+};
+
+static const a1fs_bdev_ops uring_ops = {
+	.name = "uring",
+	.map_flags = MAP_PRIVATE,
+	.sync = pwrite_sync,
+	.release = pwrite_release,
+	.ring = true,
+};
+
+
+static const a1fs_bdev_ops *const backends[] = { &mmap_ops, &pwrite_ops, &uring_ops };
+
+a1fs_bdev *bdev_open(const char *path, a1fs_opts *opts){
+	const a1fs_bdev_ops *ops = NULL;
+	const char *name = opts->io ? opts->io : mmap_ops.name;
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++){
+		if (strcmp(backends[i]->name, name) == 0) ops = backends[i];
+	}
+	if (!ops){
+		fprintf(stderr, "Unknown I/O backend %s\n", name);
+		return NULL;
+	}
+	a1fs_bdev *bd = calloc(1, sizeof(a1fs_bdev));
+	if (!bd) return NULL;
+	bd->ops = ops;
+	bd->fd = -1;
+	bd->page = sysconf(_SC_PAGESIZE);
+	bd->pagemap = -1;
+	bd->image = map_file_fd(path, A1FS_BLOCK_SIZE, &bd->size, ops->map_flags, &bd->fd);
+	// only journal checkpoints drop the private copies
+	if (bd->image && ops->release && bd->size >= A1FS_BLOCK_SIZE &&
+	    !(((a1fs_superblock*)bd->image)->features & A1FS_FEATURE_JOURNAL)){
+		fprintf(stderr, "The %s I/O backend needs an image with a journal (mkfs.a1fs -j)\n", ops->name);
+		munmap(bd->image, bd->size);
+		close(bd->fd);
+		bd->image = NULL;
+	}
+	if (!bd->image){
+		free(bd);
+		return NULL;
+	}
+	size_t cache_mb = opts->cache ? opts->cache : A1FS_DEFAULT_CACHE_MB;
+	bd->cache_limit = ops->release ? (uint64_t)cache_mb * 1024 * 1024 / bd->page : 0;
+	if (ops->release && opts->flush == 0) opts->flush = A1FS_PWRITE_FLUSH_MS;
+	pthread_mutex_init(&bd->lock, NULL);
+	return bd;
+}
+
+void bdev_start(a1fs_bdev *bd){
+	// which pages have private copies; without it, syncs write every page
+	if (bd->ops->release && bd->pagemap < 0) bd->pagemap = open("/proc/self/pagemap", O_RDONLY);
+	if (bd->ops->ring && !bd->ring){
+		bd->ring = uring_open(A1FS_URING_ENTRIES);
+		bd->queue = bd->ring ? calloc(A1FS_URING_ENTRIES, sizeof(bd->queue[0])) : NULL;
+		if (!bd->queue){
+			fprintf(stderr, "io_uring is not available (%s), using pwrite\n", strerror(errno));
+			if (bd->ring) uring_close(bd->ring);
+			bd->ring = NULL;
+			bd->ops = &pwrite_ops;
+		}
+	}
+}
+
+int bdev_close(a1fs_bdev *bd, bool sync){
+	int result = 0;
+	if (bd->ops->release){
+		result = bd->ops->release(bd);
+	} else if (sync){
+		result = bd->ops->sync(bd, 0, bd->size);
+	}
+	munmap(bd->image, bd->size);
+	close(bd->fd);
+	if (bd->pagemap >= 0) close(bd->pagemap);
+	if (bd->ring) uring_close(bd->ring);
+	free(bd->queue);
+	pthread_mutex_destroy(&bd->lock);
+	free(bd);
+	return result;
+}
+
+int bdev_sync(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end){
+	// msync() wants whole pages, which may be larger than blocks
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t from = (size_t)start * A1FS_BLOCK_SIZE / page * page;
+	size_t to = (size_t)end * A1FS_BLOCK_SIZE;
+	a1fs_bdev *bd = fs->bdev;
+	if (!bd) return msync((char*)fs->image + from, to - from, MS_SYNC) < 0 ? -errno : 0;
+
+	int result = bd->ops->sync(bd, from, to);
+	pthread_mutex_lock(&bd->lock);
+	bd->syncs += 1;
+	bd->synced_blocks += end - start;
+	pthread_mutex_unlock(&bd->lock);
+	return result;
+}
+
+int bdev_sync_ranges(fs_ctx *fs, const a1fs_drange *ranges, size_t count){
+	a1fs_bdev *bd = fs->bdev;
+	int result = 0;
+	if (!bd || !bd->ops->release){
+		// msync() of each, which waits for its own writes
+		for (size_t i = 0; i < count; i++){
+			int synced = bdev_sync(fs, ranges[i].start, ranges[i].end);
+			if (result == 0) result = synced;
+		}
+		return result;
+	}
+
+	size_t page = bd->page;
+	pthread_mutex_lock(&bd->lock);
+	uint64_t written = bd->written_pages;
+	for (size_t i = 0; i < count && result == 0; i++){
+		size_t first = (size_t)ranges[i].start * A1FS_BLOCK_SIZE / page;
+		size_t end = ((size_t)ranges[i].end * A1FS_BLOCK_SIZE + page - 1) / page;
+		result = write_private(bd, first, end, false);
+		bd->syncs += 1;
+		bd->synced_blocks += ranges[i].end - ranges[i].start;
+	}
+	if (bd->ring){
+		// the queued writes read the image, so they are waited for even on failure
+		int flushed = flush_ring(bd, false);
+		if (result == 0) result = flushed;
+	}
+	bd->cached += bd->written_pages - written;
+	pthread_mutex_unlock(&bd->lock);
+	if (result == 0 && fdatasync(bd->fd) < 0) result = -errno;
+	return result;
+}
+
+int bdev_sync_all(fs_ctx *fs){
+	a1fs_bdev *bd = fs->bdev;
+	if (bd && bd->ops->release) return bdev_release(fs);
+	return bdev_sync(fs, 0, fs->size / A1FS_BLOCK_SIZE);
+}
+
+bool bdev_cache_full(fs_ctx *fs){
+	a1fs_bdev *bd = fs->bdev;
+	if (!bd || bd->cache_limit == 0) return false;
+	pthread_mutex_lock(&bd->lock);
+	bool full = bd->cached >= bd->cache_limit;
+	pthread_mutex_unlock(&bd->lock);
+	return full;
+}
+
+int bdev_release(fs_ctx *fs){
+	a1fs_bdev *bd = fs->bdev;
+	if (!bd || !bd->ops->release) return 0;
+	int result = bd->ops->release(bd);
+	pthread_mutex_lock(&bd->lock);
+	bd->releases += 1;
+	pthread_mutex_unlock(&bd->lock);
+	return result;
+}
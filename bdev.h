@@ -0,0 +1,150 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "dirty.h"
+#include "fs_ctx.h"
+#include "options.h"
+#include "uring.h"
+
+
+/**
+ * How the image gets to the disk, chosen with the --io=<backend> option.
+ *
+ * The file system works on the image mapped into memory either way; a
+ * backend decides how the mapping is made, and how the blocks that dirty.h
+ * and journal.h sync reach the file.
+ *
+ * mmap (the default) maps the image shared: a changed block is in the page
+ * cache at once, the kernel writes it back whenever it decides to, and a sync
+ * is an msync().
+ *
+ * pwrite maps the image private: reads still come from the page cache, but a
+ * changed page becomes a private copy that the kernel never writes to the
+ * file. A sync writes the pages of its blocks that have private copies, as
+ * /proc/self/pagemap tells, with pwrite() and fdatasync(), so nothing reaches
+ * the disk in another order than the file system asks for; with a journal, a
+ * block is never in place before its transaction is committed. The private
+ * copies are the block cache: once the syncs have written more than the
+ * --cache size of them, the next checkpoint of the journal writes them all
+ * and drops them, with no operation in progress. Nothing else drops them, so
+ * bdev_open() refuses this backend on an image without a journal, where they
+ * would grow until unmount.
+ *
+ * uring is pwrite with the writes of a sync, one per run of private pages,
+ * queued on an io_uring (see uring.h) and submitted in batches, a system call
+ * for up to A1FS_URING_ENTRIES of them instead of one each. Where io_uring
+ * is not available, it is pwrite.
+ *
+ * Blocks are not read or written through a get/put interface: the code works
+ * on pointers into the mapping, which stay valid for the whole mount. An image
+ * has at most 2^32 blocks of 4 KiB, 16 TiB, which fits in the address space a
+ * 64-bit process has, and only the pages in use take memory.
+ */
+typedef struct a1fs_bdev {
+	/** Backend; see bdev.c. */
+	const struct a1fs_bdev_ops *ops;
+	/** The image file, for pwrite(). */
+	int fd;
+	/** /proc/self/pagemap, to find the private copies; -1 until bdev_start(), or if it can't be read. */
+	int pagemap;
+	/** The mapping of the image, its size in bytes, and the page size. */
+	void *image;
+	size_t size;
+	size_t page;
+	/** Protects everything below; held while the pages are written. */
+	pthread_mutex_t lock;
+	/** The ring of the uring backend, and the runs of pages [first, end) queued on it; NULL without one. */
+	a1fs_uring *ring;
+	size_t (*queue)[2];
+	size_t queued;
+	/** Pages written since the private copies were last dropped, and the most to keep. */
+	uint64_t cached;
+	uint64_t cache_limit;
+
+	/** Number of syncs, and the number of blocks they asked for. */
+	uint64_t syncs;
+	uint64_t synced_blocks;
+	/** Number of pages written to the file by pwrite(). */
+	uint64_t written_pages;
+	/** Number of times the private copies were dropped, and the number of pages dropped. */
+	uint64_t releases;
+	uint64_t released_pages;
+} a1fs_bdev;
+
+/** Operations of a backend. */
+typedef struct a1fs_bdev_ops {
+	/** Name given to the --io option. */
+	const char *name;
+	/** mmap() flags of the image. */
+	int map_flags;
+	/** Write bytes [from, to) of the image, page aligned, to the disk; return -errno on failure. */
+	int (*sync)(a1fs_bdev *bd, size_t from, size_t to);
+	/** Write every changed page to the disk and drop the private copies; return -errno on failure. */
+	int (*release)(a1fs_bdev *bd);
+	/** Whether the writes go through an io_uring. */
+	bool ring;
+} a1fs_bdev_ops;
+
+
+/**
+ * Map the image with the backend opts->io names (mmap by default). The
+ * pwrite backend sets a flush interval if opts has none (see dirty.h), so
+ * that the changed blocks are written, and dropped, as the mount goes on; it
+ * needs an image with a journal.
+ *
+ * @return  the backend; NULL on failure, with a message printed.
+ */
+a1fs_bdev *bdev_open(const char *path, a1fs_opts *opts);
+
+/**
+ * Finish setting up the backend in the process that serves the mount, once
+ * FUSE has daemonized: /proc/self/pagemap describes the process that opened
+ * it, which the fork leaves behind, and the ring of the uring backend is set
+ * up here so that it belongs to the process that submits to it. Until then,
+ * syncs write every page of their ranges, one pwrite() at a time.
+ */
+void bdev_start(a1fs_bdev *bd);
+
+/**
+ * Write back what is left, sync the whole image if sync is set, and unmap it.
+ *
+ * @return  0 on success; -errno if the image could not be written.
+ */
+int bdev_close(a1fs_bdev *bd, bool sync);
+
+/**
+ * Sync blocks [start, end) of the image; with no backend (fs->bdev is NULL),
+ * with msync().
+ *
+ * @return  0 on success; -errno on failure.
+ */
+int bdev_sync(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end);
+
+/**
+ * Sync the count ranges, sorted and apart from each other, together: with the
+ * pwrite and uring backends, the writes of all of them are issued (and on a
+ * ring, queued across ranges) before the file is synced, once.
+ *
+ * @return  0 on success; -errno on failure, after which any of the ranges may
+ *          not be on disk.
+ */
+int bdev_sync_ranges(fs_ctx *fs, const a1fs_drange *ranges, size_t count);
+
+/** Sync the whole image, or with a backend that keeps private copies, only the pages that have one. */
+int bdev_sync_all(fs_ctx *fs);
+
+/** Whether the private copies of the image have grown past the cache size. */
+bool bdev_cache_full(fs_ctx *fs);
+
+/**
+ * Write every changed page of the image and drop the private copies. No
+ * operation may be in progress.
+ *
+ * @return  0 on success; -errno on failure.
+ */
+int bdev_release(fs_ctx *fs);
@@ -0,0 +1,1063 @@
+/**
+ * Benchmarks of the file system code, run on an image file without FUSE.
+ *
+ * Each benchmark formats its own image with mkfs.a1fs, mounts it with the
+ * same fs_ctx_init() and core_* calls that the drivers use, and prints what
+ * it measured. Run "bench" without arguments for the list.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdev.h"
+#include "dirty.h"
+#include "fs_core.h"
+#include "fs_ctx.h"
+#include "freemap.h"
+#include "group.h"
+#include "journal.h"
+
+
+/** Options shared by the benchmarks; each one uses those it needs. */
+typedef struct bench_opts {
+	/** Image file, and the mkfs.a1fs to format it with. */
+	const char *image;
+	const char *mkfs;
+	/** Extra mkfs.a1fs options, such as "-c -x". */
+	const char *format;
+	/** Size of the image in MiB; 0 for the default of the benchmark. */
+	size_t size;
+	/** I/O backend, see bdev.h. */
+	const char *io;
+	/** Number of runs; the best one is reported. */
+	int runs;
+	/** I/O of the fio benchmark: write, randwrite, read or randread; its block size; and fsync every that many writes (0 for none). */
+	const char *rw;
+	size_t bs;
+	unsigned int fsync_every;
+} bench_opts;
+
+static bench_opts bopts = {
+	.image = "bench.img",
+	.mkfs = "./mkfs.a1fs",
+	.format = "",
+	.size = 0,
+	.io = NULL,
+	.runs = 3,
+	.rw = "randwrite",
+	.bs = 4096,
+	.fsync_every = 0,
+};
+
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what){
+	fprintf(stderr, "bench: %s\n", what);
+	exit(1);
+}
+
+/** Make a new image of size MiB (bopts.size if set) with inodes inodes, formatted with extra and bopts.format. */
+static void format(size_t size, unsigned int inodes, const char *extra){
+	if (bopts.size) size = bopts.size;
+	int fd = open(bopts.image, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t)size << 20) < 0) die(strerror(errno));
+	close(fd);
+	char cmd[1024];
+	snprintf(cmd, sizeof(cmd), "%s -f -i %u %s %s %s >/dev/null", bopts.mkfs, inodes, extra, bopts.format, bopts.image);
+	if (system(cmd) != 0) die("mkfs.a1fs failed");
+}
+
+/** Mount the image into fs, as the drivers do. */
+static void mount(fs_ctx *fs, a1fs_opts *opts){
+	memset(fs, 0, sizeof(*fs));
+	if (!opts->io) opts->io = bopts.io;
+	fs->bdev = bdev_open(bopts.image, opts);
+	if (!fs->bdev || !fs_ctx_init(fs, fs->bdev->image, fs->bdev->size, opts)) die("mount failed");
+	bdev_start(fs->bdev);
+}
+
+/** Write everything out and unmount fs; with cold set, also drop the image from the page cache. */
+static void unmount(fs_ctx *fs, bool cold){
+	core_flush_all(fs);
+	if (fs->journal && journal_checkpoint(fs) < 0) die("journal checkpoint failed");
+	a1fs_bdev *bd = fs->bdev;
+	fs_ctx_destroy(fs);
+	if (bdev_close(bd, true) < 0) die("image sync failed");
+	if (cold){
+		int fd = open(bopts.image, O_RDONLY);
+		if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) die("could not drop the page cache");
+		close(fd);
+	}
+}
+
+/** Create a file or directory called name in dir. */
+static a1fs_inode *create(fs_ctx *fs, a1fs_inode *dir, const char *name, mode_t mode){
+	a1fs_inode *inode;
+	if (core_mknod(fs, dir, name, mode, &inode) < 0) die("create failed");
+	return inode;
+}
+
+/** Write size bytes of buf in chunks of chunk bytes to inode, from offset 0. */
+static void fill(fs_ctx *fs, a1fs_inode *inode, const char *buf, size_t chunk, uint64_t size){
+	for (uint64_t off = 0; off < size; off += chunk){
+		size_t len = size - off < chunk ? size - off : chunk;
+		if (core_write(fs, inode, NULL, buf, len, off) != (int)len) die("write failed");
+	}
+	if (core_flush(fs, inode) < 0) die("flush failed");
+}
+
+
+/** Chunk sizes of the read and write benchmarks, as FUSE and applications issue them. */
+static const size_t chunks[] = { 4096, 128 * 1024, 1024 * 1024 };
+
+/**
+ * Sequential read of a file that takes most of a 256 MiB image, through one
+ * handle, in 4 KiB, 128 KiB and 1 MiB chunks, from the page cache.
+ */
+static void bench_read(void){
+	format(256, 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	uint64_t size = 192ull << 20;
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'r', 1 << 20);
+	a1fs_inode *file = create(&fs, get_inode(&fs, 1), "file", S_IFREG | 0644);
+	fill(&fs, file, buf, 1 << 20, size);
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++){
+		double best = 0;
+		for (int run = 0; run < bopts.runs; run++){
+			a1fs_handle *handle = core_open(&fs, file);
+			double start = now();
+			for (uint64_t off = 0; off < size; off += chunks[c]){
+				if (core_read(&fs, file, &handle->cursor, buf, chunks[c], off) != (int)chunks[c]) die("read failed");
+			}
+			double mbs = (size >> 20) / (now() - start);
+			if (mbs > best) best = mbs;
+			core_release(&fs, handle);
+		}
+		printf("read %4zu KiB chunks: %8.0f MB/s\n", chunks[c] / 1024, best);
+	}
+	free(buf);
+	unmount(&fs, false);
+}
+
+/**
+ * Sequential write of a 192 MiB file on a 256 MiB image, in 4 KiB, 128 KiB
+ * and 1 MiB chunks: appends to a new file, including the flush that
+ * allocates them, then overwrites of the same file.
+ */
+static void bench_write(void){
+	format(256, 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	uint64_t size = 192ull << 20;
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'w', 1 << 20);
+	a1fs_inode *root = get_inode(&fs, 1);
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++){
+		double append = 0, overwrite = 0;
+		for (int run = 0; run < bopts.runs; run++){
+			a1fs_inode *file = create(&fs, root, "file", S_IFREG | 0644);
+			double start = now();
+			fill(&fs, file, buf, chunks[c], size);
+			double mbs = (size >> 20) / (now() - start);
+			if (mbs > append) append = mbs;
+			start = now();
+			fill(&fs, file, buf, chunks[c], size);
+			mbs = (size >> 20) / (now() - start);
+			if (mbs > overwrite) overwrite = mbs;
+			if (core_unlink(&fs, root, "file") < 0) die("unlink failed");
+		}
+		printf("write %4zu KiB chunks: append %8.0f MB/s, overwrite %8.0f MB/s\n", chunks[c] / 1024, append, overwrite);
+	}
+	free(buf);
+	unmount(&fs, false);
+}
+
+/**
+ * Allocate every block of a 1 GiB image one at a time, as growing a file
+ * block by block does: from the bitmaps, searching from block 0 each time
+ * (first fit) or from the block after the last one (next fit), and from
+ * the free space index of freemap.h.
+ */
+static void bench_alloc(void){
+	static const struct { const char *name; bool freemap; bool next_fit; } modes[] = {
+		{ "bitmap, first fit", false, false },
+		{ "bitmap, next fit", false, true },
+		{ "freemap, next fit", true, true },
+	};
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++){
+		format(1024, 64, "");
+		fs_ctx fs;
+		a1fs_opts opts = {0};
+		mount(&fs, &opts);
+		// without the index, blocks are found by scanning the bitmaps
+		if (!modes[m].freemap) freemap_destroy(&fs);
+		uint64_t count = 0;
+		a1fs_blk_t goal = 0;
+		double start = now();
+		while (1){
+			pthread_mutex_lock(&fs.block_lock);
+			long blk = group_find_block(&fs, goal);
+			if (blk >= 0) group_take_blocks(&fs, blk, 1);
+			pthread_mutex_unlock(&fs.block_lock);
+			if (blk < 0) break;
+			if (modes[m].next_fit) goal = blk + 1;
+			count++;
+		}
+		double secs = now() - start;
+		printf("alloc %-18s %8lu blocks in %7.3f s, %6.0f ns/block\n", modes[m].name, (unsigned long)count, secs, secs * 1e9 / count);
+		unmount(&fs, false);
+	}
+}
+
+/** Next number of a fixed pseudo-random sequence, so that every run fragments the image the same way. */
+static uint32_t next_random(uint32_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/**
+ * Fragment the free space of fs: fill blocks blocks with files of 1 to 16
+ * blocks in a "frag" directory, then delete about half of them at random.
+ */
+static void fragment(fs_ctx *fs, uint32_t blocks, const char *buf){
+	a1fs_inode *dir = create(fs, get_inode(fs, 1), "frag", S_IFDIR | 0755);
+	uint32_t state = 2463534242u, used = 0;
+	unsigned int files = 0;
+	char name[32];
+	while (used < blocks){
+		uint32_t size = 1 + next_random(&state) % 16;
+		snprintf(name, sizeof(name), "f%u", files++);
+		fill(fs, create(fs, dir, name, S_IFREG | 0644), buf, size * A1FS_BLOCK_SIZE, size * A1FS_BLOCK_SIZE);
+		used += size;
+	}
+	for (unsigned int i = 0; i < files; i++){
+		if (next_random(&state) & 1) continue;
+		snprintf(name, sizeof(name), "f%u", i);
+		if (core_unlink(fs, dir, name) < 0) die("unlink failed");
+	}
+}
+
+/** Print how many of the count files have how many extents. */
+static void print_extents(const char *what, a1fs_inode **files, int count){
+	static const uint32_t limits[] = { 1, 4, 16, 64, 256, UINT32_MAX };
+	int histogram[sizeof(limits) / sizeof(limits[0])] = {0};
+	uint32_t max = 0;
+	uint64_t total = 0;
+	for (int i = 0; i < count; i++){
+		uint32_t n = files[i]->extent_count;
+		size_t b = 0;
+		while (n > limits[b]) b++;
+		histogram[b]++;
+		total += n;
+		if (n > max) max = n;
+	}
+	printf("%-8s 1: %3d  2-4: %3d  5-16: %3d  17-64: %3d  65-256: %3d  >256: %3d  mean %6.1f  max %4u\n", what,
+	       histogram[0], histogram[1], histogram[2], histogram[3], histogram[4], histogram[5], (double)total / count, max);
+}
+
+/**
+ * Extents per file of 8 MiB files written on a fragmented 256 MiB image:
+ * appended in 1 MiB chunks, and grown with one truncate.
+ */
+static void bench_extents(void){
+	format(256, 8192, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'e', 1 << 20);
+	fragment(&fs, 36 * 1024, buf);
+
+	enum { FILES = 8 };
+	uint64_t size = 8ull << 20;
+	a1fs_inode *root = get_inode(&fs, 1);
+	a1fs_inode *appended[FILES], *truncated[FILES];
+	char name[32];
+	for (int i = 0; i < FILES; i++){
+		snprintf(name, sizeof(name), "append%d", i);
+		appended[i] = create(&fs, root, name, S_IFREG | 0644);
+		fill(&fs, appended[i], buf, 1 << 20, size);
+		snprintf(name, sizeof(name), "truncate%d", i);
+		truncated[i] = create(&fs, root, name, S_IFREG | 0644);
+		if (core_truncate(&fs, truncated[i], size) < 0) die("truncate failed");
+	}
+	print_extents("append", appended, FILES);
+	print_extents("truncate", truncated, FILES);
+	free(buf);
+	unmount(&fs, false);
+}
+
+/** Make a directory called name in the root with count empty files f0, f1, ... in it. */
+static a1fs_inode *populate(fs_ctx *fs, const char *name, unsigned int count){
+	a1fs_inode *dir = create(fs, get_inode(fs, 1), name, S_IFDIR | 0755);
+	char file[32];
+	for (unsigned int i = 0; i < count; i++){
+		snprintf(file, sizeof(file), "f%u", i);
+		create(fs, dir, file, S_IFREG | 0644);
+	}
+	return dir;
+}
+
+/** core_readdir() filler that stops at the entry named buf. */
+static int match_name(void *buf, const a1fs_dirent *dirent){
+	return strcmp(buf, dirent->name) == 0;
+}
+
+/**
+ * stat() of random names in a directory of 100k entries: a lookup and a
+ * getattr each, through the name index, and by scanning the directory with
+ * readdir as the lookups did before there was one.
+ */
+static void bench_stat(void){
+	enum { ENTRIES = 100000, STATS = 100000, SCANS = 200 };
+	format(256, ENTRIES + 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	a1fs_inode *dir = populate(&fs, "big", ENTRIES);
+	// start from a cold name index, as after a mount
+	unmount(&fs, false);
+	mount(&fs, &opts);
+	if (core_lookup(&fs, get_inode(&fs, 1), "big", &dir) < 0) die("lookup failed");
+
+	uint32_t state = 2463534242u;
+	char name[32];
+	struct stat st;
+	a1fs_inode *inode;
+	double start = now();
+	if (core_lookup(&fs, dir, "f0", &inode) < 0) die("lookup failed");
+	double first = now() - start;
+	start = now();
+	for (int i = 0; i < STATS; i++){
+		snprintf(name, sizeof(name), "f%u", next_random(&state) % ENTRIES);
+		if (core_lookup(&fs, dir, name, &inode) < 0) die("lookup failed");
+		core_getattr(&fs, inode, &st);
+	}
+	double indexed = (now() - start) / STATS;
+	start = now();
+	for (int i = 0; i < SCANS; i++){
+		snprintf(name, sizeof(name), "f%u", next_random(&state) % ENTRIES);
+		if (core_readdir(&fs, dir, NULL, 0, match_name, name) != 1) die("readdir failed");
+	}
+	double scanned = (now() - start) / SCANS;
+	printf("stat %d entries: first lookup %8.0f us, indexed %8.0f ns/stat, scanned %8.0f ns/stat\n",
+	       ENTRIES, first * 1e6, indexed * 1e9, scanned * 1e9);
+	unmount(&fs, false);
+}
+
+/** Work of one thread of the parallel benchmark. */
+typedef struct worker {
+	fs_ctx *fs;
+	/** The file of the thread, and its directory for the metadata work. */
+	a1fs_inode *file;
+	a1fs_inode *dir;
+	/** 0 to read the file, 1 to overwrite it, 2 to create, stat and unlink files. */
+	int work;
+	int id;
+} worker;
+
+enum { PARALLEL_MAX = 8, PARALLEL_PASSES = 4, PARALLEL_FILES = 2000 };
+static const uint64_t parallel_size = 32ull << 20;
+
+static void *run_worker(void *arg){
+	worker *w = arg;
+	char *buf = malloc(128 * 1024);
+	if (!buf) die("out of memory");
+	memset(buf, 'p', 128 * 1024);
+	if (w->work == 2){
+		char name[32];
+		struct stat st;
+		a1fs_inode *inode;
+		for (int i = 0; i < PARALLEL_FILES; i++){
+			snprintf(name, sizeof(name), "w%d.%d", w->id, i);
+			create(w->fs, w->dir, name, S_IFREG | 0644);
+			if (core_lookup(w->fs, w->dir, name, &inode) < 0) die("lookup failed");
+			core_getattr(w->fs, inode, &st);
+			if (core_unlink(w->fs, w->dir, name) < 0) die("unlink failed");
+		}
+	} else {
+		a1fs_handle *handle = core_open(w->fs, w->file);
+		for (int pass = 0; pass < PARALLEL_PASSES; pass++){
+			for (uint64_t off = 0; off < parallel_size; off += 128 * 1024){
+				int done = w->work == 0 ? core_read(w->fs, w->file, &handle->cursor, buf, 128 * 1024, off)
+				                        : core_write(w->fs, w->file, &handle->cursor, buf, 128 * 1024, off);
+				if (done != 128 * 1024) die("read or write failed");
+			}
+		}
+		core_release(w->fs, handle);
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Throughput of 1 to 8 threads working at once, as with a mount with --mt:
+ * each reads or overwrites its own 32 MiB file in 128 KiB chunks, or
+ * creates, stats and unlinks files in one directory shared by all.
+ */
+static void bench_parallel(void){
+	format(512, 64 + PARALLEL_MAX * PARALLEL_FILES, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'p', 1 << 20);
+	a1fs_inode *root = get_inode(&fs, 1);
+	a1fs_inode *dir = create(&fs, root, "shared", S_IFDIR | 0755);
+	worker workers[PARALLEL_MAX];
+	char name[32];
+	for (int i = 0; i < PARALLEL_MAX; i++){
+		snprintf(name, sizeof(name), "file%d", i);
+		workers[i] = (worker){ .fs = &fs, .file = create(&fs, root, name, S_IFREG | 0644), .dir = dir, .id = i };
+		fill(&fs, workers[i].file, buf, 1 << 20, parallel_size);
+	}
+	free(buf);
+
+	for (int threads = 1; threads <= PARALLEL_MAX; threads *= 2){
+		double rates[3];
+		for (int work = 0; work < 3; work++){
+			pthread_t tids[PARALLEL_MAX];
+			double start = now();
+			for (int i = 0; i < threads; i++){
+				workers[i].work = work;
+				if (pthread_create(&tids[i], NULL, run_worker, &workers[i]) != 0) die("pthread_create failed");
+			}
+			for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+			if (work == 1) core_flush_all(&fs);
+			double secs = now() - start;
+			rates[work] = work < 2 ? threads * PARALLEL_PASSES * (parallel_size >> 20) / secs
+			                       : threads * PARALLEL_FILES / secs;
+		}
+		printf("parallel %d threads: read %7.0f MB/s, overwrite %7.0f MB/s, create+stat+unlink %7.0f ops/s\n",
+		       threads, rates[0], rates[1], rates[2]);
+	}
+	unmount(&fs, false);
+}
+
+/** Time core_truncate() of inode to size. */
+static double time_truncate(fs_ctx *fs, a1fs_inode *inode, uint64_t size){
+	double start = now();
+	if (core_truncate(fs, inode, size) < 0) die("truncate failed");
+	return now() - start;
+}
+
+/**
+ * Truncate of a 1 GiB file on a 1280 MiB image: grown from 0, cut to half,
+ * and cut to 0, at once and in 1 MiB steps; then unlinks of every entry of a
+ * directory of 20k entries, from the first one on.
+ */
+static void bench_truncate(void){
+	enum { ENTRIES = 20000 };
+	format(1280, ENTRIES + 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	uint64_t size = 1ull << 30;
+	a1fs_inode *root = get_inode(&fs, 1);
+	a1fs_inode *file = create(&fs, root, "file", S_IFREG | 0644);
+	double grow = 1e9, half = 1e9, zero = 1e9, steps = 1e9;
+	for (int run = 0; run < bopts.runs; run++){
+		double t = time_truncate(&fs, file, size);
+		if (t < grow) grow = t;
+		t = time_truncate(&fs, file, size / 2);
+		if (t < half) half = t;
+		t = time_truncate(&fs, file, 0);
+		if (t < zero) zero = t;
+		time_truncate(&fs, file, size);
+		t = 0;
+		for (uint64_t left = size; left > 0; left -= 1 << 20) t += time_truncate(&fs, file, left - (1 << 20));
+		if (t < steps) steps = t;
+	}
+	printf("truncate 1 GiB: grow from 0 %8.3f ms, to 512 MiB %8.3f ms, to 0 %8.3f ms, to 0 in 1 MiB steps %8.3f ms\n",
+	       grow * 1e3, half * 1e3, zero * 1e3, steps * 1e3);
+	if (core_unlink(&fs, root, "file") < 0) die("unlink failed");
+
+	a1fs_inode *dir = populate(&fs, "dir", ENTRIES);
+	char name[32];
+	double start = now();
+	for (unsigned int i = 0; i < ENTRIES; i++){
+		snprintf(name, sizeof(name), "f%u", i);
+		if (core_unlink(&fs, dir, name) < 0) die("unlink failed");
+	}
+	printf("truncate directory: unlink %d entries from the first one on %8.0f ns/unlink\n",
+	       ENTRIES, (now() - start) * 1e9 / ENTRIES);
+	unmount(&fs, false);
+}
+
+/** Start counting the cache misses of this thread; return the counter, or -1 if the kernel does not let us. */
+static int start_misses(void){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	return fd;
+}
+
+/** Stop the counter fd; return the cache misses it counted, or -1 without one. */
+static long long stop_misses(int fd){
+	long long count = -1;
+	if (fd < 0) return -1;
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+	close(fd);
+	return count;
+}
+
+/** core_readdir() filler that counts the entries. */
+static int count_entry(void *buf, const a1fs_dirent *dirent){
+	(void)dirent;
+	(*(unsigned int*)buf)++;
+	return 0;
+}
+
+/**
+ * Scan of a directory of 100k files with readdir, in the fixed and in the
+ * compact (mkfs.a1fs -c) entry format: time and cache misses of a whole
+ * scan, and of a lookup by scanning, as every lookup did before the name
+ * index.
+ */
+static void bench_scan(void){
+	enum { ENTRIES = 100000 };
+	static const char *formats[] = { "", "-c" };
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++){
+		format(256, ENTRIES + 64, formats[f]);
+		fs_ctx fs;
+		a1fs_opts opts = {0};
+		mount(&fs, &opts);
+		a1fs_inode *dir = populate(&fs, "big", ENTRIES);
+		double scan = 1e9, find = 1e9;
+		long long scan_misses = -1, find_misses = -1;
+		char name[32];
+		snprintf(name, sizeof(name), "f%u", ENTRIES - 1);
+		for (int run = 0; run < bopts.runs; run++){
+			unsigned int count = 0;
+			int counter = start_misses();
+			double start = now();
+			if (core_readdir(&fs, dir, NULL, 0, count_entry, &count) != 0 || count < ENTRIES) die("readdir failed");
+			double t = now() - start;
+			long long misses = stop_misses(counter);
+			if (t < scan){
+				scan = t;
+				scan_misses = misses;
+			}
+			counter = start_misses();
+			start = now();
+			if (core_readdir(&fs, dir, NULL, 0, match_name, name) != 1) die("readdir failed");
+			t = now() - start;
+			misses = stop_misses(counter);
+			if (t < find){
+				find = t;
+				find_misses = misses;
+			}
+		}
+		char scan_text[32] = "n/a", find_text[32] = "n/a";
+		if (scan_misses >= 0) snprintf(scan_text, sizeof(scan_text), "%lld", scan_misses);
+		if (find_misses >= 0) snprintf(find_text, sizeof(find_text), "%lld", find_misses);
+		printf("scan %-6s %6lu KiB: readdir %7.3f ms, %10s misses; find last %7.3f ms, %10s misses\n",
+		       f == 0 ? "fixed" : "compact", (unsigned long)(dir->size >> 10), scan * 1e3, scan_text, find * 1e3, find_text);
+		unmount(&fs, false);
+	}
+}
+
+/** Contents of file i of the upgrade check. */
+static char upgrade_byte(int i){
+	return 'a' + i % 26;
+}
+
+/**
+ * Mount check of an image from before the extent tree: a small image is
+ * written, its superblock and inodes are changed back to that format (no
+ * EXTENT_TREE or DIR_INDEX feature, and garbage where the padding was), and
+ * it is mounted again and every file is read back, grown, and created next
+ * to, and one directory is emptied and removed. Exits with 1 if anything is
+ * wrong.
+ */
+static void bench_upgrade(void){
+	enum { DIRS = 2, FILES = 40, WRITES = 3 };
+	format(64, 256, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	char *buf = malloc(WRITES * 20000);
+	if (!buf) die("out of memory");
+	char name[32];
+	a1fs_inode *root = get_inode(&fs, 1);
+	for (int d = 0; d < DIRS; d++){
+		snprintf(name, sizeof(name), "d%d", d);
+		a1fs_inode *dir = create(&fs, root, name, S_IFDIR | 0755);
+		for (int i = 0; i < FILES; i++){
+			snprintf(name, sizeof(name), "f%d", i);
+			a1fs_inode *file = create(&fs, dir, name, S_IFREG | 0644);
+			// several flushes, so that files get several extents
+			size_t len = 5000 + i * 300;
+			memset(buf, upgrade_byte(i), len);
+			for (int k = 0; k < WRITES; k++){
+				if (core_write(&fs, file, NULL, buf, len, k * len) != (int)len) die("write failed");
+				if (core_flush(&fs, file) < 0) die("flush failed");
+			}
+		}
+	}
+	unmount(&fs, false);
+
+	int fd = open(bopts.image, O_RDWR);
+	off_t size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+	void *image = size < 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED) die(strerror(errno));
+	a1fs_superblock *sp = image;
+	if (sp->features & A1FS_FEATURE_BLOCK_GROUPS && sp->groups_count > 1) die("the image must have a single group");
+	sp->features &= ~(A1FS_FEATURE_EXTENT_TREE | A1FS_FEATURE_DIR_INDEX);
+	for (size_t i = 0; i < sp->max_inodes_count; i++){
+		a1fs_inode *inode = (a1fs_inode*)((char*)image + (size_t)sp->inode_table * A1FS_BLOCK_SIZE + i * sp->inode_size);
+		inode->extent_count = 0xdead0000 + i % 7;
+		inode->extent_depth = 0x55;
+		inode->dir_index = 0xbeef;
+	}
+	munmap(image, size);
+	close(fd);
+
+	mount(&fs, &opts);
+	root = get_inode(&fs, 1);
+	int failures = 0;
+	for (int d = 0; d < DIRS; d++){
+		a1fs_inode *dir, *file;
+		snprintf(name, sizeof(name), "d%d", d);
+		if (core_lookup(&fs, root, name, &dir) < 0){
+			printf("upgrade: lookup of %s failed\n", name);
+			failures++;
+			continue;
+		}
+		for (int i = 0; i < FILES; i++){
+			snprintf(name, sizeof(name), "f%d", i);
+			size_t len = WRITES * (5000 + i * 300);
+			if (core_lookup(&fs, dir, name, &file) < 0 || core_read(&fs, file, NULL, buf, len, 0) != (int)len){
+				printf("upgrade: d%d/%s can't be read\n", d, name);
+				failures++;
+				continue;
+			}
+			for (size_t k = 0; k < len; k++){
+				if (buf[k] != upgrade_byte(i)){
+					printf("upgrade: d%d/%s differs at %zu\n", d, name, k);
+					failures++;
+					break;
+				}
+			}
+			if (core_write(&fs, file, NULL, buf, 1000, len) != 1000 || core_flush(&fs, file) < 0){
+				printf("upgrade: d%d/%s can't be grown\n", d, name);
+				failures++;
+			}
+		}
+		if (core_mknod(&fs, dir, "new", S_IFREG | 0644, &file) < 0){
+			printf("upgrade: create in d%d failed\n", d);
+			failures++;
+		}
+	}
+	// and the blocks of old files and directories can be freed
+	a1fs_inode *dir;
+	if (core_lookup(&fs, root, "d0", &dir) == 0){
+		for (int i = 0; i < FILES; i++){
+			snprintf(name, sizeof(name), "f%d", i);
+			if (core_unlink(&fs, dir, name) < 0) failures++;
+		}
+		if (core_unlink(&fs, dir, "new") < 0 || core_rmdir(&fs, root, "d0") < 0){
+			printf("upgrade: d0 can't be removed\n");
+			failures++;
+		}
+	}
+	free(buf);
+	unmount(&fs, false);
+	printf("upgrade: %d files of an image from before extent trees, %d failures\n", DIRS * FILES, failures);
+	if (failures){
+		unlink(bopts.image);
+		exit(1);
+	}
+}
+
+static int compare_doubles(const void *a, const void *b){
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Latency of fsync() of a 4 KiB write on a 1 GiB image while another file
+ * dirties 0, 4 or 16 MiB of its data in between: syncing the ranges the file
+ * dirtied (core_fsync()), and syncing the whole image as the only sync there
+ * was before.
+ */
+static void bench_fsync(void){
+	enum { SYNCS = 50 };
+	static const size_t others[] = { 0, 4, 16 };
+	format(1024, 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 's', 1 << 20);
+	a1fs_inode *root = get_inode(&fs, 1);
+	a1fs_inode *big = create(&fs, root, "big", S_IFREG | 0644);
+	a1fs_inode *small = create(&fs, root, "small", S_IFREG | 0644);
+	fill(&fs, big, buf, 1 << 20, 256 << 20);
+	if (bdev_sync_all(&fs) < 0 || dirty_sync_all(&fs) < 0) die("sync failed");
+
+	for (size_t o = 0; o < sizeof(others) / sizeof(others[0]); o++){
+		double times[2][SYNCS];
+		for (int whole = 0; whole < 2; whole++){
+			for (int i = 0; i < SYNCS; i++){
+				for (size_t k = 0; k < others[o]; k++){
+					uint64_t off = ((i * others[o] + k) % 256) << 20;
+					if (core_write(&fs, big, NULL, buf, 1 << 20, off) != 1 << 20) die("write failed");
+				}
+				if (core_write(&fs, small, NULL, buf, 4096, (uint64_t)i * 4096) != 4096) die("write failed");
+				double start = now();
+				int result = whole ? core_flush(&fs, small) : core_fsync(&fs, small);
+				if (result >= 0 && whole) result = bdev_sync_all(&fs);
+				if (result < 0) die("fsync failed");
+				times[whole][i] = now() - start;
+			}
+			qsort(times[whole], SYNCS, sizeof(double), compare_doubles);
+			if (whole && dirty_sync_all(&fs) < 0) die("sync failed");
+		}
+		printf("fsync, other file dirties %2zu MiB: ranges median %6.2f ms p90 %6.2f ms, whole image median %6.2f ms p90 %6.2f ms\n",
+		       others[o], times[0][SYNCS / 2] * 1e3, times[0][SYNCS * 9 / 10] * 1e3,
+		       times[1][SYNCS / 2] * 1e3, times[1][SYNCS * 9 / 10] * 1e3);
+	}
+	free(buf);
+	unmount(&fs, false);
+}
+
+/** The image and a copy of it that msync() copies what it syncs to, while bench_synced() runs. */
+static char *shadow_image;
+static char *shadow;
+
+/** msync() that also copies the range to the shadow image (see bench_synced()). */
+int msync(void *addr, size_t len, int flags){
+	if (shadow) memcpy(shadow + ((char*)addr - shadow_image), addr, len);
+	return syscall(SYS_msync, addr, len, flags);
+}
+
+/**
+ * Check that the dirty ranges cover every change: random creates, writes,
+ * flushes, truncates, renames and unlinks in the mmap backend, then a sync
+ * of all the ranges, after which every used block of the image must have
+ * been synced. msync() is hooked to copy what it syncs into a shadow image
+ * to compare with. Exits with 1 if a block was missed.
+ */
+static void bench_synced(void){
+	enum { ROUNDS = 40, OPS = 500, NAMES = 300 };
+	format(64, 2048, "");
+	fs_ctx fs;
+	a1fs_opts opts = { .io = "mmap" };
+	mount(&fs, &opts);
+	shadow_image = fs.image;
+	shadow = malloc(fs.size);
+	if (!shadow) die("out of memory");
+	// changes made by the mount itself (e.g. feature bits) are not tracked
+	memcpy(shadow, fs.image, fs.size);
+	a1fs_inode *root = get_inode(&fs, 1), *dirs[4];
+	char name[64], name2[64], buf[9000];
+	memset(buf, 'a', sizeof(buf));
+	for (int i = 0; i < 4; i++){
+		snprintf(name, sizeof(name), "d%d", i);
+		dirs[i] = create(&fs, root, name, S_IFDIR | 0755);
+	}
+	uint32_t state = 2463534242u;
+	size_t missed = 0;
+	for (int round = 0; round < ROUNDS; round++){
+		for (int i = 0; i < OPS; i++){
+			a1fs_inode *dir = dirs[next_random(&state) % 4], *dir2 = dirs[next_random(&state) % 4], *inode;
+			snprintf(name, sizeof(name), "file-with-a-long-name-%u", next_random(&state) % NAMES);
+			snprintf(name2, sizeof(name2), "file-with-a-long-name-%u", next_random(&state) % NAMES);
+			buf[0] = next_random(&state);
+			switch (next_random(&state) % 6){
+			case 0:
+				core_mknod(&fs, dir, name, next_random(&state) % 8 ? S_IFREG | 0644 : S_IFDIR | 0755, &inode);
+				break;
+			case 1:
+				if (core_unlink(&fs, dir, name) < 0) core_rmdir(&fs, dir, name);
+				break;
+			case 2:
+				core_rename(&fs, dir, name, dir2, name2);
+				break;
+			case 3:
+				if (core_lookup(&fs, dir, name, &inode) == 0 && S_ISREG(inode->mode)){
+					uint64_t off = next_random(&state) % 2 ? inode->size : next_random(&state) % 20000;
+					core_write(&fs, inode, NULL, buf, next_random(&state) % sizeof(buf), off);
+				}
+				break;
+			case 4:
+				if (core_lookup(&fs, dir, name, &inode) == 0 && S_ISREG(inode->mode)) core_flush(&fs, inode);
+				break;
+			case 5:
+				if (core_lookup(&fs, dir, name, &inode) == 0 && S_ISREG(inode->mode)){
+					core_truncate(&fs, inode, next_random(&state) % 30000);
+				}
+				break;
+			}
+		}
+		core_flush_all(&fs);
+		if (dirty_sync_all(&fs) < 0) die("sync failed");
+		for (a1fs_blk_t b = 0; b < fs.size / A1FS_BLOCK_SIZE; b++){
+			// a free block's contents don't matter
+			if (group_run_length(&fs, b, b + 1) == 1) continue;
+			size_t off = (size_t)b * A1FS_BLOCK_SIZE;
+			if (memcmp(shadow + off, (char*)fs.image + off, A1FS_BLOCK_SIZE) != 0){
+				if (missed++ < 10) printf("synced: round %d: block %u was not synced\n", round, b);
+			}
+		}
+	}
+	free(shadow);
+	shadow = NULL;
+	unmount(&fs, false);
+	printf("synced: %d rounds of %d operations, %zu blocks not synced\n", ROUNDS, OPS, missed);
+	if (missed){
+		unlink(bopts.image);
+		exit(1);
+	}
+}
+
+/**
+ * The I/O backends compared on a 1 GiB image with a 4 MiB journal and a
+ * 512 MiB file: sequential 1 MiB writes with an fsync every 64 MiB, random
+ * 4 KiB writes without fsync and with one every 16 writes, then sequential
+ * 1 MiB and random 4 KiB reads. Only the backend -i names, if given.
+ */
+static void bench_backends(void){
+	enum { RANDOM = 20000 };
+	static const char *backends[] = { "mmap", "pwrite", "uring" };
+	uint64_t size = 512ull << 20, blocks = size / A1FS_BLOCK_SIZE;
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'b', 1 << 20);
+	for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++){
+		if (bopts.io && strcmp(bopts.io, backends[b]) != 0) continue;
+		format(1024, 64, "-j 1024");
+		fs_ctx fs;
+		a1fs_opts opts = { .io = backends[b] };
+		mount(&fs, &opts);
+		a1fs_inode *file = create(&fs, get_inode(&fs, 1), "file", S_IFREG | 0644);
+		uint32_t state = 2463534242u;
+
+		double start = now();
+		for (uint64_t off = 0; off < size; off += 1 << 20){
+			if (core_write(&fs, file, NULL, buf, 1 << 20, off) != 1 << 20) die("write failed");
+			if ((off >> 20) % 64 == 63 && core_fsync(&fs, file) < 0) die("fsync failed");
+		}
+		if (core_fsync(&fs, file) < 0) die("fsync failed");
+		double seq_write = (size >> 20) / (now() - start);
+		double rand_write[2];
+		for (int sync = 0; sync < 2; sync++){
+			start = now();
+			for (int i = 0; i < RANDOM; i++){
+				buf[0] = i;
+				uint64_t off = next_random(&state) % blocks * A1FS_BLOCK_SIZE;
+				if (core_write(&fs, file, NULL, buf, 4096, off) != 4096) die("write failed");
+				if (sync && i % 16 == 15 && core_fsync(&fs, file) < 0) die("fsync failed");
+			}
+			if (core_fsync(&fs, file) < 0) die("fsync failed");
+			rand_write[sync] = RANDOM / (now() - start);
+		}
+		start = now();
+		for (uint64_t off = 0; off < size; off += 1 << 20){
+			if (core_read(&fs, file, NULL, buf, 1 << 20, off) != 1 << 20) die("read failed");
+		}
+		double seq_read = (size >> 20) / (now() - start);
+		start = now();
+		for (int i = 0; i < 5 * RANDOM; i++){
+			uint64_t off = next_random(&state) % blocks * A1FS_BLOCK_SIZE;
+			if (core_read(&fs, file, NULL, buf, 4096, off) != 4096) die("read failed");
+		}
+		double rand_read = 5 * RANDOM / (now() - start);
+		printf("backends %-6s: write 1M %6.0f MB/s, write 4K %7.0f ops/s, with fsync/16 %6.0f ops/s, read 1M %6.0f MB/s, read 4K %8.0f ops/s\n",
+		       fs.bdev->ops->name, seq_write, rand_write[0], rand_write[1], seq_read, rand_read);
+		unmount(&fs, false);
+	}
+	free(buf);
+}
+
+/**
+ * fio-like I/O of a 512 MiB file on a 1 GiB image with a journal, with the
+ * backend -i names: -w write, randwrite, read or randread, in blocks of -b
+ * bytes, with an fsync every -n writes. Prints the throughput and the
+ * latency percentiles of the operations, fsync included.
+ */
+static void bench_fio(void){
+	bool writes = strstr(bopts.rw, "write") != NULL, random = strncmp(bopts.rw, "rand", 4) == 0;
+	if (strcmp(bopts.rw + (random ? 4 : 0), writes ? "write" : "read") != 0) die("-w must be write, randwrite, read or randread");
+	if (bopts.bs == 0 || bopts.bs > (1 << 20) || bopts.bs % 512) die("-b must be a multiple of 512 up to 1 MiB");
+	format(1024, 64, "-j 1024");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	uint64_t size = fs.size / 2 / bopts.bs * bopts.bs, blocks = size / bopts.bs;
+	size_t ops = random && blocks > 100000 ? 100000 : blocks;
+	char *buf = malloc(1 << 20);
+	double *times = malloc(ops * sizeof(double));
+	if (!buf || !times) die("out of memory");
+	memset(buf, 'f', 1 << 20);
+	a1fs_inode *file = create(&fs, get_inode(&fs, 1), "file", S_IFREG | 0644);
+	// reads and overwrites find the file there
+	if (!writes || random){
+		fill(&fs, file, buf, 1 << 20, size);
+		if (core_fsync(&fs, file) < 0) die("fsync failed");
+	}
+
+	a1fs_handle *handle = core_open(&fs, file);
+	uint32_t state = 2463534242u;
+	double start = now();
+	for (size_t i = 0; i < ops; i++){
+		uint64_t off = (random ? next_random(&state) % blocks : i) * bopts.bs;
+		double op = now();
+		if (writes){
+			buf[0] = i;
+			if (core_write(&fs, file, &handle->cursor, buf, bopts.bs, off) != (int)bopts.bs) die("write failed");
+			if (bopts.fsync_every && i % bopts.fsync_every == bopts.fsync_every - 1 && core_fsync(&fs, file) < 0) die("fsync failed");
+		} else if (core_read(&fs, file, &handle->cursor, buf, bopts.bs, off) != (int)bopts.bs){
+			die("read failed");
+		}
+		times[i] = now() - op;
+	}
+	if (writes && core_fsync(&fs, file) < 0) die("fsync failed");
+	double secs = now() - start;
+	core_release(&fs, handle);
+	qsort(times, ops, sizeof(double), compare_doubles);
+	printf("fio %s %s bs=%zu fsync=%u: %8.1f MB/s, %9.0f IOPS, latency us p50 %7.1f p99 %7.1f p99.9 %8.1f max %8.1f\n",
+	       fs.bdev->ops->name, bopts.rw, bopts.bs, bopts.fsync_every, ops * bopts.bs / secs / (1 << 20), ops / secs,
+	       times[ops / 2] * 1e6, times[ops * 99 / 100] * 1e6, times[ops * 999 / 1000] * 1e6, times[ops - 1] * 1e6);
+	free(times);
+	free(buf);
+	unmount(&fs, false);
+}
+
+/**
+ * Cold sequential read of a 512 MiB file on a 1 GiB image, in 128 KiB chunks
+ * as FUSE issues them, with the image dropped from the page cache before
+ * every run: without a handle, as if read-ahead were off, and through a
+ * handle that reads ahead (see readahead.h). Only a device with some latency
+ * shows a difference; put the image on one with -f.
+ */
+static void bench_coldread(void){
+	size_t chunk = 128 * 1024;
+	format(1024, 64, "");
+	fs_ctx fs;
+	a1fs_opts opts = {0};
+	mount(&fs, &opts);
+	uint64_t size = 512ull << 20;
+	char *buf = malloc(1 << 20);
+	if (!buf) die("out of memory");
+	memset(buf, 'c', 1 << 20);
+	fill(&fs, create(&fs, get_inode(&fs, 1), "file", S_IFREG | 0644), buf, 1 << 20, size);
+	unmount(&fs, true);
+
+	for (int ra = 0; ra < 2; ra++){
+		double best = 0;
+		for (int run = 0; run < bopts.runs; run++){
+			mount(&fs, &opts);
+			a1fs_inode *file;
+			if (core_lookup(&fs, get_inode(&fs, 1), "file", &file) < 0) die("lookup failed");
+			a1fs_handle *handle = core_open(&fs, file);
+			double start = now();
+			for (uint64_t off = 0; off < size; off += chunk){
+				if (core_read(&fs, file, ra ? &handle->cursor : NULL, buf, chunk, off) != (int)chunk) die("read failed");
+			}
+			double mbs = (size >> 20) / (now() - start);
+			if (mbs > best) best = mbs;
+			core_release(&fs, handle);
+			unmount(&fs, true);
+		}
+		printf("coldread %s, %4zu KiB chunks: %8.0f MB/s\n", ra ? "read-ahead   " : "no read-ahead", chunk / 1024, best);
+	}
+	free(buf);
+}
+
+
+typedef struct bench {
+	const char *name;
+	void (*run)(void);
+	const char *help;
+} bench;
+
+static const bench benches[] = {
+	{ "read", bench_read, "sequential read MB/s of a 192 MiB file on a 256 MiB image" },
+	{ "write", bench_write, "sequential append and overwrite MB/s of a 192 MiB file" },
+	{ "alloc", bench_alloc, "time to allocate every block of a 1 GiB image one at a time" },
+	{ "extents", bench_extents, "extents per file of 8 MiB files written on a fragmented image" },
+	{ "stat", bench_stat, "random stat() in a directory of 100k entries, indexed and scanned" },
+	{ "parallel", bench_parallel, "read, write and metadata throughput of 1 to 8 threads" },
+	{ "truncate", bench_truncate, "time to grow and shrink a 1 GiB file, and to empty a directory" },
+	{ "scan", bench_scan, "readdir time and cache misses of 100k files, fixed and compact entries" },
+	{ "upgrade", bench_upgrade, "check that an image from before extent trees mounts and works" },
+	{ "fsync", bench_fsync, "fsync latency of ranges against whole image msync" },
+	{ "synced", bench_synced, "check that syncing the dirty ranges syncs every changed block" },
+	{ "backends", bench_backends, "the mmap, pwrite and uring I/O backends compared" },
+	{ "fio", bench_fio, "fio-like I/O with -w pattern, -b block size, -n fsync interval" },
+	{ "coldread", bench_coldread, "cold sequential read MB/s with and without read-ahead" },
+};
+
+static void usage(void){
+	fprintf(stderr, "Usage: bench <benchmark> [-f image] [-m mkfs] [-o \"mkfs options\"] [-s MiB] [-i backend] [-r runs]\n"
+	                "                   [-w write|randwrite|read|randread] [-b bytes] [-n writes per fsync]\n\n");
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+		fprintf(stderr, "  %-10s %s\n", benches[i].name, benches[i].help);
+	}
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	if (argc < 2) usage();
+	const bench *b = NULL;
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+		if (strcmp(benches[i].name, argv[1]) == 0) b = &benches[i];
+	}
+	if (!b) usage();
+	int opt;
+	optind = 2;
+	while ((opt = getopt(argc, argv, "f:m:o:s:i:r:w:b:n:")) != -1){
+		switch (opt){
+		case 'f': bopts.image = optarg; break;
+		case 'm': bopts.mkfs = optarg; break;
+		case 'o': bopts.format = optarg; break;
+		case 's': bopts.size = strtoul(optarg, NULL, 10); break;
+		case 'i': bopts.io = optarg; break;
+		case 'r': bopts.runs = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'w': bopts.rw = optarg; break;
+		case 'b': bopts.bs = strtoul(optarg, NULL, 10); break;
+		case 'n': bopts.fsync_every = strtoul(optarg, NULL, 10); break;
+		default: usage();
+		}
+	}
+	b->run();
+	unlink(bopts.image);
+	return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dalloc.h"
+#include "dirty.h"
+#include "extree.h"
+#include "fs_core.h"
+
+
+bool dalloc_init(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	fs->dallocs = calloc(sp->max_inodes_count, sizeof(a1fs_dalloc*));
+	if (!fs->dallocs) return false;
+	fs->dalloc_count = sp->max_inodes_count;
+	fs->reserved_blocks = 0;
+	return true;
+}
+
+/** Free the buffer of inode number ino and give back its reservation. */
+static void free_dalloc(fs_ctx *fs, a1fs_ino_t ino){
+	a1fs_dalloc *da = fs->dallocs[ino];
+	if (!da) return;
+	pthread_mutex_lock(&fs->block_lock);
+	fs->reserved_blocks -= da->reserved;
+	pthread_mutex_unlock(&fs->block_lock);
+	free(da->data);
+	free(da);
+	fs->dallocs[ino] = NULL;
+}
+
+void dalloc_destroy(fs_ctx *fs){
+	if (!fs->dallocs) return;
+	for (a1fs_ino_t ino = 0; ino < fs->dalloc_count; ino++){
+		if (fs->dallocs[ino]){
+			free(fs->dallocs[ino]->data);
+			free(fs->dallocs[ino]);
+		}
+	}
+	free(fs->dallocs);
+	fs->dallocs = NULL;
+}
+
+a1fs_dalloc *dalloc_get(fs_ctx *fs, a1fs_inode *inode){
+	return fs->dallocs[get_ino(fs, inode)];
+}
+
+
+/**
+ * Number of blocks that growing inode by len bytes takes: the data blocks,
+ * the indirect block of a file that has none, and the extent tree nodes of
+ * one new extent
+ */
+static uint32_t blocks_needed(fs_ctx *fs, a1fs_inode *inode, uint64_t len){
+	uint64_t end = inode->size + len;
+	if (inode->blocks == 0){
+		// inline data moves to the first block along with the new data
+		if (end <= inline_capacity(fs)) return 0;
+		return (end + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE + 1;
+	}
+	uint64_t old_blocks = (inode->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	uint64_t new_blocks = (end + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	return new_blocks - old_blocks + extree_nodes_needed(inode);
+}
+
+int dalloc_append(fs_ctx *fs, a1fs_inode *inode, const char *buf, size_t size){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	a1fs_ino_t ino = get_ino(fs, inode);
+	if (size > A1FS_DALLOC_MAX) return 1;
+	a1fs_dalloc *da = fs->dallocs[ino];
+	if (da && da->len + size > A1FS_DALLOC_MAX){
+		int result = dalloc_flush(fs, inode);
+		if (result < 0) return result;
+		da = NULL;
+	}
+	size_t len = da ? da->len : 0;
+	uint32_t need = blocks_needed(fs, inode, len + size);
+	// nothing to save for data that stays inline
+	if (need == 0) return 1;
+	if (!da){
+		da = calloc(1, sizeof(a1fs_dalloc));
+		if (!da) return 1;
+		fs->dallocs[ino] = da;
+	}
+	if (len + size > da->cap){
+		size_t cap = da->cap ? da->cap : A1FS_BLOCK_SIZE;
+		while (cap < len + size) cap *= 2;
+		if (cap > A1FS_DALLOC_MAX) cap = A1FS_DALLOC_MAX;
+		char *data = realloc(da->data, cap);
+		if (!data) return 1;
+		da->data = data;
+		da->cap = cap;
+	}
+	// most appends fit in blocks that are reserved already
+	if (need > da->reserved){
+		pthread_mutex_lock(&fs->block_lock);
+		if (sp->free_blocks_count - fs->reserved_blocks < need - da->reserved){
+			pthread_mutex_unlock(&fs->block_lock);
+			return 1;
+		}
+		fs->reserved_blocks += need - da->reserved;
+		da->reserved = need;
+		pthread_mutex_unlock(&fs->block_lock);
+	}
+	memcpy(da->data + len, buf, size);
+	da->len = len + size;
+	return 0;
+}
+
+size_t dalloc_read(fs_ctx *fs, a1fs_inode *inode, char *buf, uint64_t pos, size_t size){
+	a1fs_dalloc *da = dalloc_get(fs, inode);
+	if (!da || pos >= da->len) return 0;
+	if (size > da->len - pos) size = da->len - pos;
+	memcpy(buf, da->data + pos, size);
+	return size;
+}
+
+int dalloc_flush(fs_ctx *fs, a1fs_inode *inode){
+	a1fs_ino_t ino = get_ino(fs, inode);
+	a1fs_dalloc *da = fs->dallocs[ino];
+	if (!da) return 0;
+	if (da->len > 0){
+		uint64_t offset = inode->size;
+		// the reservation is given back as the blocks are taken
+		int result = alloc_data(fs, inode, da->len, da->reserved);
+		if (result < 0) return result;
+		da->reserved = 0;
+		// copy one contiguous run (the rest of an extent) at a time
+		a1fs_run run;
+		size_t copied = 0;
+		find_run(fs, inode, offset, da->len, &run);
+		while (1){
+			memcpy(run.ptr, da->data + copied, run.len);
+			dirty_mark(fs, inode, run.ptr, run.len);
+			copied += run.len;
+			if (copied == da->len) break;
+			next_run(fs, &run, da->len - copied);
+		}
+	}
+	free_dalloc(fs, ino);
+	return 0;
+}
+
+void dalloc_drop(fs_ctx *fs, a1fs_inode *inode){
+	free_dalloc(fs, get_ino(fs, inode));
+}
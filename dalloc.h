@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Most bytes buffered for one file before they are allocated. */
+#define A1FS_DALLOC_MAX (1024 * 1024)
+
+/**
+ * Delayed allocation of appended data.
+ *
+ * Appends to a regular file are kept in memory past the end of its on-disk
+ * data, inode->size, instead of growing it on every write. The blocks they
+ * will need are only reserved, in fs->reserved_blocks, so that other files
+ * can't take them. When the file is flushed, released or truncated, or the
+ * buffer is full, the whole buffer is allocated at once, which takes few
+ * contiguous extents however small the appends were.
+ *
+ * The size of a file is inode->size plus the buffered bytes. A buffer is
+ * changed under the write lock of its inode and read under the read lock.
+ */
+typedef struct a1fs_dalloc {
+	/** Data that follows inode->size. */
+	char *data;
+	/** Number of bytes buffered. */
+	size_t len;
+	/** Size of data. */
+	size_t cap;
+	/** Number of blocks reserved for the data and the nodes that map it. */
+	uint32_t reserved;
+} a1fs_dalloc;
+
+/** Allocate the table of buffers; return false on failure. */
+bool dalloc_init(fs_ctx *fs);
+
+/** Free the table of buffers and the data still in them. */
+void dalloc_destroy(fs_ctx *fs);
+
+/** Get the buffer of inode; NULL if nothing is buffered. */
+a1fs_dalloc *dalloc_get(fs_ctx *fs, a1fs_inode *inode);
+
+/**
+ * Buffer size bytes appended to the regular file inode.
+ *
+ * A full buffer is flushed first. Writes that fit inline or are larger than a
+ * buffer are not buffered, nor are writes that don't get the memory or the
+ * reservation they need; the caller writes them directly.
+ *
+ * @return  0 if the data is buffered; 1 if the caller must write it; -errno
+ *          if the buffer could not be flushed (see dalloc_flush()).
+ */
+int dalloc_append(fs_ctx *fs, a1fs_inode *inode, const char *buf, size_t size);
+
+/**
+ * Copy up to size bytes of buffered data, starting pos bytes past inode->size.
+ *
+ * @return  number of bytes copied.
+ */
+size_t dalloc_read(fs_ctx *fs, a1fs_inode *inode, char *buf, uint64_t pos, size_t size);
+
+/**
+ * Allocate and write out the buffered data of inode.
+ *
+ * Errors:
+ *   ENOSPC  the free space is too fragmented for the extents the data needs;
+ *           the data stays buffered.
+ */
+int dalloc_flush(fs_ctx *fs, a1fs_inode *inode);
+
+/** Throw away the buffered data of inode, which is being freed. */
+void dalloc_drop(fs_ctx *fs, a1fs_inode *inode);
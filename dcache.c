@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+
+/** Allocate the path cache; return false on failure. */
+bool dcache_init(fs_ctx *fs){
+	fs->dcache = calloc(1, sizeof(a1fs_dcache));
+	if (!fs->dcache) return false;
+	pthread_mutex_init(&fs->dcache->lock, NULL);
+	return true;
+}
+
+/** Free the path cache. */
+void dcache_destroy(fs_ctx *fs){
+	if (!fs->dcache) return;
+	for (int i = 0; i < A1FS_DCACHE_SLOTS; i++){
+		free(fs->dcache->entries[i].path);
+	}
+	pthread_mutex_destroy(&fs->dcache->lock);
+	free(fs->dcache);
+	fs->dcache = NULL;
+}
+
+/** Hash of a path (FNV-1a). */
+uint32_t dcache_hash(const char *path){
+	uint32_t hash = 2166136261u;
+	for (; *path; path++){
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	}
+	return hash;
+}
+
+/** Look up path in the cache. */
+long dcache_lookup(fs_ctx *fs, const char *path, uint32_t hash){
+	a1fs_dcache_entry *entry = &fs->dcache->entries[hash & (A1FS_DCACHE_SLOTS - 1)];
+	long ino = -1;
+	pthread_mutex_lock(&fs->dcache->lock);
+	if (entry->path && entry->hash == hash && strcmp(entry->path, path) == 0){
+		ino = entry->ino;
+		if (ino){
+			fs->dcache->hits++;
+		} else {
+			fs->dcache->negative_hits++;
+		}
+	} else {
+		fs->dcache->misses++;
+	}
+	pthread_mutex_unlock(&fs->dcache->lock);
+	return ino;
+}
+
+/** Current generation of the cache. */
+uint64_t dcache_generation(fs_ctx *fs){
+	pthread_mutex_lock(&fs->dcache->lock);
+	uint64_t generation = fs->dcache->generation;
+	pthread_mutex_unlock(&fs->dcache->lock);
+	return generation;
+}
+
+/** Cache that path resolves to ino, unless a path was changed since generation or is being changed. */
+void dcache_insert(fs_ctx *fs, const char *path, uint32_t hash, a1fs_ino_t ino, uint64_t generation){
+	a1fs_dcache_entry *entry = &fs->dcache->entries[hash & (A1FS_DCACHE_SLOTS - 1)];
+	char *copy = strdup(path);
+	pthread_mutex_lock(&fs->dcache->lock);
+	// the walk may have read what a change since then, or under way, changed
+	if (fs->dcache->generation != generation || fs->dcache->changing > 0){
+		pthread_mutex_unlock(&fs->dcache->lock);
+		free(copy);
+		return;
+	}
+	// caching is optional, so running out of memory only loses the entry
+	free(entry->path);
+	entry->path = copy;
+	entry->hash = hash;
+	entry->ino = ino;
+	pthread_mutex_unlock(&fs->dcache->lock);
+}
+
+/** Forget path, but not the paths below it, before it is created or removed. */
+void dcache_remove(fs_ctx *fs, const char *path){
+	uint32_t hash = dcache_hash(path);
+	a1fs_dcache_entry *entry = &fs->dcache->entries[hash & (A1FS_DCACHE_SLOTS - 1)];
+	pthread_mutex_lock(&fs->dcache->lock);
+	fs->dcache->generation++;
+	fs->dcache->changing++;
+	if (entry->path && entry->hash == hash && strcmp(entry->path, path) == 0){
+		free(entry->path);
+		entry->path = NULL;
+	}
+	pthread_mutex_unlock(&fs->dcache->lock);
+}
+
+/** Forget path and every path below it, before it is renamed. */
+void dcache_invalidate(fs_ctx *fs, const char *path){
+	size_t len = strlen(path);
+	pthread_mutex_lock(&fs->dcache->lock);
+	fs->dcache->generation++;
+	fs->dcache->changing++;
+	for (int i = 0; i < A1FS_DCACHE_SLOTS; i++){
+		a1fs_dcache_entry *entry = &fs->dcache->entries[i];
+		if (entry->path && strncmp(entry->path, path, len) == 0 &&
+		    (entry->path[len] == '\0' || entry->path[len] == '/')){
+			free(entry->path);
+			entry->path = NULL;
+		}
+	}
+	pthread_mutex_unlock(&fs->dcache->lock);
+}
+
+/** Finish a change started with dcache_remove() or dcache_invalidate(). */
+void dcache_done(fs_ctx *fs){
+	pthread_mutex_lock(&fs->dcache->lock);
+	// walks that started during the change may have read it half done
+	fs->dcache->generation++;
+	fs->dcache->changing--;
+	pthread_mutex_unlock(&fs->dcache->lock);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of paths cached at the same time. Must be a power of 2. */
+#define A1FS_DCACHE_SLOTS 4096
+
+/** One cached path. */
+typedef struct a1fs_dcache_entry {
+	/** Full path; NULL if the slot is unused. */
+	char *path;
+	/** Hash of the path. */
+	uint32_t hash;
+	/** Inode number the path resolves to; 0 for a negative entry. */
+	a1fs_ino_t ino;
+} a1fs_dcache_entry;
+
+/**
+ * Path to inode cache ("dcache").
+ *
+ * Maps full paths to inode numbers. Negative entries remember paths that do
+ * not exist. Each path has a single slot chosen by its hash, so inserting a
+ * path replaces whatever was cached in that slot.
+ *
+ * A path is resolved without the cache lock, so a rename or unlink may change
+ * it after the walk read it and before its result is inserted. A path is
+ * forgotten before it is changed, with dcache_remove() or dcache_invalidate(),
+ * so that no lookup finds the old inode while it is being freed, and nothing
+ * is inserted until the change is done with dcache_done(). Both bump the
+ * generation; a walk reads it with dcache_generation() before it starts, and
+ * its result is not inserted if the generation changed since.
+ */
+typedef struct a1fs_dcache {
+	/** Protects the entries and the counters. */
+	pthread_mutex_t lock;
+	a1fs_dcache_entry entries[A1FS_DCACHE_SLOTS];
+	/** Lookups answered with an inode. */
+	uint64_t hits;
+	/** Lookups answered with a negative entry. */
+	uint64_t negative_hits;
+	/** Lookups that had to walk the path. */
+	uint64_t misses;
+	/** Number of dcache_remove(), dcache_invalidate() and dcache_done() calls. */
+	uint64_t generation;
+	/** Number of changes started with dcache_remove() or dcache_invalidate() and not done yet. */
+	uint32_t changing;
+} a1fs_dcache;
+
+/** Allocate the path cache; return false on failure. */
+bool dcache_init(fs_ctx *fs);
+
+/** Free the path cache. */
+void dcache_destroy(fs_ctx *fs);
+
+/** Hash of a path. */
+uint32_t dcache_hash(const char *path);
+
+/**
+ * Look up path in the cache.
+ *
+ * @return  inode number on a hit; 0 on a negative hit; -1 on a miss.
+ */
+long dcache_lookup(fs_ctx *fs, const char *path, uint32_t hash);
+
+/** Current generation of the cache, to pass to dcache_insert(). */
+uint64_t dcache_generation(fs_ctx *fs);
+
+/**
+ * Cache that path resolves to ino, or that it does not exist if ino is 0,
+ * unless a path was changed since the cache was at generation, or is being
+ * changed.
+ */
+void dcache_insert(fs_ctx *fs, const char *path, uint32_t hash, a1fs_ino_t ino, uint64_t generation);
+
+/** Forget path, but not the paths below it, before it is created or removed; see dcache_done(). */
+void dcache_remove(fs_ctx *fs, const char *path);
+
+/** Forget path and every path below it, before it is renamed; see dcache_done(). */
+void dcache_invalidate(fs_ctx *fs, const char *path);
+
+/** Finish the change of a path started with dcache_remove() or dcache_invalidate(), whether it failed or not. */
+void dcache_done(fs_ctx *fs);
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+
+#include "dindex.h"
+
+
+/** Allocate the directory index cache; return false on failure. */
+bool dindex_init(fs_ctx *fs){
+	fs->dindexes = calloc(A1FS_DINDEX_SLOTS, sizeof(a1fs_dindex));
+	if (!fs->dindexes) return false;
+	pthread_mutex_init(&fs->dindex_lock, NULL);
+	return true;
+}
+
+/** Free the directory index cache and every index in it. */
+void dindex_destroy(fs_ctx *fs){
+	if (!fs->dindexes) return;
+	for (int i = 0; i < A1FS_DINDEX_SLOTS; i++){
+		free(fs->dindexes[i].slots);
+	}
+	pthread_mutex_destroy(&fs->dindex_lock);
+	free(fs->dindexes);
+	fs->dindexes = NULL;
+}
+
+/** Hash of a directory entry name (FNV-1a). */
+uint32_t dindex_hash(const char *name){
+	uint32_t hash = 2166136261u;
+	for (; *name; name++){
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	}
+	return hash;
+}
+
+/** Get the cached index of directory ino; NULL if it is not cached. */
+a1fs_dindex *dindex_get(fs_ctx *fs, a1fs_ino_t ino){
+	for (int i = 0; i < A1FS_DINDEX_SLOTS; i++){
+		if (fs->dindexes[i].ino == ino){
+			fs->dindexes[i].stamp = ++fs->dindex_clock;
+			return &fs->dindexes[i];
+		}
+	}
+	return NULL;
+}
+
+/** Create an empty index for directory ino, evicting the least recently used one. */
+a1fs_dindex *dindex_create(fs_ctx *fs, a1fs_ino_t ino, uint32_t count){
+	a1fs_dindex *idx = &fs->dindexes[0];
+	for (int i = 1; i < A1FS_DINDEX_SLOTS; i++){
+		if (fs->dindexes[i].stamp < idx->stamp) idx = &fs->dindexes[i];
+	}
+	free(idx->slots);
+	// keep the load factor at most 1/2
+	uint32_t nslots = 16;
+	while (nslots < 2 * count) nslots *= 2;
+	idx->slots = calloc(nslots, sizeof(a1fs_dindex_slot));
+	if (!idx->slots){
+		idx->ino = 0;
+		idx->stamp = 0;
+		return NULL;
+	}
+	idx->ino = ino;
+	idx->mask = nslots - 1;
+	idx->count = 0;
+	idx->stamp = ++fs->dindex_clock;
+	return idx;
+}
+
+/** Forget the index of directory ino, if any. */
+void dindex_drop(fs_ctx *fs, a1fs_ino_t ino){
+	for (int i = 0; i < A1FS_DINDEX_SLOTS; i++){
+		if (fs->dindexes[i].ino == ino){
+			free(fs->dindexes[i].slots);
+			fs->dindexes[i].slots = NULL;
+			fs->dindexes[i].ino = 0;
+			fs->dindexes[i].stamp = 0;
+		}
+	}
+}
+
+/** Put an entry into the first empty bucket of its probe sequence. */
+static void put_slot(a1fs_dindex_slot *slots, uint32_t mask, a1fs_dindex_slot slot){
+	uint32_t i = slot.hash & mask;
+	while (slots[i].pos) i = (i + 1) & mask;
+	slots[i] = slot;
+}
+
+/** Add entry with given name hash and position to the index. */
+bool dindex_insert(fs_ctx *fs, a1fs_dindex *idx, uint32_t hash, uint32_t pos){
+	if (2 * (idx->count + 1) > idx->mask + 1){
+		// double the number of buckets
+		uint32_t mask = 2 * idx->mask + 1;
+		a1fs_dindex_slot *slots = calloc(mask + 1, sizeof(a1fs_dindex_slot));
+		if (!slots){
+			dindex_drop(fs, idx->ino);
+			return false;
+		}
+		for (uint32_t i = 0; i <= idx->mask; i++){
+			if (idx->slots[i].pos) put_slot(slots, mask, idx->slots[i]);
+		}
+		free(idx->slots);
+		idx->slots = slots;
+		idx->mask = mask;
+	}
+	put_slot(idx->slots, idx->mask, (a1fs_dindex_slot){ hash, pos + 1 });
+	idx->count++;
+	return true;
+}
+
+/** Remove entry with given name hash and position from the index. */
+void dindex_remove(a1fs_dindex *idx, uint32_t hash, uint32_t pos){
+	uint32_t i = hash & idx->mask;
+	while (idx->slots[i].pos && idx->slots[i].pos != pos + 1){
+		i = (i + 1) & idx->mask;
+	}
+	if (!idx->slots[i].pos) return;
+	idx->count--;
+	// shift back the entries that follow so that no probe sequence is broken
+	uint32_t hole = i;
+	for (i = (i + 1) & idx->mask; idx->slots[i].pos; i = (i + 1) & idx->mask){
+		uint32_t home = idx->slots[i].hash & idx->mask;
+		// the entry may move to the hole only if its home is not in (hole, i]
+		if (((i - home) & idx->mask) >= ((i - hole) & idx->mask)){
+			idx->slots[hole] = idx->slots[i];
+			hole = i;
+		}
+	}
+	idx->slots[hole].pos = 0;
+}
+
+/** Find the next candidate entry for a name hash. */
+long dindex_find(const a1fs_dindex *idx, uint32_t hash, uint32_t *bucket){
+	uint32_t i = *bucket & idx->mask;
+	while (idx->slots[i].pos){
+		const a1fs_dindex_slot *slot = &idx->slots[i];
+		i = (i + 1) & idx->mask;
+		if (slot->hash == hash){
+			*bucket = i;
+			return slot->pos - 1;
+		}
+	}
+	*bucket = i;
+	return -1;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of directories whose index is cached at the same time. */
+#define A1FS_DINDEX_SLOTS 8
+
+/** Directories smaller than this, in bytes, are searched linearly. */
+#define A1FS_DINDEX_MIN_SIZE A1FS_BLOCK_SIZE
+
+/** One bucket of a directory index. */
+typedef struct a1fs_dindex_slot {
+	/** Hash of the entry name. */
+	uint32_t hash;
+	/** Position of the entry in the directory plus one; 0 if the bucket is empty. */
+	uint32_t pos;
+} a1fs_dindex_slot;
+
+/**
+ * In-memory hash index of the entries of one directory, keyed by name.
+ *
+ * Buckets only hold the name hash and the position of the entry (see dir.h), so a lookup
+ * must still compare the name of every candidate with the one it wants.
+ *
+ * None of the functions below lock; callers hold fs->dindex_lock for as long
+ * as they use an index.
+ */
+typedef struct a1fs_dindex {
+	/** Directory inode number; 0 if the slot is unused. */
+	a1fs_ino_t ino;
+	/** Number of buckets minus one; the number of buckets is a power of 2. */
+	uint32_t mask;
+	/** Number of entries in the index. */
+	uint32_t count;
+	/** Last time the index was used, for eviction. */
+	uint64_t stamp;
+	/** Buckets, open addressing with linear probing. */
+	a1fs_dindex_slot *slots;
+} a1fs_dindex;
+
+/** Allocate the directory index cache; return false on failure. */
+bool dindex_init(fs_ctx *fs);
+
+/** Free the directory index cache and every index in it. */
+void dindex_destroy(fs_ctx *fs);
+
+/** Hash of a directory entry name. */
+uint32_t dindex_hash(const char *name);
+
+/** Get the cached index of directory ino; NULL if it is not cached. */
+a1fs_dindex *dindex_get(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Create an empty index for directory ino, evicting the least recently used
+ * index if the cache is full.
+ *
+ * @param fs     file system context.
+ * @param ino    directory inode number.
+ * @param count  expected number of entries.
+ * @return       the new index; NULL if out of memory.
+ */
+a1fs_dindex *dindex_create(fs_ctx *fs, a1fs_ino_t ino, uint32_t count);
+
+/** Forget the index of directory ino, if any. */
+void dindex_drop(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Add entry with given name hash and position to the index.
+ *
+ * @return  true on success; false if out of memory, in which case the index
+ *          has been dropped.
+ */
+bool dindex_insert(fs_ctx *fs, a1fs_dindex *idx, uint32_t hash, uint32_t pos);
+
+/** Remove entry with given name hash and position from the index. */
+void dindex_remove(a1fs_dindex *idx, uint32_t hash, uint32_t pos);
+
+/**
+ * Find the next candidate entry for a name hash.
+ *
+ * Start with *bucket = hash and call again with the same bucket to get the
+ * next candidate.
+ *
+ * @return  position of the candidate entry; -1 if there are no more candidates.
+ */
+long dindex_find(const a1fs_dindex *idx, uint32_t hash, uint32_t *bucket);
@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <string.h>
+
+#include "dir.h"
+#include "dindex.h"
+#include "dirty.h"
+#include "htree.h"
+
+
+/** Whether the directories of the image use compact records. */
+static bool compact(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	return sp->features & A1FS_FEATURE_COMPACT_DIRS;
+}
+
+/** Get the record at pos of dir. */
+static char *get_record(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	a1fs_run run;
+	find_run(fs, dir, pos, 1, &run);
+	return run.ptr;
+}
+
+/** Decode the record at ptr, which is at pos of its directory; return its length. */
+static size_t read_record(fs_ctx *fs, char *ptr, uint64_t pos, a1fs_dirent *dirent){
+	size_t len;
+	if (compact(fs)){
+		a1fs_cdentry *cd = (a1fs_cdentry*)ptr;
+		dirent->ino = cd->ino;
+		dirent->name = cd->name;
+		len = cd->rec_len;
+	} else {
+		a1fs_dentry *dentry = (a1fs_dentry*)ptr;
+		dirent->ino = dentry->ino;
+		dirent->name = dentry->name;
+		len = sizeof(a1fs_dentry);
+	}
+	dirent->pos = pos;
+	dirent->next = pos + len;
+	return len;
+}
+
+/** Position of the first record of dir at or after pos. */
+static uint64_t first_record(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	if (!compact(fs)){
+		return (pos + sizeof(a1fs_dentry) - 1) / sizeof(a1fs_dentry) * sizeof(a1fs_dentry);
+	}
+	uint64_t rec = pos / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+	if (rec >= dir->size) return pos;
+	// walk the records of the block, pos may be inside one of them
+	char *block = get_record(fs, dir, rec);
+	while (rec < pos) rec += ((a1fs_cdentry*)(block + rec % A1FS_BLOCK_SIZE))->rec_len;
+	return rec;
+}
+
+int dir_iterate(fs_ctx *fs, a1fs_inode *dir, a1fs_cursor *cursor, uint64_t pos,
+                core_filler_t filler, void *buf){
+	pos = first_record(fs, dir, pos);
+	if (pos >= dir->size) return 0;
+	int result = 0;
+	// one extent run at a time; records never cross a block
+	a1fs_run run;
+	seek_run(fs, dir, cursor, pos, dir->size - pos, &run);
+	while (1){
+		size_t off = 0;
+		while (off < run.len && result == 0){
+			a1fs_dirent dirent;
+			off += read_record(fs, run.ptr + off, pos + off, &dirent);
+			if (dirent.ino) result = filler(buf, &dirent);
+		}
+		pos += off;
+		if (result != 0 || pos >= dir->size) break;
+		next_run(fs, &run, dir->size - pos);
+	}
+	save_cursor(fs, dir, cursor, &run);
+	return result;
+}
+
+
+/** Arguments of the filler() that builds a name index. */
+typedef struct index_buf {
+	fs_ctx *fs;
+	a1fs_dindex *idx;
+} index_buf;
+
+/** Add one entry to the index; stop if out of memory. */
+static int index_fill(void *buf, const a1fs_dirent *dirent){
+	index_buf *ib = (index_buf*)buf;
+	return !dindex_insert(ib->fs, ib->idx, dindex_hash(dirent->name), dirent->pos);
+}
+
+/**
+ * Get the name index of dir, building it if it is not cached
+ * Return NULL if there is not enough memory for the index
+ * fs->dindex_lock must be held
+ */
+static a1fs_dindex *get_dindex(fs_ctx *fs, a1fs_inode *dir){
+	a1fs_ino_t ino = get_ino(fs, dir);
+	a1fs_dindex *idx = dindex_get(fs, ino);
+	if (idx) return idx;
+	// compact records are rarely longer than a short name needs
+	size_t rec_len = compact(fs) ? A1FS_CDENTRY_LEN(16) : sizeof(a1fs_dentry);
+	idx = dindex_create(fs, ino, dir->size / rec_len);
+	if (!idx) return NULL;
+	index_buf ib = { fs, idx };
+	if (dir_iterate(fs, dir, NULL, 0, index_fill, &ib) != 0) return NULL;
+	return idx;
+}
+
+/** Whether dir has an on-disk index. */
+static bool indexed(fs_ctx *fs, a1fs_inode *dir){
+	return htree_enabled(fs) && dir->dir_index != 0;
+}
+
+/** Record in the indexes of dir that the entry at pos is named name. */
+static void index_add(fs_ctx *fs, a1fs_inode *dir, const char *name, uint64_t pos){
+	if (indexed(fs, dir)){
+		htree_insert(fs, dir, dindex_hash(name), pos);
+		return;
+	}
+	a1fs_dindex *idx = dindex_get(fs, get_ino(fs, dir));
+	if (idx) dindex_insert(fs, idx, dindex_hash(name), pos);
+}
+
+/** Record in the indexes of dir that the entry at pos is no longer named name. */
+static void index_remove(fs_ctx *fs, a1fs_inode *dir, const char *name, uint64_t pos){
+	if (indexed(fs, dir)){
+		htree_remove(fs, dir, dindex_hash(name), pos);
+		return;
+	}
+	a1fs_dindex *idx = dindex_get(fs, get_ino(fs, dir));
+	if (idx) dindex_remove(idx, dindex_hash(name), pos);
+}
+
+
+/** Arguments of the filler() that builds an on-disk index. */
+typedef struct htree_buf {
+	fs_ctx *fs;
+	a1fs_inode *dir;
+} htree_buf;
+
+/** Add one entry to the on-disk index; stop if out of space. */
+static int htree_fill(void *buf, const a1fs_dirent *dirent){
+	htree_buf *hb = (htree_buf*)buf;
+	return !htree_insert(hb->fs, hb->dir, dindex_hash(dirent->name), dirent->pos);
+}
+
+/**
+ * Give dir an on-disk index of its entries
+ * The directory stays without one if there is not enough free space
+ * fs->dindex_lock must be held
+ */
+static void build_htree(fs_ctx *fs, a1fs_inode *dir){
+	if (htree_create(fs, dir) < 0) return;
+	// the on-disk index replaces the cached one
+	dindex_drop(fs, get_ino(fs, dir));
+	htree_buf hb = { fs, dir };
+	dir_iterate(fs, dir, NULL, 0, htree_fill, &hb);
+}
+
+
+/** Arguments of the filler() that searches a directory linearly. */
+typedef struct find_buf {
+	const char *name;
+	a1fs_ino_t ino;
+	long pos;
+} find_buf;
+
+/** Stop at the entry called fb->name. */
+static int find_fill(void *buf, const a1fs_dirent *dirent){
+	find_buf *fb = (find_buf*)buf;
+	if (strcmp(fb->name, dirent->name) != 0) return 0;
+	fb->ino = dirent->ino;
+	fb->pos = dirent->pos;
+	return 1;
+}
+
+long dir_find(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t *ino){
+	if (indexed(fs, dir)){
+		// a cold lookup reads one index block per level and the candidates
+		a1fs_hiter it;
+		long pos;
+		htree_seek(fs, dir, dindex_hash(name), &it);
+		while ((pos = htree_next(fs, &it)) >= 0){
+			a1fs_dirent dirent;
+			read_record(fs, get_record(fs, dir, pos), pos, &dirent);
+			if (strcmp(name, dirent.name) == 0){
+				*ino = dirent.ino;
+				break;
+			}
+		}
+		return pos;
+	}
+	if (dir->size >= A1FS_DINDEX_MIN_SIZE){
+		pthread_mutex_lock(&fs->dindex_lock);
+		a1fs_dindex *idx = get_dindex(fs, dir);
+		if (idx){
+			// only the entries whose name hash matches need to be compared
+			uint32_t hash = dindex_hash(name);
+			uint32_t bucket = hash;
+			long pos;
+			while ((pos = dindex_find(idx, hash, &bucket)) >= 0){
+				a1fs_dirent dirent;
+				read_record(fs, get_record(fs, dir, pos), pos, &dirent);
+				if (strcmp(name, dirent.name) == 0){
+					*ino = dirent.ino;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&fs->dindex_lock);
+			return pos;
+		}
+		pthread_mutex_unlock(&fs->dindex_lock);
+	}
+	find_buf fb = { name, 0, -1 };
+	dir_iterate(fs, dir, NULL, 0, find_fill, &fb);
+	if (fb.pos >= 0) *ino = fb.ino;
+	return fb.pos;
+}
+
+
+/** Length of name as stored in an entry; longer names are cut like in a1fs_dentry. */
+static size_t name_len(const char *name){
+	return strnlen(name, A1FS_NAME_MAX - 1);
+}
+
+/** Fill in the compact record cd, of length rec_len, with an entry. */
+static void set_cdentry(a1fs_cdentry *cd, uint16_t rec_len, const char *name, a1fs_ino_t ino){
+	cd->ino = ino;
+	cd->rec_len = rec_len;
+	cd->name_len = name_len(name);
+	cd->pad = 0;
+	memcpy(cd->name, name, cd->name_len);
+	cd->name[cd->name_len] = '\0';
+}
+
+/** Length of the records of the block of dir at block; inline records make up one short block. */
+static size_t block_len(a1fs_inode *dir, uint64_t block){
+	return dir->size - block < A1FS_BLOCK_SIZE ? dir->size - block : A1FS_BLOCK_SIZE;
+}
+
+/** Record that the record at pos of dir changed: its whole block, with compact records, which change together. */
+static void mark_record(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	if (compact(fs)){
+		uint64_t block = pos / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+		dirty_mark(fs, dir, get_record(fs, dir, block), block_len(dir, block));
+	} else {
+		dirty_mark(fs, dir, get_record(fs, dir, pos), sizeof(a1fs_dentry));
+	}
+}
+
+/** Put an entry into the slack of the block of dir at block; return its position, or -1 if there is not enough. */
+static long fill_slack(fs_ctx *fs, a1fs_inode *dir, uint64_t block, const char *name, a1fs_ino_t ino){
+	size_t need = A1FS_CDENTRY_LEN(name_len(name));
+	size_t len = block_len(dir, block);
+	char *ptr = get_record(fs, dir, block);
+	for (size_t off = 0; off < len; off += ((a1fs_cdentry*)(ptr + off))->rec_len){
+		a1fs_cdentry *cd = (a1fs_cdentry*)(ptr + off);
+		size_t used = cd->ino ? A1FS_CDENTRY_LEN(cd->name_len) : 0;
+		if (cd->rec_len - used < need) continue;
+		// split the slack off the record
+		uint16_t rec_len = cd->rec_len - used;
+		if (used) cd->rec_len = used;
+		set_cdentry((a1fs_cdentry*)(ptr + off + used), rec_len, name, ino);
+		return block + off + used;
+	}
+	return -1;
+}
+
+/** Add an entry to the compact directory dir; return its position or -errno. */
+static long add_cdentry(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t ino){
+	size_t need = A1FS_CDENTRY_LEN(name_len(name));
+	char *ptr;
+	int result;
+	uint64_t *hint = &fs->dir_hints[get_ino(fs, dir)];
+	if (dir->size > 0){
+		// new entries go to the slack left by removed entries, or else to the
+		// slack of the last block, if it has enough
+		uint64_t last = (dir->size - 1) / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+		for (uint64_t block = *hint < last ? *hint : last; block <= last; block += A1FS_BLOCK_SIZE){
+			long pos = fill_slack(fs, dir, block, name, ino);
+			if (pos >= 0) return pos;
+			*hint = block + A1FS_BLOCK_SIZE;
+		}
+	}
+	if (dir->size > 0 && dir->blocks == 0){
+		// the inline records are full; they move to the first block, the rest
+		// of which becomes slack of the last record
+		uint64_t old_size = dir->size;
+		result = add_data(fs, dir, &ptr, A1FS_BLOCK_SIZE - old_size);
+		if (result < 0) return result;
+		char *block = get_record(fs, dir, 0);
+		size_t last = 0;
+		while (last + ((a1fs_cdentry*)(block + last))->rec_len < old_size){
+			last += ((a1fs_cdentry*)(block + last))->rec_len;
+		}
+		((a1fs_cdentry*)(block + last))->rec_len += A1FS_BLOCK_SIZE - old_size;
+		long pos = fill_slack(fs, dir, 0, name, ino);
+		if (pos >= 0) return pos;
+	}
+	// else the entry starts a new block, or the inline records of an empty directory
+	size_t len = dir->size == 0 && need <= inline_capacity(fs) ? inline_capacity(fs) : A1FS_BLOCK_SIZE;
+	result = add_data(fs, dir, &ptr, len);
+	if (result < 0) return result;
+	set_cdentry((a1fs_cdentry*)ptr, len, name, ino);
+	return dir->size - len;
+}
+
+/** Add an entry to the directory dir of fixed size entries; return its position or -errno. */
+static long add_dentry(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t ino){
+	uint64_t *hint = &fs->dir_hints[get_ino(fs, dir)];
+	a1fs_dentry *dentry = NULL;
+	long pos = -1;
+	if (*hint < dir->size){
+		// the record of a removed entry, if there is one after the hint
+		a1fs_run run;
+		uint64_t done = 0, size = dir->size - *hint;
+		find_run(fs, dir, *hint, size, &run);
+		while (1){
+			for (size_t off = 0; off < run.len && pos < 0; off += sizeof(a1fs_dentry)){
+				if (((a1fs_dentry*)(run.ptr + off))->ino == 0){
+					dentry = (a1fs_dentry*)(run.ptr + off);
+					pos = *hint + done + off;
+				}
+			}
+			done += run.len;
+			if (pos >= 0 || done == size) break;
+			next_run(fs, &run, size - done);
+		}
+	}
+	if (pos < 0){
+		int result = add_data(fs, dir, (char**)&dentry, sizeof(a1fs_dentry));
+		if (result < 0) return result;
+		pos = dir->size - sizeof(a1fs_dentry);
+	}
+	*hint = pos + sizeof(a1fs_dentry);
+	dentry->ino = ino;
+	strncpy(dentry->name, name, A1FS_NAME_MAX);
+	dentry->name[A1FS_NAME_MAX - 1] = '\0';
+	return pos;
+}
+
+long dir_add(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t ino){
+	long pos = compact(fs) ? add_cdentry(fs, dir, name, ino) : add_dentry(fs, dir, name, ino);
+	if (pos < 0) return pos;
+	mark_record(fs, dir, pos);
+	pthread_mutex_lock(&fs->dindex_lock);
+	if (htree_enabled(fs) && !dir->dir_index && dir->size >= A1FS_HTREE_MIN_SIZE){
+		build_htree(fs, dir);
+	} else {
+		index_add(fs, dir, name, pos);
+	}
+	pthread_mutex_unlock(&fs->dindex_lock);
+	return pos;
+}
+
+int dir_rename(fs_ctx *fs, a1fs_inode *dir, uint64_t pos, const char *name){
+	char *ptr = get_record(fs, dir, pos);
+	a1fs_dirent dirent;
+	read_record(fs, ptr, pos, &dirent);
+	if (compact(fs) && A1FS_CDENTRY_LEN(name_len(name)) > ((a1fs_cdentry*)ptr)->rec_len){
+		// the new name does not fit into the record, move the entry
+		long result = dir_add(fs, dir, name, dirent.ino);
+		if (result < 0) return result;
+		dir_remove(fs, dir, pos);
+		return 0;
+	}
+	pthread_mutex_lock(&fs->dindex_lock);
+	index_remove(fs, dir, dirent.name, pos);
+	if (compact(fs)){
+		a1fs_cdentry *cd = (a1fs_cdentry*)ptr;
+		set_cdentry(cd, cd->rec_len, name, cd->ino);
+	} else {
+		a1fs_dentry *dentry = (a1fs_dentry*)ptr;
+		strncpy(dentry->name, name, A1FS_NAME_MAX);
+		dentry->name[A1FS_NAME_MAX - 1] = '\0';
+	}
+	mark_record(fs, dir, pos);
+	index_add(fs, dir, name, pos);
+	pthread_mutex_unlock(&fs->dindex_lock);
+	return 0;
+}
+
+
+/** Whether the block of compact records of dir at block holds no entries. */
+static bool block_empty(fs_ctx *fs, a1fs_inode *dir, uint64_t block){
+	a1fs_cdentry *first = (a1fs_cdentry*)get_record(fs, dir, block);
+	return first->ino == 0 && first->rec_len == block_len(dir, block);
+}
+
+/**
+ * Remove the entry at pos from the compact directory dir
+ * The record is merged into the one before it, so no other entry moves and a
+ * readdir() that is under way does not skip any. A block left without
+ * entries stays until new entries fill it, unless it is the last one; the
+ * last block of a directory always holds an entry
+ */
+static void remove_cdentry(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	uint64_t block = pos / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+	char *ptr = get_record(fs, dir, block);
+	a1fs_cdentry *cd = (a1fs_cdentry*)(ptr + pos % A1FS_BLOCK_SIZE);
+	index_remove(fs, dir, cd->name, pos);
+	if (pos == block){
+		cd->ino = 0;
+	} else {
+		size_t prev = 0;
+		while (prev + ((a1fs_cdentry*)(ptr + prev))->rec_len != pos % A1FS_BLOCK_SIZE){
+			prev += ((a1fs_cdentry*)(ptr + prev))->rec_len;
+		}
+		((a1fs_cdentry*)(ptr + prev))->rec_len += cd->rec_len;
+	}
+	mark_record(fs, dir, pos);
+	uint64_t *hint = &fs->dir_hints[get_ino(fs, dir)];
+	if (block < *hint) *hint = block;
+	// drop the empty blocks at the end
+	uint64_t size = dir->size;
+	while (size > 0 && block_empty(fs, dir, (size - 1) / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE)){
+		size = (size - 1) / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+	}
+	if (size == dir->size) return;
+	if (size < *hint) *hint = size;
+	pthread_mutex_unlock(&fs->dindex_lock);
+	delete_data(fs, dir, size, dir->size - size);
+	pthread_mutex_lock(&fs->dindex_lock);
+}
+
+/**
+ * Remove the entry at pos from the directory dir of fixed size entries
+ * The record is left unused, so no other entry moves and a readdir() that is
+ * under way does not skip any; dir_add() reuses it. The last record of a
+ * directory is always used
+ */
+static void remove_dentry(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	a1fs_dentry *dentry = (a1fs_dentry*)get_record(fs, dir, pos);
+	index_remove(fs, dir, dentry->name, pos);
+	dentry->ino = 0;
+	dentry->name[0] = '\0';
+	mark_record(fs, dir, pos);
+	uint64_t *hint = &fs->dir_hints[get_ino(fs, dir)];
+	if (pos < *hint) *hint = pos;
+	// drop the unused records at the end
+	uint64_t size = dir->size;
+	while (size > 0 && ((a1fs_dentry*)get_record(fs, dir, size - sizeof(a1fs_dentry)))->ino == 0){
+		size -= sizeof(a1fs_dentry);
+	}
+	if (size == dir->size) return;
+	if (size < *hint) *hint = size;
+	pthread_mutex_unlock(&fs->dindex_lock);
+	delete_data(fs, dir, size, dir->size - size);
+	pthread_mutex_lock(&fs->dindex_lock);
+}
+
+void dir_remove(fs_ctx *fs, a1fs_inode *dir, uint64_t pos){
+	pthread_mutex_lock(&fs->dindex_lock);
+	if (compact(fs)){
+		remove_cdentry(fs, dir, pos);
+	} else {
+		remove_dentry(fs, dir, pos);
+	}
+	if (indexed(fs, dir) && dir->size < A1FS_HTREE_MIN_SIZE / 2){
+		// small enough to be searched without it
+		htree_drop(fs, dir);
+	}
+	pthread_mutex_unlock(&fs->dindex_lock);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "fs_core.h"
+
+
+/**
+ * Directory entries, in either on-disk format.
+ *
+ * An entry is identified by its position, the byte offset of its record in
+ * the directory. Records are a1fs_dentry, or a1fs_cdentry when the superblock
+ * has A1FS_FEATURE_COMPACT_DIRS; nothing outside of dir.c depends on which.
+ *
+ * The caller holds the lock of the directory inode (see fs_core.h); the name
+ * index is locked here.
+ */
+
+
+/**
+ * Call filler for each entry of dir, starting from the one at pos.
+ *
+ * pos may be any position the directory had, e.g. the next position of an
+ * entry that has been removed since; iteration goes on from the first record
+ * at or after it.
+ *
+ * @param cursor  extent cursor of an open handle; NULL if there is none.
+ * @return        0 after the last entry; the non-zero value that stopped filler.
+ */
+int dir_iterate(fs_ctx *fs, a1fs_inode *dir, a1fs_cursor *cursor, uint64_t pos,
+                core_filler_t filler, void *buf);
+
+/**
+ * Find the entry called name in dir.
+ *
+ * Large directories are searched through their on-disk index (see htree.h),
+ * or else through their cached name index (see dindex.h).
+ *
+ * @param ino  receives the inode number of the entry.
+ * @return     position of the entry; -1 if there is none.
+ */
+long dir_find(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t *ino);
+
+/**
+ * Add an entry called name for inode ino to dir.
+ *
+ * The record of a removed entry is reused if the name fits into it, looking
+ * from fs->dir_hints, which removals lower; the directory grows otherwise.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @return  position of the new entry; -errno on error.
+ */
+long dir_add(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_ino_t ino);
+
+/**
+ * Rename the entry at pos of dir to name.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ */
+int dir_rename(fs_ctx *fs, a1fs_inode *dir, uint64_t pos, const char *name);
+
+/**
+ * Remove the entry at pos from dir.
+ *
+ * No other entry moves, so a readdir() that is under way returns every entry
+ * that is not removed. The record is left unused, or merged into the one
+ * before it, and the unused records at the end are dropped, so an empty
+ * directory has size 0.
+ */
+void dir_remove(fs_ctx *fs, a1fs_inode *dir, uint64_t pos);
@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bdev.h"
+#include "dirty.h"
+#include "fs_core.h"
+#include "journal.h"
+
+
+bool dirty_init(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	fs->writeback = calloc(1, sizeof(a1fs_writeback));
+	if (!fs->writeback) return false;
+	a1fs_writeback *wb = fs->writeback;
+	wb->inodes = calloc(sp->max_inodes_count, sizeof(a1fs_dirty*));
+	if (!wb->inodes) return false;
+	wb->inode_count = sp->max_inodes_count;
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_mutex_init(&wb->sync_lock, NULL);
+	pthread_mutex_init(&wb->flusher_lock, NULL);
+	// the flusher sleeps on the monotonic clock, which a date change does not move
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb->flusher_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return true;
+}
+
+void dirty_destroy(fs_ctx *fs){
+	a1fs_writeback *wb = fs->writeback;
+	if (!wb) return;
+	if (wb->inodes){
+		for (a1fs_ino_t ino = 0; ino < wb->inode_count; ino++) free(wb->inodes[ino]);
+		free(wb->inodes);
+		pthread_mutex_destroy(&wb->lock);
+		pthread_mutex_destroy(&wb->sync_lock);
+		pthread_mutex_destroy(&wb->flusher_lock);
+		pthread_cond_destroy(&wb->flusher_cond);
+	}
+	free(wb);
+	fs->writeback = NULL;
+}
+
+
+/** Add the blocks [start, end) to the sorted ranges of d, merging the two closest ranges if there are too many. */
+static void add_range(a1fs_dirty *d, a1fs_blk_t start, a1fs_blk_t end){
+	// most changes extend or repeat the last range
+	if (d->count > 0 && d->ranges[d->count - 1].start <= start && start <= d->ranges[d->count - 1].end){
+		if (end > d->ranges[d->count - 1].end) d->ranges[d->count - 1].end = end;
+		return;
+	}
+	// the first range that ends at or after start; every one before it stays as is
+	uint32_t i = 0;
+	while (i < d->count && d->ranges[i].end < start) i++;
+	// the ranges from i on that touch [start, end) are merged into it
+	uint32_t j = i;
+	while (j < d->count && d->ranges[j].start <= end){
+		if (d->ranges[j].start < start) start = d->ranges[j].start;
+		if (d->ranges[j].end > end) end = d->ranges[j].end;
+		j++;
+	}
+	if (j != i + 1){
+		memmove(&d->ranges[i + 1], &d->ranges[j], (d->count - j) * sizeof(a1fs_drange));
+		d->count = d->count + 1 - (j - i);
+	}
+	d->ranges[i] = (a1fs_drange){ start, end };
+	if (d->count <= A1FS_DIRTY_RANGES) return;
+	// one too many; the closest two become one, which syncs a few clean blocks
+	uint32_t best = 0;
+	for (uint32_t k = 1; k + 1 < d->count; k++){
+		if (d->ranges[k + 1].start - d->ranges[k].end < d->ranges[best + 1].start - d->ranges[best].end) best = k;
+	}
+	d->ranges[best].end = d->ranges[best + 1].end;
+	memmove(&d->ranges[best + 1], &d->ranges[best + 2], (d->count - best - 2) * sizeof(a1fs_drange));
+	d->count -= 1;
+}
+
+/** Blocks of the image that len bytes at ptr are in; false if they are not in the image. */
+static bool to_blocks(fs_ctx *fs, const void *ptr, size_t len, a1fs_blk_t *start, a1fs_blk_t *end){
+	const char *image = fs->image;
+	const char *p = ptr;
+	if (len == 0 || p < image || p >= image + fs->size) return false;
+	*start = (p - image) / A1FS_BLOCK_SIZE;
+	*end = (p - image + len - 1) / A1FS_BLOCK_SIZE + 1;
+	return true;
+}
+
+void dirty_mark(fs_ctx *fs, a1fs_inode *inode, const void *ptr, size_t len){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	a1fs_writeback *wb = fs->writeback;
+	a1fs_blk_t start, end;
+	if (!to_blocks(fs, ptr, len, &start, &end)) return;
+	// with a journal, only file data outside the inode is synced in place
+	bool inline_data = (const char*)ptr >= (const char*)inode && (const char*)ptr < (const char*)inode + sp->inode_size;
+	if (fs->journal && (!S_ISREG(inode->mode) || inline_data)){
+		journal_mark(fs, start, end);
+		return;
+	}
+	a1fs_ino_t ino = get_ino(fs, inode);
+	pthread_mutex_lock(&wb->lock);
+	a1fs_dirty *d = wb->inodes[ino];
+	if (!d){
+		d = calloc(1, sizeof(a1fs_dirty));
+		if (!d){
+			// without the memory to track it, the change is synced with the metadata
+			add_range(&wb->meta, start, end);
+			pthread_mutex_unlock(&wb->lock);
+			return;
+		}
+		d->ino = ino;
+		d->next = wb->list;
+		if (wb->list) wb->list->prev = d;
+		wb->list = d;
+		wb->inodes[ino] = d;
+	}
+	add_range(d, start, end);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+void dirty_mark_inode(fs_ctx *fs, a1fs_inode *inode){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (fs->journal){
+		dirty_mark_meta(fs, inode, sp->inode_size);
+	} else {
+		dirty_mark(fs, inode, inode, sp->inode_size);
+	}
+}
+
+void dirty_mark_map(fs_ctx *fs, a1fs_inode *inode, const void *ptr, size_t len){
+	if (fs->journal){
+		dirty_mark_meta(fs, ptr, len);
+	} else {
+		dirty_mark(fs, inode, ptr, len);
+	}
+}
+
+void dirty_mark_meta(fs_ctx *fs, const void *ptr, size_t len){
+	a1fs_writeback *wb = fs->writeback;
+	a1fs_blk_t start, end;
+	if (!to_blocks(fs, ptr, len, &start, &end)) return;
+	if (fs->journal){
+		journal_mark(fs, start, end);
+		return;
+	}
+	pthread_mutex_lock(&wb->lock);
+	add_range(&wb->meta, start, end);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/** Take d off the list and free it. wb->lock must be held. */
+static void unlink_dirty(a1fs_writeback *wb, a1fs_dirty *d){
+	if (d->prev) d->prev->next = d->next;
+	else wb->list = d->next;
+	if (d->next) d->next->prev = d->prev;
+	wb->inodes[d->ino] = NULL;
+	free(d);
+}
+
+void dirty_drop(fs_ctx *fs, a1fs_inode *inode){
+	a1fs_writeback *wb = fs->writeback;
+	pthread_mutex_lock(&wb->lock);
+	a1fs_dirty *d = wb->inodes[get_ino(fs, inode)];
+	if (d) unlink_dirty(wb, d);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+
+/** Ranges taken off for a sync. */
+typedef struct sync_batch {
+	a1fs_drange *ranges;
+	size_t count;
+	size_t cap;
+} sync_batch;
+
+/** Move the ranges of d into batch; return false if out of memory, with d as it was. */
+static bool take_ranges(sync_batch *batch, a1fs_dirty *d){
+	if (d->count == 0) return true;
+	if (batch->count + d->count > batch->cap){
+		size_t cap = batch->cap ? batch->cap : 64;
+		while (cap < batch->count + d->count) cap *= 2;
+		a1fs_drange *ranges = realloc(batch->ranges, cap * sizeof(a1fs_drange));
+		if (!ranges) return false;
+		batch->ranges = ranges;
+		batch->cap = cap;
+	}
+	memcpy(batch->ranges + batch->count, d->ranges, d->count * sizeof(a1fs_drange));
+	batch->count += d->count;
+	d->count = 0;
+	return true;
+}
+
+static int compare_ranges(const void *a, const void *b){
+	a1fs_blk_t x = ((const a1fs_drange*)a)->start, y = ((const a1fs_drange*)b)->start;
+	return x < y ? -1 : x > y;
+}
+
+/** Record the count ranges as metadata again, after a sync of them failed. */
+static void restore_ranges(a1fs_writeback *wb, const a1fs_drange *ranges, size_t count){
+	pthread_mutex_lock(&wb->lock);
+	for (size_t i = 0; i < count; i++) add_range(&wb->meta, ranges[i].start, ranges[i].end);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/** Add the range [start, end) to batch; return false if out of memory. */
+static bool push_range(sync_batch *batch, a1fs_blk_t start, a1fs_blk_t end){
+	if (batch->count == batch->cap){
+		size_t cap = batch->cap ? 2 * batch->cap : 64;
+		a1fs_drange *ranges = realloc(batch->ranges, cap * sizeof(a1fs_drange));
+		if (!ranges) return false;
+		batch->ranges = ranges;
+		batch->cap = cap;
+	}
+	batch->ranges[batch->count++] = (a1fs_drange){ start, end };
+	return true;
+}
+
+/**
+ * Sync the ranges of batch, sorted and merged where they touch, so that
+ * ranges of different inodes next to each other take one msync(), and all
+ * of them a single bdev_sync_ranges(). If that fails, they are all recorded
+ * as metadata again.
+ * fs->writeback->sync_lock must be held
+ */
+static int sync_batch_ranges(fs_ctx *fs, sync_batch *batch){
+	a1fs_writeback *wb = fs->writeback;
+	int result = 0;
+	sync_batch todo = { NULL, 0, 0 };
+	qsort(batch->ranges, batch->count, sizeof(a1fs_drange), compare_ranges);
+	size_t i = 0;
+	while (i < batch->count){
+		a1fs_drange r = batch->ranges[i++];
+		while (i < batch->count && batch->ranges[i].start <= r.end){
+			if (batch->ranges[i].end > r.end) r.end = batch->ranges[i].end;
+			i++;
+		}
+		// a block freed and reused by the running transaction still
+		// belongs to its old owner on disk until the free is committed
+		if (fs->journal && journal_freed(fs, r.start, r.end)){
+			int committed = journal_commit(fs);
+			if (committed < 0) result = committed;
+		}
+		// a merged range may span metadata that the journal has not
+		// committed yet; it goes to disk with its commit, not before
+		a1fs_blk_t start = r.start;
+		while (start < r.end){
+			a1fs_blk_t end = fs->journal ? journal_next_pending(fs, start, r.end) : r.end;
+			if (end > start && !push_range(&todo, start, end)){
+				restore_ranges(wb, &(a1fs_drange){ start, end }, 1);
+				result = -ENOMEM;
+			}
+			start = end + 1;
+		}
+	}
+	free(batch->ranges);
+	if (todo.count > 0){
+		int synced = bdev_sync_ranges(fs, todo.ranges, todo.count);
+		if (synced < 0){
+			restore_ranges(wb, todo.ranges, todo.count);
+			result = synced;
+		} else {
+			for (size_t k = 0; k < todo.count; k++){
+				wb->msyncs += 1;
+				wb->synced_blocks += todo.ranges[k].end - todo.ranges[k].start;
+			}
+		}
+	}
+	free(todo.ranges);
+	return result;
+}
+
+/** Commit the metadata to the journal once the data is synced, if there is one; returns the first error. */
+static int commit_meta(fs_ctx *fs, int result){
+	if (!fs->journal) return result;
+	// outside sync_lock, so that the commit is shared with other syncs
+	int committed = journal_commit(fs);
+	return result < 0 ? result : committed;
+}
+
+int dirty_sync(fs_ctx *fs, a1fs_inode *inode){
+	a1fs_writeback *wb = fs->writeback;
+	sync_batch batch = { NULL, 0, 0 };
+	// the superblock changes with every allocation
+	a1fs_dirty super = { .count = 1, .ranges = { { 0, 1 } } };
+	// with a journal, the superblock is in the metadata it commits
+	if (fs->journal) super.count = 0;
+	pthread_mutex_lock(&wb->sync_lock);
+	pthread_mutex_lock(&wb->lock);
+	a1fs_dirty *d = wb->inodes[get_ino(fs, inode)];
+	bool ok = take_ranges(&batch, &super) && take_ranges(&batch, &wb->meta);
+	if (ok && d){
+		ok = take_ranges(&batch, d);
+		if (ok) unlink_dirty(wb, d);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	int result = ok ? 0 : -ENOMEM;
+	if (batch.count > 0){
+		int synced = sync_batch_ranges(fs, &batch);
+		if (result == 0) result = synced;
+	}
+	pthread_mutex_unlock(&wb->sync_lock);
+	return commit_meta(fs, result);
+}
+
+int dirty_sync_all(fs_ctx *fs){
+	a1fs_writeback *wb = fs->writeback;
+	sync_batch batch = { NULL, 0, 0 };
+	a1fs_dirty super = { .count = 1, .ranges = { { 0, 1 } } };
+	if (fs->journal) super.count = 0;
+	pthread_mutex_lock(&wb->sync_lock);
+	pthread_mutex_lock(&wb->lock);
+	bool ok = take_ranges(&batch, &super) && take_ranges(&batch, &wb->meta);
+	while (ok && wb->list){
+		ok = take_ranges(&batch, wb->list);
+		if (ok) unlink_dirty(wb, wb->list);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	int result = ok ? 0 : -ENOMEM;
+	if (batch.count > 0){
+		int synced = sync_batch_ranges(fs, &batch);
+		if (result == 0) result = synced;
+	}
+	pthread_mutex_unlock(&wb->sync_lock);
+	return commit_meta(fs, result);
+}
+
+
+/** Sync every fs->opts->flush milliseconds until told to stop. */
+static void *flusher_main(void *arg){
+	fs_ctx *fs = arg;
+	a1fs_writeback *wb = fs->writeback;
+	pthread_mutex_lock(&wb->flusher_lock);
+	while (!wb->stopping){
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += fs->opts->flush / 1000;
+		deadline.tv_nsec += (long)(fs->opts->flush % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000){
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!wb->stopping && pthread_cond_timedwait(&wb->flusher_cond, &wb->flusher_lock, &deadline) != ETIMEDOUT);
+		pthread_mutex_unlock(&wb->flusher_lock);
+		dirty_sync_all(fs);
+		pthread_mutex_lock(&wb->flusher_lock);
+	}
+	pthread_mutex_unlock(&wb->flusher_lock);
+	return NULL;
+}
+
+bool dirty_start_flusher(fs_ctx *fs){
+	a1fs_writeback *wb = fs->writeback;
+	if (fs->opts->flush == 0) return true;
+	wb->stopping = false;
+	wb->flusher_running = pthread_create(&wb->flusher, NULL, flusher_main, fs) == 0;
+	return wb->flusher_running;
+}
+
+void dirty_stop_flusher(fs_ctx *fs){
+	a1fs_writeback *wb = fs->writeback;
+	if (!wb->flusher_running) return;
+	pthread_mutex_lock(&wb->flusher_lock);
+	wb->stopping = true;
+	pthread_cond_signal(&wb->flusher_cond);
+	pthread_mutex_unlock(&wb->flusher_lock);
+	// it syncs once more on the way out
+	pthread_join(wb->flusher, NULL);
+	wb->flusher_running = false;
+}
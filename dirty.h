@@ -0,0 +1,128 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Most ranges kept for one inode; more are merged into the closest ones. */
+#define A1FS_DIRTY_RANGES 16
+
+/** Blocks [start, end) of the image, changed since they were last synced. */
+typedef struct a1fs_drange {
+	a1fs_blk_t start;
+	a1fs_blk_t end;
+} a1fs_drange;
+
+/** Dirty ranges of one inode, sorted and apart from each other. */
+typedef struct a1fs_dirty {
+	/** Inode the ranges belong to. */
+	a1fs_ino_t ino;
+	/** Number of ranges in use. */
+	uint32_t count;
+	/** One more than the limit, for the range that is being merged. */
+	a1fs_drange ranges[A1FS_DIRTY_RANGES + 1];
+	/** Neighbours in the list of inodes with dirty ranges. */
+	struct a1fs_dirty *prev;
+	struct a1fs_dirty *next;
+} a1fs_dirty;
+
+/**
+ * Dirty range tracking and writeback.
+ *
+ * The image is a shared mapping, so what is written to it reaches the disk
+ * whenever the kernel decides to, and only msync() makes sure it has. Rather
+ * than syncing the whole image, every change is recorded as a range of
+ * blocks: file data, directory records, extent tree and index nodes and the
+ * inode itself under the inode they belong to, and the bitmaps, group
+ * descriptors and the inodes changed by a namespace operation on another
+ * inode as metadata. fsync() of an inode syncs its ranges and the metadata
+ * ranges, and nothing else; the superblock is always synced along.
+ *
+ * A range is recorded after the change it covers, so a sync that takes it
+ * off has the change in the page cache already; a later change records it
+ * again. Syncs are serialized, so that an fsync() that finds no range of its
+ * inode left knows that the sync that took them is over.
+ *
+ * With the --flush=<ms> option, a background thread syncs the ranges of every
+ * inode that often, sorted and coalesced into as few msync() calls as
+ * possible, so that an fsync() finds little left to do.
+ *
+ * With a journal (see journal.h), only file data is recorded here; every
+ * other change goes to the running transaction of the journal, and a sync
+ * commits it after the data, instead of syncing it in place.
+ *
+ * Ranges are recorded under fs->writeback->lock, which is taken last; a sync
+ * holds sync_lock and no other lock of fs_core.h.
+ */
+typedef struct a1fs_writeback {
+	/** Protects the ranges and the list; taken after every other lock. */
+	pthread_mutex_t lock;
+	/** Held by a sync from when it takes the ranges until they are on disk. */
+	pthread_mutex_t sync_lock;
+	/** Ranges of each inode; NULL if it has none. */
+	a1fs_dirty **inodes;
+	/** Number of entries in inodes; the image may be unmapped when they are freed. */
+	uint32_t inode_count;
+	/** Inodes with dirty ranges. */
+	a1fs_dirty *list;
+	/** Metadata ranges. */
+	a1fs_dirty meta;
+
+	/** Background flusher; only runs with the flush option. */
+	pthread_t flusher;
+	bool flusher_running;
+	/** Set when the flusher is to stop; protected by flusher_lock. */
+	bool stopping;
+	pthread_mutex_t flusher_lock;
+	pthread_cond_t flusher_cond;
+
+	/** Number of msync() calls made, and the number of blocks they covered. */
+	uint64_t msyncs;
+	uint64_t synced_blocks;
+} a1fs_writeback;
+
+
+/** Allocate the range tables; return false on failure. */
+bool dirty_init(fs_ctx *fs);
+
+/** Free the range tables; the flusher must be stopped. */
+void dirty_destroy(fs_ctx *fs);
+
+/** Record that len bytes at ptr, inside the image, were changed for inode. */
+void dirty_mark(fs_ctx *fs, a1fs_inode *inode, const void *ptr, size_t len);
+
+/** Record that inode itself, with its inline data, was changed. */
+void dirty_mark_inode(fs_ctx *fs, a1fs_inode *inode);
+
+/** Record that len bytes at ptr of the extents or extent tree nodes of inode were changed. */
+void dirty_mark_map(fs_ctx *fs, a1fs_inode *inode, const void *ptr, size_t len);
+
+/** Record that len bytes of metadata at ptr were changed; pointers outside the image are ignored. */
+void dirty_mark_meta(fs_ctx *fs, const void *ptr, size_t len);
+
+/** Forget the ranges of inode, which is being freed. */
+void dirty_drop(fs_ctx *fs, a1fs_inode *inode);
+
+/**
+ * Sync the ranges of inode, the metadata ranges and the superblock, or with a
+ * journal, commit the metadata once the ranges are synced.
+ *
+ * Errors:
+ *   EIO  the data could not be written (or another error of msync()); the
+ *        ranges are kept as metadata, to be tried again.
+ */
+int dirty_sync(fs_ctx *fs, a1fs_inode *inode);
+
+/** Same as dirty_sync(), for the ranges of every inode. */
+int dirty_sync_all(fs_ctx *fs);
+
+/** Start the flusher if the flush option asks for it; return false if it can't be started. */
+bool dirty_start_flusher(fs_ctx *fs);
+
+/** Stop the flusher, if it runs, after a last sync. */
+void dirty_stop_flusher(fs_ctx *fs);
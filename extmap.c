@@ -0,0 +1,66 @@
+#include <stdlib.h>
+
+#include "extmap.h"
+
+
+/** Allocate the extent map cache; return false on failure. */
+bool extmap_init(fs_ctx *fs){
+	fs->extmaps = calloc(A1FS_EXTMAP_SLOTS, sizeof(a1fs_extmap));
+	if (!fs->extmaps) return false;
+	for (int i = 0; i < A1FS_EXTMAP_SLOTS; i++){
+		pthread_mutex_init(&fs->extmaps[i].lock, NULL);
+	}
+	return true;
+}
+
+/** Free the extent map cache. */
+void extmap_destroy(fs_ctx *fs){
+	if (!fs->extmaps) return;
+	for (int i = 0; i < A1FS_EXTMAP_SLOTS; i++){
+		pthread_mutex_destroy(&fs->extmaps[i].lock);
+	}
+	free(fs->extmaps);
+	fs->extmaps = NULL;
+}
+
+/** Find the extent that contains logical block lblk of the extents in a block. */
+uint32_t extmap_find(fs_ctx *fs, a1fs_blk_t block, const a1fs_extent *extents,
+                     uint32_t count, uint64_t lblk, uint64_t *start){
+	a1fs_extmap *map = &fs->extmaps[block % A1FS_EXTMAP_SLOTS];
+	pthread_mutex_lock(&map->lock);
+	if (map->block != block){
+		// the slot belongs to another file, take it over
+		map->block = block;
+		map->count = 0;
+	}
+	// extend the map over every extent but the last one
+	while (map->count + 1 < count){
+		uint32_t prev = map->count ? map->end[map->count - 1] : 0;
+		map->end[map->count] = prev + extents[map->count].count;
+		map->count++;
+	}
+	// binary search for the first extent that ends after lblk
+	uint32_t lo = 0, hi = count - 1;
+	while (lo < hi){
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (map->end[mid] > lblk){
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	*start = lo ? map->end[lo - 1] : 0;
+	pthread_mutex_unlock(&map->lock);
+	return lo;
+}
+
+/** Forget the map of an extent block, e.g. when extents are dropped. */
+void extmap_invalidate(fs_ctx *fs, a1fs_blk_t block){
+	a1fs_extmap *map = &fs->extmaps[block % A1FS_EXTMAP_SLOTS];
+	pthread_mutex_lock(&map->lock);
+	if (map->block == block){
+		map->block = 0;
+		map->count = 0;
+	}
+	pthread_mutex_unlock(&map->lock);
+}
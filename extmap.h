@@ -0,0 +1,57 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of extent blocks whose map is cached at the same time. */
+#define A1FS_EXTMAP_SLOTS 64
+
+/**
+ * Cached cumulative lengths of the extents stored in one block: the indirect
+ * extent block of a file, or a leaf of its extent tree (see extree.h).
+ *
+ * Only the last extent of a file can change length without the number of
+ * extents changing, so the map covers every extent but the last one. Once an
+ * extent is followed by another one its length is fixed until extents are
+ * dropped, which must be reported with extmap_invalidate().
+ */
+typedef struct a1fs_extmap {
+	/** Protects the slot; files that share a slot are mapped one at a time. */
+	pthread_mutex_t lock;
+	/** Extent block the map belongs to; 0 if the slot is unused. */
+	a1fs_blk_t block;
+	/** Number of extents covered by end[]. */
+	uint32_t count;
+	/** end[i] is the number of blocks in extents 0..i. */
+	uint32_t end[A1FS_MAX_EXTENTS];
+} a1fs_extmap;
+
+/** Allocate the extent map cache; return false on failure. */
+bool extmap_init(fs_ctx *fs);
+
+/** Free the extent map cache. */
+void extmap_destroy(fs_ctx *fs);
+
+/**
+ * Find the extent that contains logical block lblk of the extents in a block.
+ *
+ * Assumption:
+ *      lblk is less than the total number of blocks in the extents
+ *
+ * @param fs       file system context.
+ * @param block    the extent block.
+ * @param extents  pointer to the extents stored in that block.
+ * @param count    number of extents in use.
+ * @param lblk     logical block number, counted from the first extent of the block.
+ * @param start    receives the logical block number the extent starts at, likewise.
+ * @return         index of the extent.
+ */
+uint32_t extmap_find(fs_ctx *fs, a1fs_blk_t block, const a1fs_extent *extents,
+                     uint32_t count, uint64_t lblk, uint64_t *start);
+
+/** Forget the map of an extent block, e.g. when extents are dropped. */
+void extmap_invalidate(fs_ctx *fs, a1fs_blk_t block);
@@ -0,0 +1,168 @@
+#include "extree.h"
+#include "dirty.h"
+#include "extmap.h"
+#include "group.h"
+
+
+/** Get block blk of the image. */
+static void *get_block(fs_ctx *fs, a1fs_blk_t blk){
+	return (char*)fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** Number of extents under a node at level; the leaves are at level 0. */
+static uint64_t span(uint32_t level){
+	uint64_t extents = A1FS_MAX_EXTENTS;
+	while (level--) extents *= A1FS_EXTENT_FANOUT;
+	return extents;
+}
+
+/** Number of entries in use in the node at level whose first extent is base. */
+static uint32_t node_count(const a1fs_inode *inode, uint32_t level, uint64_t base){
+	uint64_t per_entry = level ? span(level - 1) : 1;
+	uint64_t count = (inode->extent_count - base + per_entry - 1) / per_entry;
+	return count < A1FS_EXTENT_FANOUT ? count : A1FS_EXTENT_FANOUT;
+}
+
+/** Allocate a block for a node of inode. fs->block_lock must be held. */
+static a1fs_blk_t alloc_node(fs_ctx *fs, a1fs_inode *inode){
+	a1fs_blk_t blk = group_find_block(fs, group_block_goal(fs, inode));
+	group_take_blocks(fs, blk, 1);
+	fs->block_hint = blk + 1;
+	inode->blocks += 1;
+	return blk;
+}
+
+/** Free the node of inode in block blk. fs->block_lock must be held. */
+static void free_node(fs_ctx *fs, a1fs_inode *inode, a1fs_blk_t blk){
+	group_put_blocks(fs, blk, 1);
+	inode->blocks -= 1;
+	// the block may become a leaf of another file
+	extmap_invalidate(fs, blk);
+}
+
+
+a1fs_extent *extree_get(fs_ctx *fs, a1fs_inode *inode, uint32_t index){
+	a1fs_blk_t blk = inode->extents.start;
+	for (uint32_t level = inode->extent_depth; level > 0; level--){
+		a1fs_extent_index *children = get_block(fs, blk);
+		blk = children[index / span(level - 1) % A1FS_EXTENT_FANOUT].child;
+	}
+	return (a1fs_extent*)get_block(fs, blk) + index % A1FS_MAX_EXTENTS;
+}
+
+a1fs_extent *extree_find(fs_ctx *fs, a1fs_inode *inode, uint64_t lblk, uint32_t *index, uint64_t *start){
+	a1fs_blk_t blk = inode->extents.start;
+	// first extent and first logical block of the current node
+	uint64_t base = 0, first = 0;
+	for (uint32_t level = inode->extent_depth; level > 0; level--){
+		a1fs_extent_index *children = get_block(fs, blk);
+		// binary search for the last child that starts at or before lblk
+		uint32_t lo = 0, hi = node_count(inode, level, base) - 1;
+		while (lo < hi){
+			uint32_t mid = lo + (hi - lo + 1) / 2;
+			if (children[mid].lblk <= lblk){
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		base += lo * span(level - 1);
+		first = children[lo].lblk;
+		blk = children[lo].child;
+	}
+	a1fs_extent *extents = get_block(fs, blk);
+	uint32_t i = extmap_find(fs, blk, extents, node_count(inode, 0, base), lblk - first, start);
+	*start += first;
+	*index = base + i;
+	return &extents[i];
+}
+
+
+uint32_t extree_nodes_needed(const a1fs_inode *inode){
+	uint64_t next = inode->extent_count;
+	uint32_t depth = inode->extent_depth;
+	uint32_t needed = 0;
+	if (next == span(depth)){
+		// a new root
+		needed += 1;
+		depth += 1;
+	}
+	// a new node on every level below the root where the extent comes first
+	for (uint32_t level = 0; level < depth; level++){
+		if (next % span(level) == 0) needed += 1;
+	}
+	return needed;
+}
+
+a1fs_extent *extree_append(fs_ctx *fs, a1fs_inode *inode, uint64_t lblk){
+	uint64_t next = inode->extent_count;
+	if (next == span(inode->extent_depth)){
+		// the tree is full, so it grows by one level above the old root
+		a1fs_blk_t root = alloc_node(fs, inode);
+		a1fs_extent_index *children = get_block(fs, root);
+		children[0].lblk = 0;
+		children[0].child = inode->extents.start;
+		dirty_mark_map(fs, inode, &children[0], sizeof(a1fs_extent_index));
+		inode->extents.start = root;
+		inode->extent_depth += 1;
+	}
+	a1fs_blk_t blk = inode->extents.start;
+	for (uint32_t level = inode->extent_depth; level > 0; level--){
+		a1fs_extent_index *children = get_block(fs, blk);
+		uint32_t i = next / span(level - 1) % A1FS_EXTENT_FANOUT;
+		if (next % span(level - 1) == 0){
+			// the extent is the first one of a new child
+			children[i].lblk = lblk;
+			children[i].child = alloc_node(fs, inode);
+			dirty_mark_map(fs, inode, &children[i], sizeof(a1fs_extent_index));
+		}
+		blk = children[i].child;
+	}
+	inode->extent_count += 1;
+	return (a1fs_extent*)get_block(fs, blk) + next % A1FS_MAX_EXTENTS;
+}
+
+
+/**
+ * Free the children of the index node blk at level, whose first extent is
+ * base, that held extents below old_count but hold none any more
+ */
+static void prune(fs_ctx *fs, a1fs_inode *inode, a1fs_blk_t blk, uint32_t level, uint64_t base, uint32_t old_count){
+	if (level == 0) return;
+	a1fs_extent_index *children = get_block(fs, blk);
+	uint64_t per_child = span(level - 1);
+	// children before the one with the new last extent are still full
+	uint32_t i = inode->extent_count > base ? (inode->extent_count - base - 1) / per_child : 0;
+	for (; i < A1FS_EXTENT_FANOUT && base + i * per_child < old_count; i++){
+		uint64_t child_base = base + i * per_child;
+		prune(fs, inode, children[i].child, level - 1, child_base, old_count);
+		if (child_base >= inode->extent_count){
+			free_node(fs, inode, children[i].child);
+		}
+	}
+}
+
+void extree_trim(fs_ctx *fs, a1fs_inode *inode, uint32_t old_count){
+	prune(fs, inode, inode->extents.start, inode->extent_depth, 0, old_count);
+	if (inode->extent_count == 0){
+		// no data block is left, so the root is not needed either
+		free_node(fs, inode, inode->extents.start);
+		inode->extent_depth = 0;
+		return;
+	}
+	while (inode->extent_depth > 0 && inode->extent_count <= span(inode->extent_depth - 1)){
+		// every extent is under the first child, which becomes the root
+		a1fs_blk_t root = inode->extents.start;
+		inode->extents.start = ((a1fs_extent_index*)get_block(fs, root))->child;
+		free_node(fs, inode, root);
+		inode->extent_depth -= 1;
+	}
+	// the map of the last leaf still covers the dropped extents
+	a1fs_blk_t blk = inode->extents.start;
+	uint32_t last = inode->extent_count - 1;
+	for (uint32_t level = inode->extent_depth; level > 0; level--){
+		a1fs_extent_index *children = get_block(fs, blk);
+		blk = children[last / span(level - 1) % A1FS_EXTENT_FANOUT].child;
+	}
+	extmap_invalidate(fs, blk);
+}
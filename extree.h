@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Extent trees, for files with more extents than one indirect block holds.
+ *
+ * A file with extent_depth 0 keeps its direct extents in the block of its
+ * indirect extent, as it always has. Beyond that, that block is the root of a
+ * tree of extent_depth levels of index nodes (a1fs_extent_index) above leaves
+ * of A1FS_MAX_EXTENTS direct extents.
+ *
+ * Extents are only added and dropped at the end of a file, so every node but
+ * the last one of each level is full, and the number of entries in a node
+ * follows from extent_count; nodes have no header. An extent is found by
+ * logical block with one binary search per level (the leaves through the
+ * cached extent maps of extmap.h), or by number with one division per level.
+ *
+ * The caller holds the lock of the inode; functions that allocate or free
+ * blocks also need fs->block_lock.
+ */
+
+
+/** Get extent number index of inode. */
+a1fs_extent *extree_get(fs_ctx *fs, a1fs_inode *inode, uint32_t index);
+
+/**
+ * Find the extent of inode that contains logical block lblk.
+ *
+ * Assumption:
+ *      lblk is less than the number of blocks in the extents
+ *
+ * @param index  receives the number of the extent.
+ * @param start  receives the logical block the extent starts at.
+ */
+a1fs_extent *extree_find(fs_ctx *fs, a1fs_inode *inode, uint64_t lblk, uint32_t *index, uint64_t *start);
+
+/** Number of blocks extree_append() takes for new nodes. */
+uint32_t extree_nodes_needed(const a1fs_inode *inode);
+
+/**
+ * Add an extent at the end of inode; return it, to be filled in by the caller.
+ *
+ * The inode must have its indirect block already, and there must be
+ * extree_nodes_needed() free blocks. fs->block_lock must be held.
+ *
+ * @param lblk  logical block the new extent starts at.
+ */
+a1fs_extent *extree_append(fs_ctx *fs, a1fs_inode *inode, uint64_t lblk);
+
+/**
+ * Free the nodes of inode that held extents before extent_count dropped from
+ * old_count, but hold none now; that is the whole tree once no extent is left.
+ *
+ * fs->block_lock must be held.
+ */
+void extree_trim(fs_ctx *fs, a1fs_inode *inode, uint32_t old_count);
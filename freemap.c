@@ -0,0 +1,205 @@
+#include <stdlib.h>
+
+#include "freemap.h"
+
+
+/** A run of free blocks; a node of the treap. */
+typedef struct a1fs_frun {
+	/** First block of the run. */
+	a1fs_blk_t start;
+	/** Number of blocks in the run. */
+	uint32_t len;
+	/** Length of the longest run in the subtree. */
+	uint32_t max;
+	/** Heap priority; a parent's is never less than its children's. */
+	uint32_t prio;
+	struct a1fs_frun *left;
+	struct a1fs_frun *right;
+} a1fs_frun;
+
+
+/** Recompute the longest run under n from its children. */
+static void update(a1fs_frun *n){
+	n->max = n->len;
+	if (n->left && n->left->max > n->max) n->max = n->left->max;
+	if (n->right && n->right->max > n->max) n->max = n->right->max;
+}
+
+/** Split the subtree t into the runs that start before key and the rest. */
+static void split(a1fs_frun *t, a1fs_blk_t key, a1fs_frun **less, a1fs_frun **rest){
+	if (!t){
+		*less = *rest = NULL;
+	} else if (t->start < key){
+		split(t->right, key, &t->right, rest);
+		update(t);
+		*less = t;
+	} else {
+		split(t->left, key, less, &t->left);
+		update(t);
+		*rest = t;
+	}
+}
+
+/** Join two subtrees, where every run of a starts before every run of b. */
+static a1fs_frun *merge(a1fs_frun *a, a1fs_frun *b){
+	if (!a) return b;
+	if (!b) return a;
+	if (a->prio >= b->prio){
+		a->right = merge(a->right, b);
+		update(a);
+		return a;
+	}
+	b->left = merge(a, b->left);
+	update(b);
+	return b;
+}
+
+static void free_tree(a1fs_frun *t){
+	if (!t) return;
+	free_tree(t->left);
+	free_tree(t->right);
+	free(t);
+}
+
+
+bool freemap_init(fs_ctx *fs){
+	fs->freemap = calloc(1, sizeof(a1fs_freemap));
+	if (!fs->freemap) return false;
+	fs->freemap->seed = 2463534242u;
+	return true;
+}
+
+void freemap_destroy(fs_ctx *fs){
+	if (!fs->freemap) return;
+	free_tree(fs->freemap->root);
+	free(fs->freemap);
+	fs->freemap = NULL;
+}
+
+/** Get the run that contains blk; NULL if blk is used. */
+static a1fs_frun *find_run(a1fs_freemap *fm, a1fs_blk_t blk){
+	a1fs_frun *n = fm->root, *found = NULL;
+	// the last run that starts at or before blk
+	while (n){
+		if (n->start <= blk){
+			found = n;
+			n = n->right;
+		} else {
+			n = n->left;
+		}
+	}
+	return found && blk - found->start < found->len ? found : NULL;
+}
+
+/** Add the run of len blocks from start, which touches no other run. */
+static bool insert(a1fs_freemap *fm, a1fs_blk_t start, uint32_t len){
+	a1fs_frun *n = malloc(sizeof(a1fs_frun));
+	if (!n) return false;
+	fm->seed ^= fm->seed << 13;
+	fm->seed ^= fm->seed >> 17;
+	fm->seed ^= fm->seed << 5;
+	n->start = start;
+	n->len = len;
+	n->max = len;
+	n->prio = fm->seed;
+	n->left = n->right = NULL;
+	a1fs_frun *less, *rest;
+	split(fm->root, start, &less, &rest);
+	fm->root = merge(merge(less, n), rest);
+	fm->count += 1;
+	return true;
+}
+
+/** Remove the run that starts at start and return it, not freed. */
+static a1fs_frun *detach(a1fs_freemap *fm, a1fs_blk_t start){
+	a1fs_frun *less, *rest, *n;
+	split(fm->root, start, &less, &rest);
+	split(rest, start + 1, &n, &rest);
+	fm->root = merge(less, rest);
+	fm->count -= 1;
+	return n;
+}
+
+/** Drop the index after a failed allocation; the bitmaps are used instead. */
+static bool fail(fs_ctx *fs){
+	freemap_destroy(fs);
+	return false;
+}
+
+bool freemap_put(fs_ctx *fs, a1fs_blk_t start, uint32_t count){
+	a1fs_freemap *fm = fs->freemap;
+	if (count == 0) return true;
+	// absorb the runs right before and right after
+	if (start > 0){
+		a1fs_frun *prev = find_run(fm, start - 1);
+		if (prev){
+			count += prev->len;
+			start = prev->start;
+			free(detach(fm, prev->start));
+		}
+	}
+	a1fs_frun *next = find_run(fm, start + count);
+	if (next){
+		count += next->len;
+		free(detach(fm, next->start));
+	}
+	return insert(fm, start, count) || fail(fs);
+}
+
+bool freemap_take(fs_ctx *fs, a1fs_blk_t start, uint32_t count){
+	a1fs_freemap *fm = fs->freemap;
+	if (count == 0) return true;
+	a1fs_frun *run = detach(fm, find_run(fm, start)->start);
+	a1fs_blk_t end = run->start + run->len;
+	bool ok = true;
+	// what is left on either side stays free
+	if (run->start < start) ok = insert(fm, run->start, start - run->start);
+	if (ok && start + count < end) ok = insert(fm, start + count, end - start - count);
+	free(run);
+	return ok || fail(fs);
+}
+
+/** The first run under t that starts at or after from and has at least want blocks. */
+static a1fs_frun *first_fit(a1fs_frun *t, a1fs_blk_t from, uint32_t want){
+	while (t && t->max >= want){
+		if (t->start < from){
+			t = t->right;
+			continue;
+		}
+		// the runs on the left come first, if one of them fits
+		a1fs_frun *left = first_fit(t->left, from, want);
+		if (left) return left;
+		if (t->len >= want) return t;
+		t = t->right;
+	}
+	return NULL;
+}
+
+long freemap_find(fs_ctx *fs, a1fs_blk_t goal, uint32_t want, uint32_t *len){
+	a1fs_freemap *fm = fs->freemap;
+	*len = 0;
+	if (!fm->root) return -1;
+	a1fs_frun *run = find_run(fm, goal);
+	if (run && run->start + run->len - goal >= want){
+		*len = run->start + run->len - goal;
+		return goal;
+	}
+	run = first_fit(fm->root, goal, want);
+	if (!run) run = first_fit(fm->root, 0, want);
+	if (!run){
+		// no run is long enough; the longest one it is
+		run = fm->root;
+		while (run->len != run->max){
+			run = run->left && run->left->max == run->max ? run->left : run->right;
+		}
+	}
+	*len = run->len;
+	return run->start;
+}
+
+size_t freemap_run_length(fs_ctx *fs, a1fs_blk_t blk, size_t limit){
+	a1fs_frun *run = find_run(fs->freemap, blk);
+	if (!run || blk >= limit) return 0;
+	size_t end = (size_t)run->start + run->len;
+	return (end < limit ? end : limit) - blk;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * In-memory index of the free space: every run of free blocks, as an extent.
+ *
+ * The runs are kept in a treap ordered by first block, where each node also
+ * knows the longest run below it. Finding a run of at least some length at or
+ * after a goal, the longest run, or the run around a block then takes time
+ * logarithmic in the number of runs, where the bitmaps would have to be
+ * scanned from the goal on.
+ *
+ * The index is built from the bitmaps when the file system is mounted, and
+ * group.c keeps it in step with them; it is never written to the image. If a
+ * run can't be allocated, the index is dropped and the bitmaps are scanned
+ * instead from then on. Everything here needs fs->block_lock.
+ */
+typedef struct a1fs_freemap {
+	/** Root of the treap. */
+	struct a1fs_frun *root;
+	/** Number of runs. */
+	uint64_t count;
+	/** State of the generator of the priorities. */
+	uint32_t seed;
+} a1fs_freemap;
+
+
+/** Create an empty index; return false on failure. */
+bool freemap_init(fs_ctx *fs);
+
+/** Free the index, if any. */
+void freemap_destroy(fs_ctx *fs);
+
+/**
+ * Record that count blocks from start on became free; they may extend the
+ * runs before and after them.
+ *
+ * @return  false if memory ran out; the index is gone then.
+ */
+bool freemap_put(fs_ctx *fs, a1fs_blk_t start, uint32_t count);
+
+/**
+ * Record that count free blocks from start on, all in one run, are used.
+ *
+ * @return  false if memory ran out; the index is gone then.
+ */
+bool freemap_take(fs_ctx *fs, a1fs_blk_t start, uint32_t count);
+
+/**
+ * Find free blocks, next fit from goal: the first run of at least want blocks
+ * at or after goal (or, if there is none, from block 0 on); or else the
+ * longest run. A run that goal is inside of counts from goal.
+ *
+ * @param len  receives the number of free blocks found.
+ * @return     the first of them; -1 if no block is free.
+ */
+long freemap_find(fs_ctx *fs, a1fs_blk_t goal, uint32_t want, uint32_t *len);
+
+/** Number of free blocks from blk on, but not past limit. */
+size_t freemap_run_length(fs_ctx *fs, a1fs_blk_t blk, size_t limit);
@@ -0,0 +1,1089 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs_core.h"
+#include "helper.h"
+#include "extree.h"
+#include "dindex.h"
+#include "dir.h"
+#include "dalloc.h"
+#include "dirty.h"
+#include "group.h"
+#include "journal.h"
+
+
+/**
+ * Number of direct extents in the indirect block of inode, on an image from
+ * before extent_count was kept: the leading entries whose lengths add up to
+ * its data blocks (all of its blocks but the indirect one)
+ */
+static uint32_t count_extents(fs_ctx *fs, a1fs_inode *inode) {
+    if ((size_t)inode->extents.start * A1FS_BLOCK_SIZE >= fs->size) return 0;
+    a1fs_extent *extent = (a1fs_extent*) ((char*)fs->image + (size_t)inode->extents.start * A1FS_BLOCK_SIZE);
+    uint64_t blocks = 0;
+    uint32_t count = 0;
+    while (blocks + 1 < inode->blocks && count < A1FS_MAX_EXTENTS) {
+        blocks += extent[count].count;
+        count++;
+    }
+    return count;
+}
+
+
+/** Allocate the kernel reference counts, the extent generations, the directory hints and the locks; return false on failure. */
+bool core_init(fs_ctx *fs) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    fs->lookups = calloc(sp->max_inodes_count, sizeof(uint64_t));
+    fs->extent_gens = calloc(sp->max_inodes_count, sizeof(uint32_t));
+    fs->dir_hints = calloc(sp->max_inodes_count, sizeof(uint64_t));
+    fs->inode_locks = calloc(sp->max_inodes_count, sizeof(pthread_rwlock_t));
+    if (!fs->lookups || !fs->extent_gens || !fs->dir_hints || !fs->inode_locks) return false;
+    fs->inode_lock_count = sp->max_inodes_count;
+    for (size_t i = 0; i < fs->inode_lock_count; i++) {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->block_lock, NULL);
+    pthread_mutex_init(&fs->ialloc_lock, NULL);
+    pthread_mutex_init(&fs->rename_lock, NULL);
+    if (!(sp->features & A1FS_FEATURE_EXTENT_TREE)) {
+        // an image from before extent trees: every file has a single indirect
+        // block, and extent_depth is whatever the padding held; so is
+        // extent_count on an image from before it was kept, and dir_index on
+        // one from before name indexes
+        char *inode_bitmap = (char*)fs->image + (size_t)sp->inode_bitmap * A1FS_BLOCK_SIZE;
+        for (a1fs_ino_t ino = 0; ino < sp->max_inodes_count; ino++) {
+            a1fs_inode *inode = get_inode(fs, ino);
+            inode->extent_depth = 0;
+            if (!(sp->features & A1FS_FEATURE_DIR_INDEX)) inode->dir_index = 0;
+            if (read_bitmap(inode_bitmap, ino)) {
+                inode->extent_count = inode->blocks > 0 ? count_extents(fs, inode) : 0;
+            }
+        }
+        sp->features |= A1FS_FEATURE_EXTENT_TREE;
+    }
+    return true;
+}
+
+
+/** Free the kernel reference counts, the extent generations, the directory hints and the locks. */
+void core_destroy(fs_ctx *fs) {
+    if (fs->inode_locks) {
+        for (size_t i = 0; i < fs->inode_lock_count; i++) {
+            pthread_rwlock_destroy(&fs->inode_locks[i]);
+        }
+        pthread_mutex_destroy(&fs->block_lock);
+        pthread_mutex_destroy(&fs->ialloc_lock);
+        pthread_mutex_destroy(&fs->rename_lock);
+    }
+    free(fs->inode_locks);
+    fs->inode_locks = NULL;
+    free(fs->lookups);
+    fs->lookups = NULL;
+    free(fs->extent_gens);
+    fs->extent_gens = NULL;
+    free(fs->dir_hints);
+    fs->dir_hints = NULL;
+}
+
+
+/** Get the inode with inode number ino. */
+a1fs_inode *get_inode(fs_ctx *fs, a1fs_ino_t ino) {
+    return group_get_inode(fs, ino);
+}
+
+
+/** Get the inode number of inode. */
+a1fs_ino_t get_ino(fs_ctx *fs, a1fs_inode *inode) {
+    return group_get_ino(fs, inode);
+}
+
+
+/** Number of bytes of data an inode without blocks can hold; 0 if the image has no inline data. */
+size_t inline_capacity(fs_ctx *fs) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    return sp->features & A1FS_FEATURE_INLINE_DATA ? sp->inode_size - sizeof(a1fs_inode) : 0;
+}
+
+
+/** Get the inline data of inode, right after it in its inode table slot. */
+char *inline_data(a1fs_inode *inode) {
+    return (char*)(inode + 1);
+}
+
+
+/** Lock inode for reading. */
+void rdlock_inode(fs_ctx *fs, a1fs_inode *inode) {
+    pthread_rwlock_rdlock(&fs->inode_locks[get_ino(fs, inode)]);
+}
+
+
+/** Lock inode for writing. */
+void wrlock_inode(fs_ctx *fs, a1fs_inode *inode) {
+    pthread_rwlock_wrlock(&fs->inode_locks[get_ino(fs, inode)]);
+}
+
+
+/** Unlock inode locked with rdlock_inode() or wrlock_inode(). */
+void unlock_inode(fs_ctx *fs, a1fs_inode *inode) {
+    pthread_rwlock_unlock(&fs->inode_locks[get_ino(fs, inode)]);
+}
+
+
+/**
+ * Fill in run for the data at offset of inode, inside extent number index
+ * The extent starts at logical block start; the run is limited by its end and by size
+ */
+static void set_run(fs_ctx *fs, a1fs_inode *inode, a1fs_extent *extent, uint32_t index, uint64_t start,
+                    uint64_t offset, uint64_t size, a1fs_run *run) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    uint64_t extent_size = (uint64_t) extent->count * A1FS_BLOCK_SIZE;
+    offset -= start * A1FS_BLOCK_SIZE;
+    run->inode = inode;
+    run->extent = extent;
+    run->index = index;
+    run->lblk = start;
+    run->ptr = (char*) ((void*)sp + extent->start * A1FS_BLOCK_SIZE) + offset;
+    run->len = extent_size - offset < size ? extent_size - offset : size;
+}
+
+
+/**
+ * Find the run of file data that starts at offset
+ * The run is limited by the end of the extent containing offset and by size
+ * The extent is found with a binary search on each level of the extent tree;
+ * inline data is a single run with no extent
+ *
+ * Assumption:
+ *      0 < size and offset + size <= file size
+ *
+ * @param inode the inode that we are interested in
+ * @param offset the offset from the beginning of the file
+ * @param size the number of bytes that are still wanted
+ * @param run the run to fill in
+ */
+void find_run(fs_ctx *fs, a1fs_inode *inode, uint64_t offset, uint64_t size, a1fs_run *run) {
+    if (inode->blocks == 0) {
+        // the data is inline, all of it in one run
+        run->inode = inode;
+        run->extent = NULL;
+        run->index = 0;
+        run->lblk = 0;
+        run->ptr = inline_data(inode) + offset;
+        run->len = size;
+        return;
+    }
+    uint32_t index;
+    uint64_t start;
+    a1fs_extent *extent = extree_find(fs, inode, offset / A1FS_BLOCK_SIZE, &index, &start);
+    set_run(fs, inode, extent, index, start, offset, size, run);
+}
+
+
+/**
+ * Same as find_run(), but try the extent of cursor and the one after it first,
+ * which is where sequential I/O continues, so that no extent lookup is needed
+ * cursor may be NULL
+ *
+ * Assumption:
+ *      0 < size and offset + size <= file size
+ */
+void seek_run(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, uint64_t offset, uint64_t size, a1fs_run *run) {
+    if (cursor) {
+        pthread_mutex_lock(&cursor->lock);
+        uint32_t index = cursor->index;
+        uint64_t start = cursor->start;
+        bool valid = cursor->gen == fs->extent_gens[get_ino(fs, inode)] && index < inode->extent_count;
+        pthread_mutex_unlock(&cursor->lock);
+        if (valid) {
+            a1fs_extent *extent = extree_get(fs, inode, index);
+            uint64_t lblk = offset / A1FS_BLOCK_SIZE;
+            if (lblk >= start + extent->count && index + 1 < inode->extent_count) {
+                start += extent->count;
+                index += 1;
+                extent = extree_get(fs, inode, index);
+            }
+            if (lblk >= start && lblk < start + extent->count) {
+                set_run(fs, inode, extent, index, start, offset, size, run);
+                return;
+            }
+        }
+    }
+    find_run(fs, inode, offset, size, run);
+}
+
+
+/** Remember the extent of run in cursor, if cursor is not NULL. */
+void save_cursor(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, const a1fs_run *run) {
+    if (!cursor) return;
+    pthread_mutex_lock(&cursor->lock);
+    cursor->index = run->index;
+    cursor->start = run->lblk;
+    cursor->gen = fs->extent_gens[get_ino(fs, inode)];
+    pthread_mutex_unlock(&cursor->lock);
+}
+
+
+/**
+ * Forward run to the beginning of the next extent
+ * The run is limited by the end of that extent and by size
+ *
+ * @param run the run returned by find_run() or next_run()
+ * @param size the number of bytes that are still wanted
+ */
+void next_run(fs_ctx *fs, a1fs_run *run, uint64_t size) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    run->lblk += run->extent->count;
+    run->index += 1;
+    // an extent that starts a leaf of the extent tree is not next to the previous one
+    run->extent = run->index % A1FS_MAX_EXTENTS ? run->extent + 1 : extree_get(fs, run->inode, run->index);
+    uint64_t extent_size = (uint64_t) run->extent->count * A1FS_BLOCK_SIZE;
+    run->ptr = (char*) ((void*)sp + run->extent->start * A1FS_BLOCK_SIZE);
+    run->len = extent_size < size ? extent_size : size;
+}
+
+
+/**
+ *  Find the pointer pointing to the file offset from the beginning by size
+ *  On return:
+ *  ptr should be pointing to the byte right after the offset
+ *  extent should be pointing to the extent where the actual last bit of the file is in
+ *
+ * Assumption:
+ *      file is not empty
+ *      0 <= size <= file size
+ *
+ *  @param inode the inode that we are interested in
+ */
+void find_ptr_at_size(fs_ctx *fs, a1fs_inode *inode, size_t size, char **ptr, a1fs_extent **last_extent) {
+    a1fs_run run;
+    if (size == 0) {
+        find_run(fs, inode, 0, 1, &run);
+        *ptr = run.ptr;
+    } else {
+        // locate the last byte before size, so that a size at the end of an extent stays in it
+        find_run(fs, inode, size - 1, 1, &run);
+        *ptr = run.ptr + 1;
+    }
+    *last_extent = run.extent;
+}
+
+
+/**
+ * initialize a new extent at required pos
+ *
+ * fs->block_lock must be held
+ *
+ * @param pos where we want to add the extent
+ * @param goal the block where the search for a free block starts
+ * @Return the pointer to the first bit of the data block of the new extent
+ */
+void* add_extent(fs_ctx *fs, a1fs_extent* pos, a1fs_blk_t goal) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    a1fs_blk_t new_extent_start = group_find_block(fs, goal);
+    fs->block_hint = new_extent_start + 1;
+    group_take_blocks(fs, new_extent_start, 1);
+    pos->start = new_extent_start;
+    pos->count = 1;
+    void* result = (void*) ((void*)sp + new_extent_start * A1FS_BLOCK_SIZE);
+    return result;
+}
+
+
+/**
+ * Free the last count data blocks of inode
+ * Extents that become empty are dropped, together with the indirect block
+ * once no extent is left
+ * fs->block_lock must be held
+ *
+ * @param inode the inode whose blocks need to be freed
+ * @param count the number of blocks to free
+ */
+void free_last_blocks(fs_ctx *fs, a1fs_inode *inode, uint64_t count) {
+    a1fs_extent *last_extent = extree_get(fs, inode, inode->extent_count - 1);
+    uint32_t old_extent_count = inode->extent_count;
+    while (count > 0) {
+        a1fs_blk_t freed = last_extent->count < count ? last_extent->count : count;
+        // trim the extent, or drop it as a whole
+        last_extent->count -= freed;
+        dirty_mark_map(fs, inode, last_extent, sizeof(a1fs_extent));
+        group_put_blocks(fs, last_extent->start + last_extent->count, freed);
+        inode->blocks -= freed;
+        count -= freed;
+        if (last_extent->count == 0) {
+            inode->extent_count -= 1;
+            if (inode->extent_count == 0) break;
+            last_extent = extree_get(fs, inode, inode->extent_count - 1);
+        }
+    }
+    if (inode->extent_count != old_extent_count) {
+        // free the extent tree nodes left empty, the indirect block too if no
+        // data block is left; the cursors still cover the dropped extents
+        extree_trim(fs, inode, old_extent_count);
+        fs->extent_gens[get_ino(fs, inode)] += 1;
+    }
+}
+
+
+/**
+ * Allocate enough blocks for p_inode to grow by size bytes and update its size
+ * The new space is not initialized
+ * Inline data that still fits into the inode needs no block; inline data that
+ * does not moves to the start of the first new block
+ * The last extent is grown in place first; the remaining blocks are taken
+ * as whole contiguous free runs so that a large append adds few extents
+ *
+ * Blocks reserved for delayed allocation (see dalloc.h) are not free, except
+ * the ones the caller reserved for this growth, which are given back once it
+ * has the blocks
+ *
+ * Errors:
+ *  ENOSPC not enough free space in the file system
+ *
+ *  @param p_inode the pointer to the inode that grows
+ *  @param size the number of bytes to grow by
+ *  @param reserved the number of blocks the caller reserved for this growth
+ */
+int alloc_data(fs_ctx *fs, a1fs_inode *p_inode, uint64_t size, uint32_t reserved) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    if (size == 0) return 0;
+    uint64_t inline_size = 0;
+    if (p_inode->blocks == 0) {
+        if (p_inode->size + size <= inline_capacity(fs)) {
+            p_inode->size += size;
+            clock_gettime(CLOCK_REALTIME, &p_inode->mtime);
+            dirty_mark_inode(fs, p_inode);
+            return 0;
+        }
+        // allocate for the inline data too, as if the file were empty
+        inline_size = p_inode->size;
+        size += inline_size;
+        p_inode->size = 0;
+    }
+    uint64_t old_blocks = (p_inode->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+    uint64_t new_blocks = (p_inode->size + size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE - old_blocks;
+    pthread_mutex_lock(&fs->block_lock);
+    uint64_t others = fs->reserved_blocks - reserved;
+    if (sp->free_blocks_count - others < new_blocks + (p_inode->size == 0)) {
+        pthread_mutex_unlock(&fs->block_lock);
+        p_inode->size += inline_size;
+        return -ENOSPC;
+    }
+    if (p_inode->size == 0) {
+        // We need to initialize the extents(indirect) of p_inode first
+        add_extent(fs, &(p_inode->extents), group_block_goal(fs, p_inode));
+        p_inode->blocks += 1;
+        p_inode->extent_count = 0;
+        p_inode->extent_depth = 0;
+    }
+    uint64_t allocated = 0;
+    if (p_inode->extent_count > 0) {
+        // grow the last extent over the free blocks right after it
+        a1fs_extent *extent = extree_get(fs, p_inode, p_inode->extent_count - 1);
+        size_t index = extent->start + extent->count;
+        allocated = group_run_length(fs, index, index + new_blocks);
+        group_take_blocks(fs, index, allocated);
+        extent->count += allocated;
+        if (allocated > 0) dirty_mark_map(fs, p_inode, extent, sizeof(a1fs_extent));
+        if (allocated > 0 && index + allocated > fs->block_hint) fs->block_hint = index + allocated;
+    }
+    while (allocated < new_blocks) {
+        // else we need new extents after the last one, each one a contiguous free run
+        if (sp->free_blocks_count - others < new_blocks - allocated + extree_nodes_needed(p_inode)) {
+            // no room for the extent tree nodes the new extent needs;
+            // give back what this call has allocated so far
+            p_inode->blocks += allocated;
+            free_last_blocks(fs, p_inode, allocated);
+            pthread_mutex_unlock(&fs->block_lock);
+            p_inode->size += inline_size;
+            return -ENOSPC;
+        }
+        size_t len;
+        long start = group_find_run(fs, group_block_goal(fs, p_inode), new_blocks - allocated, &len);
+        assert(start >= 0);
+        if (len > new_blocks - allocated) len = new_blocks - allocated;
+        group_take_blocks(fs, start, len);
+        a1fs_extent *extent = extree_append(fs, p_inode, old_blocks + allocated);
+        extent->start = start;
+        extent->count = len;
+        dirty_mark_map(fs, p_inode, extent, sizeof(a1fs_extent));
+        fs->block_hint = start + len;
+        allocated += len;
+    }
+    fs->reserved_blocks -= reserved;
+    pthread_mutex_unlock(&fs->block_lock);
+    p_inode->blocks += allocated;
+    p_inode->size += size;
+    if (inline_size > 0) {
+        a1fs_blk_t first = extree_get(fs, p_inode, 0)->start;
+        memcpy((char*)sp + (size_t)first * A1FS_BLOCK_SIZE, inline_data(p_inode), inline_size);
+        dirty_mark(fs, p_inode, (char*)sp + (size_t)first * A1FS_BLOCK_SIZE, inline_size);
+    }
+    clock_gettime(CLOCK_REALTIME, &p_inode->mtime);
+    dirty_mark_inode(fs, p_inode);
+    return 0;
+}
+
+
+/**
+ * Fill size bytes of the file starting at offset with zeros
+ *
+ * Assumption:
+ *      offset + size <= file size
+ */
+void zero_data(fs_ctx *fs, a1fs_inode *inode, uint64_t offset, uint64_t size) {
+    if (size == 0) return;
+    a1fs_run run;
+    uint64_t zeroed = 0;
+    find_run(fs, inode, offset, size, &run);
+    while (1) {
+        memset(run.ptr, 0, run.len);
+        dirty_mark(fs, inode, run.ptr, run.len);
+        zeroed += run.len;
+        if (zeroed == size) break;
+        next_run(fs, &run, size - zeroed);
+    }
+}
+
+
+/**
+ * Allocate data space of required size for p_inode
+ * The new space is filled with zeros
+ * pos pointed to the first byte of the new allocated space on return
+ * pos should be only used on success return
+ *
+ * Errors:
+ *  ENOSPC not enough free space in the file system
+ *
+ *  @param p_inode the pointer to the inode of the parent
+ *  @param pos pointer pointing to the new allocated space
+ *  @param size the size of the new allocated space
+ */
+int add_data(fs_ctx *fs, a1fs_inode *p_inode, char** pos, size_t size) {
+    uint64_t old_size = p_inode->size;
+    int result = alloc_data(fs, p_inode, size, 0);
+    if (result < 0 || size == 0) return result;
+    zero_data(fs, p_inode, old_size, size);
+    a1fs_run run;
+    find_run(fs, p_inode, old_size, size, &run);
+    *pos = run.ptr;
+    return 0;
+}
+
+
+/**
+ * Create a new inode, to be linked from a directory entry
+ * Update file_inode to be the created new inode
+ * Set size, blocks, mtime for the new inode
+ * Need to set mode and links for the new inode
+ *
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param p_inode the directory the inode will be linked from
+ * @param mode the mode the inode will have
+ * @param file_inode the address of the pointer to the new created inode
+ * @return the new inode number on success, -errnor on error
+ */
+int make_inode(fs_ctx *fs, a1fs_inode *p_inode, mode_t mode, a1fs_inode** file_inode) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    // create file_inode, near its directory if the image has block groups
+    pthread_mutex_lock(&fs->ialloc_lock);
+    long ino = sp->inodes_count < sp->max_inodes_count ? group_find_inode(fs, group_inode_goal(fs, p_inode, mode)) : -1;
+    if (ino < 0 ) {
+        pthread_mutex_unlock(&fs->ialloc_lock);
+        return -ENOSPC;
+    }
+    fs->inode_hint = ino + 1;
+    group_take_inode(fs, ino);
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    *file_inode = get_inode(fs, ino);
+    (*file_inode)->size = 0;
+    clock_gettime(CLOCK_REALTIME, &(*file_inode)->mtime);
+    (*file_inode)->blocks = 0;
+    (*file_inode)->extent_count = 0;
+    (*file_inode)->extent_depth = 0;
+    (*file_inode)->dir_index = 0;
+    return ino;
+}
+
+
+/**
+* Delete data starting from offset i.e., deleted data region is [offset, offset+size]
+* The data after the region moves down one contiguous run at a time, then the
+* blocks past the new end of the file are freed extent by extent
+* size should be valid, i.e., 0 <= size <= left space starting from offset
+*
+* @param inode the inode of the file whose data need to be deleted
+* @param offset the offset from begining of the file to the position of the data that need to deleted
+* @param size the size of the data region that need to be deleted
+*/
+void delete_data(fs_ctx *fs, a1fs_inode* inode, uint64_t offset, uint64_t size) {
+    assert(offset + size <= inode->size);
+    if (size == 0) return;
+    // In total <filesize - (offset + size)> bytes data should be moved
+    uint64_t total = inode->size - offset - size;
+    if (total > 0) {
+        a1fs_run to, from;
+        find_run(fs, inode, offset, total, &to);
+        find_run(fs, inode, offset + size, total, &from);
+        uint64_t moved = 0;
+        while (1) {
+            // both runs are contiguous, so move as much as the shorter one holds
+            size_t len = to.len < from.len ? to.len : from.len;
+            memmove(to.ptr, from.ptr, len);
+            dirty_mark(fs, inode, to.ptr, len);
+            moved += len;
+            if (moved == total) break;
+            to.ptr += len;
+            to.len -= len;
+            from.ptr += len;
+            from.len -= len;
+            if (to.len == 0) next_run(fs, &to, total - moved);
+            if (from.len == 0) next_run(fs, &from, total - moved);
+        }
+    }
+    // Now free the blocks that are past the new end of the file; inline data has none
+    uint64_t old_blocks = (inode->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+    inode->size -= size;
+    uint64_t new_blocks = (inode->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+    if (inode->blocks > 0 && old_blocks > new_blocks) {
+        pthread_mutex_lock(&fs->block_lock);
+        free_last_blocks(fs, inode, old_blocks - new_blocks);
+        pthread_mutex_unlock(&fs->block_lock);
+    }
+    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+    dirty_mark_inode(fs, inode);
+}
+
+/**
+ * Free the inode ino
+ * No dentry and no kernel reference may point to it any more
+ */
+void release_inode(fs_ctx *fs, a1fs_ino_t ino) {
+    a1fs_inode *inode = get_inode(fs, ino);
+    dalloc_drop(fs, inode);
+    if (inode->size > 0) {
+        // drop every extent, then the indirect block goes with the last one
+        delete_data(fs, inode, 0, inode->size);
+    }
+    // nothing of a freed inode needs to be on disk but the bitmap
+    dirty_drop(fs, inode);
+    pthread_mutex_lock(&fs->ialloc_lock);
+    group_put_inode(fs, ino);
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    // the inode number may be reused by another directory
+    pthread_mutex_lock(&fs->dindex_lock);
+    dindex_drop(fs, ino);
+    pthread_mutex_unlock(&fs->dindex_lock);
+}
+
+
+/**
+ * Remove the entry at pos from p_inode and drop the link to its inode
+ * The inode is freed once the kernel holds no reference to it
+ * p_inode and inode must be write locked
+ */
+void unlink_dentry(fs_ctx *fs, a1fs_inode *p_inode, uint64_t pos, a1fs_inode *inode) {
+    a1fs_ino_t ino = get_ino(fs, inode);
+    if (S_ISDIR(inode->mode)) {
+        // the directory loses its "." and the parent its ".."
+        p_inode->links -= 1;
+        inode->links = 0;
+    } else {
+        inode->links -= 1;
+    }
+    dir_remove(fs, p_inode, pos);
+    // the entry and the link count go to disk with the directory
+    dirty_mark_inode(fs, p_inode);
+    dirty_mark_meta(fs, inode, sizeof(a1fs_inode));
+    if (inode->links == 0 && __atomic_load_n(&fs->lookups[ino], __ATOMIC_SEQ_CST) == 0) {
+        release_inode(fs, ino);
+    }
+}
+
+
+/** Fill in st with the file system statistics. */
+void core_statfs(fs_ctx *fs, struct statvfs *st) {
+	memset(st, 0, sizeof(*st));
+	st->f_bsize   = A1FS_BLOCK_SIZE;
+	st->f_frsize  = A1FS_BLOCK_SIZE;
+	st->f_blocks = fs->size / st->f_frsize;
+
+	struct a1fs_superblock *sp = (struct a1fs_superblock*)fs->image;
+
+	pthread_mutex_lock(&fs->block_lock);
+	st->f_bfree	 = 	sp->free_blocks_count - fs->reserved_blocks;
+	pthread_mutex_unlock(&fs->block_lock);
+	st->f_bavail = 	st->f_bfree;
+	st->f_files	 = 	sp->inodes_count;
+	st->f_ffree	 = 	sp->free_inodes_count;
+	st->f_favail = 	sp->free_inodes_count;
+
+	st->f_namemax = A1FS_NAME_MAX;
+}
+
+
+/** Fill in st with the attributes of inode. */
+void core_getattr(fs_ctx *fs, a1fs_inode *inode, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    rdlock_inode(fs, inode);
+    st->st_nlink = inode->links;
+    st->st_mode = inode->mode | 0777;
+    // buffered appends count, along with the blocks reserved for them
+    a1fs_dalloc *da = dalloc_get(fs, inode);
+    st->st_size = inode->size + (da ? da->len : 0);
+    st->st_blocks = (inode->blocks + (da ? da->reserved : 0)) * A1FS_BLOCK_SIZE / 512;
+    st->st_mtim = inode->mtime;
+    unlock_inode(fs, inode);
+    st->st_ino = get_ino(fs, inode);
+}
+
+
+/**
+ * Find the entry called name in directory p_inode
+ * The kernel reference is taken before p_inode is unlocked, so that the
+ * inode can't be freed in between
+ */
+int core_lookup(fs_ctx *fs, a1fs_inode *p_inode, const char *name, a1fs_inode **result) {
+    if (strlen(name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+    a1fs_ino_t ino;
+    int error_result = -ENOENT;
+    rdlock_inode(fs, p_inode);
+    if (dir_find(fs, p_inode, name, &ino) >= 0) {
+        *result = get_inode(fs, ino);
+        if (fs->track_lookups) core_ref(fs, ino);
+        error_result = 0;
+    }
+    unlock_inode(fs, p_inode);
+    return error_result;
+}
+
+
+/**
+ * Create a file or directory (depending on mode) called name in p_inode
+ * A new directory links to itself and to p_inode
+ */
+int core_mknod(fs_ctx *fs, a1fs_inode *p_inode, const char *name, mode_t mode, a1fs_inode **result) {
+    if (strlen(name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    pthread_mutex_lock(&fs->block_lock);
+    bool full = sp->blocks_count > sp->max_block_count;
+    pthread_mutex_unlock(&fs->block_lock);
+    if (full) return -ENOSPC;
+    a1fs_inode* new_inode;
+    journal_begin(fs);
+    wrlock_inode(fs, p_inode);
+    int ino = make_inode(fs, p_inode, mode, &new_inode);
+    if (ino < 0) {
+        unlock_inode(fs, p_inode);
+        journal_end(fs, false);
+        return ino;
+    }
+    long error_result = dir_add(fs, p_inode, name, ino);
+    if (error_result < 0) {
+        release_inode(fs, ino);
+        unlock_inode(fs, p_inode);
+        journal_end(fs, false);
+        return error_result;
+    }
+    if (S_ISDIR(mode)) {
+        p_inode->links += 1;
+        new_inode->links = 2;
+    } else {
+        new_inode->links = 1;
+    }
+    new_inode->mode = mode;
+    // the new inode goes to disk with the directory
+    dirty_mark_inode(fs, p_inode);
+    dirty_mark_meta(fs, new_inode, sizeof(a1fs_inode));
+    if (fs->track_lookups) core_ref(fs, ino);
+    unlock_inode(fs, p_inode);
+    *result = new_inode;
+    // the entry exists either way; an error only says it may not be on disk
+    return journal_end(fs, fs->opts->sync);
+}
+
+
+/**
+ * Remove the empty directory called name from p_inode
+ * The inode is freed once the kernel holds no reference to it
+ */
+int core_rmdir(fs_ctx *fs, a1fs_inode *p_inode, const char *name) {
+    a1fs_ino_t ino;
+    int error_result = 0;
+    journal_begin(fs);
+    wrlock_inode(fs, p_inode);
+    long pos = dir_find(fs, p_inode, name, &ino);
+    if (pos < 0) {
+        unlock_inode(fs, p_inode);
+        journal_end(fs, false);
+        return -ENOENT;
+    }
+    a1fs_inode *inode = get_inode(fs, ino);
+    wrlock_inode(fs, inode);
+    if (!S_ISDIR(inode->mode)) {
+        error_result = -ENOTDIR;
+    } else if (inode->size != 0) {
+        error_result = -ENOTEMPTY;
+    } else {
+        unlink_dentry(fs, p_inode, pos, inode);
+    }
+    unlock_inode(fs, inode);
+    unlock_inode(fs, p_inode);
+    int committed = journal_end(fs, fs->opts->sync && error_result == 0);
+    return error_result < 0 ? error_result : committed;
+}
+
+
+/**
+ * Remove the file called name from p_inode
+ * The inode is freed once the kernel holds no reference to it
+ */
+int core_unlink(fs_ctx *fs, a1fs_inode *p_inode, const char *name) {
+    a1fs_ino_t ino;
+    int error_result = 0;
+    journal_begin(fs);
+    wrlock_inode(fs, p_inode);
+    long pos = dir_find(fs, p_inode, name, &ino);
+    if (pos < 0) {
+        unlock_inode(fs, p_inode);
+        journal_end(fs, false);
+        return -ENOENT;
+    }
+    a1fs_inode *inode = get_inode(fs, ino);
+    wrlock_inode(fs, inode);
+    if (S_ISDIR(inode->mode)) {
+        error_result = -EISDIR;
+    } else {
+        unlink_dentry(fs, p_inode, pos, inode);
+    }
+    unlock_inode(fs, inode);
+    unlock_inode(fs, p_inode);
+    int committed = journal_end(fs, fs->opts->sync && error_result == 0);
+    return error_result < 0 ? error_result : committed;
+}
+
+
+/**
+ * Move entry name_from of p_from to name_to of p_to, replacing it if it exists
+ * Locks are taken in the order given in fs_core.h
+ */
+int core_rename(fs_ctx *fs, a1fs_inode *p_from, const char *name_from,
+                a1fs_inode *p_to, const char *name_to) {
+    if (strlen(name_to) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+    a1fs_ino_t ino_from, ino_to;
+    int result = 0;
+    journal_begin(fs);
+    pthread_mutex_lock(&fs->rename_lock);
+    if (p_from == p_to) {
+        wrlock_inode(fs, p_from);
+    } else {
+        // one parent may be an ancestor of the other, and rmdir() locks a
+        // parent before its child, so back off instead of waiting for the second
+        while (1) {
+            wrlock_inode(fs, p_from);
+            if (pthread_rwlock_trywrlock(&fs->inode_locks[get_ino(fs, p_to)]) == 0) break;
+            unlock_inode(fs, p_from);
+            sched_yield();
+        }
+    }
+
+    if (dir_find(fs, p_from, name_from, &ino_from) < 0) {
+        result = -ENOENT;
+        goto unlock;
+    }
+    a1fs_inode *inode_from = get_inode(fs, ino_from);
+
+    //find the dentry in desternation parent inode, remove it and its inode if it exists
+    long to_pos = dir_find(fs, p_to, name_to, &ino_to);
+    if (to_pos >= 0) {
+        // both paths are links to the same file
+        if (ino_to == ino_from) goto unlock;
+        a1fs_inode *inode_to = get_inode(fs, ino_to);
+        // a non-empty <to> may be locked by a thread waiting for one of the
+        // parents (e.g. it is an ancestor of p_from), so fail before locking it
+        if (S_ISDIR(inode_to->mode) && __atomic_load_n(&inode_to->size, __ATOMIC_SEQ_CST) != 0) {
+            result = -ENOTEMPTY;
+            goto unlock;
+        }
+        wrlock_inode(fs, inode_to);
+        if (replaceable(inode_to)) {
+            unlink_dentry(fs, p_to, to_pos, inode_to);
+        } else {
+            result = -ENOTEMPTY;
+        }
+        unlock_inode(fs, inode_to);
+        if(result != 0 ){ goto unlock;}
+    }
+
+    //find the dentry in orignial parent inode; removing <to> may have moved it
+    long from_pos = dir_find(fs, p_from, name_from, &ino_from);
+    if (p_from == p_to) {
+        // if parent directory are same, only need to change the dentry's name
+        result = dir_rename(fs, p_from, from_pos, name_to);
+        if(result != 0 ){ goto unlock;}
+    } else {
+        // create a new dentry in p_to, then free the orignial one
+        long to_result = dir_add(fs, p_to, name_to, ino_from);
+        if(to_result < 0 ){ result = to_result; goto unlock;}
+        dir_remove(fs, p_from, from_pos);
+        if (S_ISDIR(inode_from->mode)) {
+            // the ".." of a moved directory now links to p_to
+            p_from->links -= 1;
+            p_to->links += 1;
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &p_from->mtime);
+    clock_gettime(CLOCK_REALTIME, &p_to->mtime);
+    dirty_mark_inode(fs, p_from);
+    dirty_mark_inode(fs, p_to);
+unlock:
+    unlock_inode(fs, p_from);
+    if (p_to != p_from) unlock_inode(fs, p_to);
+    pthread_mutex_unlock(&fs->rename_lock);
+    int committed = journal_end(fs, fs->opts->sync && result == 0);
+    return result < 0 ? result : committed;
+}
+
+
+/** Call filler for each entry of directory inode, starting from the one at pos. */
+int core_readdir(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, uint64_t pos, core_filler_t filler, void *buf) {
+    rdlock_inode(fs, inode);
+    int result = dir_iterate(fs, inode, cursor, pos, filler, buf);
+    unlock_inode(fs, inode);
+    return result;
+}
+
+
+/** Change the size of the file inode; new data is filled with zeros. */
+int core_truncate(fs_ctx *fs, a1fs_inode *inode, uint64_t size) {
+    journal_begin(fs);
+    wrlock_inode(fs, inode);
+    // buffered appends are allocated first, so that all the data is on disk
+    int result = dalloc_flush(fs, inode);
+    if(result == 0 && size < inode->size){
+        // deallocate 
+        size_t remaning = inode->size - size;
+        delete_data(fs, inode, size, remaning);
+    }else if(result == 0 && size > inode->size) {
+        // allocate space with 0s
+        size_t remaning = size - inode->size;
+        char *ptr;
+        result = add_data(fs, inode, &ptr, remaning);
+    }
+    unlock_inode(fs, inode);
+    int committed = journal_end(fs, fs->opts->sync && result == 0);
+    return result < 0 ? result : committed;
+}
+
+
+/** Set the modification time of inode to mtime, or to the current time if mtime is NULL. */
+void core_set_mtime(fs_ctx *fs, a1fs_inode *inode, const struct timespec *mtime) {
+    journal_begin(fs);
+    wrlock_inode(fs, inode);
+    if (mtime) {
+        inode->mtime = *mtime;
+    } else {
+        clock_gettime(CLOCK_REALTIME, &inode->mtime);
+    }
+    dirty_mark_inode(fs, inode);
+    unlock_inode(fs, inode);
+    journal_end(fs, false);
+}
+
+
+/**
+ * Read up to size bytes at offset of the file inode into buf
+ * The part of buf past EOF is filled with zeros
+ */
+int core_read(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, char *buf, size_t size, uint64_t offset) {
+    uint64_t buf_index = 0;
+    a1fs_ra_runs runs = { 0 };
+    rdlock_inode(fs, inode);
+    if (offset < inode->size) {
+        // never read past EOF
+        uint64_t total = inode->size - offset < size ? inode->size - offset : size;
+        readahead_update(fs, inode, cursor, offset, total, &runs);
+        // copy one contiguous run (the rest of an extent) at a time
+        a1fs_run run;
+        seek_run(fs, inode, cursor, offset, total, &run);
+        while (1) {
+            memcpy(buf + buf_index, run.ptr, run.len);
+            buf_index += run.len;
+            if (buf_index == total) break;
+            next_run(fs, &run, total - buf_index);
+        }
+        save_cursor(fs, inode, cursor, &run);
+    }
+    if (buf_index < size && offset + buf_index >= inode->size) {
+        // the rest may be appended data that is not allocated yet
+        buf_index += dalloc_read(fs, inode, buf + buf_index, offset + buf_index - inode->size, size - buf_index);
+    }
+    unlock_inode(fs, inode);
+    readahead_advise(&runs);
+    memset(buf + buf_index, 0, size - buf_index);
+    return buf_index;
+}
+
+
+/**
+ * Write size bytes from buf at offset of the file inode, extending it if needed
+ * Appends to a regular file are buffered and allocated later (see dalloc.h)
+ */
+int core_write(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, const char *buf, size_t size, uint64_t offset) {
+    if (size == 0) return 0;
+    journal_begin(fs);
+    wrlock_inode(fs, inode);
+    a1fs_dalloc *da = dalloc_get(fs, inode);
+    if (S_ISREG(inode->mode) && offset == inode->size + (da ? da->len : 0)) {
+        int result = dalloc_append(fs, inode, buf, size);
+        if (result <= 0) {
+            if (result == 0) {
+                clock_gettime(CLOCK_REALTIME, &inode->mtime);
+                dirty_mark_inode(fs, inode);
+            }
+            unlock_inode(fs, inode);
+            journal_end(fs, false);
+            return result < 0 ? result : (int)size;
+        }
+    }
+    if (dalloc_get(fs, inode) && offset + size > inode->size) {
+        // the write reaches past the data on disk, so the buffered data goes there first
+        int result = dalloc_flush(fs, inode);
+        if (result < 0) {
+            unlock_inode(fs, inode);
+            journal_end(fs, false);
+            return result;
+        }
+    }
+    uint64_t old_size = inode->size;
+    if (offset + size > old_size) {
+        // grow the file; only the hole between the old EOF and offset needs zeros
+        int result = alloc_data(fs, inode, offset + size - old_size, 0);
+        if (result < 0) {
+            unlock_inode(fs, inode);
+            journal_end(fs, false);
+            return result;
+        }
+        if (offset > old_size) zero_data(fs, inode, old_size, offset - old_size);
+    }
+    // copy one contiguous run (the rest of an extent) at a time
+    size_t byte_written = 0;
+    a1fs_run run;
+    seek_run(fs, inode, cursor, offset, size, &run);
+    while (1) {
+        memcpy(run.ptr, buf + byte_written, run.len);
+        dirty_mark(fs, inode, run.ptr, run.len);
+        byte_written += run.len;
+        if (byte_written == size) break;
+        next_run(fs, &run, size - byte_written);
+    }
+    save_cursor(fs, inode, cursor, &run);
+    clock_gettime(CLOCK_REALTIME, &inode->mtime);
+    dirty_mark_inode(fs, inode);
+    unlock_inode(fs, inode);
+    journal_end(fs, false);
+    return byte_written;
+}
+
+
+/** Open inode; return NULL if out of memory. */
+a1fs_handle *core_open(fs_ctx *fs, a1fs_inode *inode) {
+    a1fs_handle *handle = malloc(sizeof(a1fs_handle));
+    if (!handle) return NULL;
+    handle->inode = inode;
+    // the first extent starts at logical block 0, so the cursor is valid as is
+    pthread_mutex_init(&handle->cursor.lock, NULL);
+    handle->cursor.index = 0;
+    handle->cursor.start = 0;
+    handle->cursor.ra = (a1fs_readahead){ 0 };
+    rdlock_inode(fs, inode);
+    handle->cursor.gen = fs->extent_gens[get_ino(fs, inode)];
+    unlock_inode(fs, inode);
+    return handle;
+}
+
+
+/** Close a handle returned by core_open(). */
+void core_release(fs_ctx *fs, a1fs_handle *handle) {
+    // there is no one to report an error to; the data stays buffered then
+    core_flush(fs, handle->inode);
+    pthread_mutex_destroy(&handle->cursor.lock);
+    free(handle);
+}
+
+
+/**
+ * Allocate and write out the appends buffered for inode
+ *
+ * Errors:
+ *   ENOSPC  not enough free space for the extents the data needs.
+ */
+int core_flush(fs_ctx *fs, a1fs_inode *inode) {
+    journal_begin(fs);
+    wrlock_inode(fs, inode);
+    int result = dalloc_flush(fs, inode);
+    unlock_inode(fs, inode);
+    journal_end(fs, false);
+    return result;
+}
+
+
+/** Write out the buffered appends of every inode, e.g. on unmount. */
+void core_flush_all(fs_ctx *fs) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    for (a1fs_ino_t ino = 0; ino < sp->max_inodes_count; ino++) {
+        if (fs->dallocs[ino]) core_flush(fs, get_inode(fs, ino));
+    }
+}
+
+
+/**
+ * Write out the buffered appends of inode and sync the parts of the image it
+ * changed, with the metadata, which is committed to the journal on an image
+ * that has one
+ *
+ * Errors:
+ *   ENOSPC  not enough free space for the extents the data needs.
+ *   EIO     the data could not be written.
+ */
+int core_fsync(fs_ctx *fs, a1fs_inode *inode) {
+    int result = core_flush(fs, inode);
+    if (result < 0) return result;
+    // no inode lock is held, so writes go on while the ranges are synced
+    return dirty_sync(fs, inode);
+}
+
+
+/** Record that the kernel holds one more reference (FUSE lookup) to ino. */
+void core_ref(fs_ctx *fs, a1fs_ino_t ino) {
+    __atomic_add_fetch(&fs->lookups[ino], 1, __ATOMIC_SEQ_CST);
+}
+
+
+/** Drop nlookup kernel references to ino. */
+void core_forget(fs_ctx *fs, a1fs_ino_t ino, uint64_t nlookup) {
+    a1fs_inode *inode = get_inode(fs, ino);
+    journal_begin(fs);
+    wrlock_inode(fs, inode);
+    // the root directory is referenced without a lookup
+    uint64_t lookups = __atomic_load_n(&fs->lookups[ino], __ATOMIC_SEQ_CST);
+    if (nlookup > lookups) nlookup = lookups;
+    lookups = __atomic_sub_fetch(&fs->lookups[ino], nlookup, __ATOMIC_SEQ_CST);
+    if (lookups == 0 && inode->links == 0) release_inode(fs, ino);
+    unlock_inode(fs, inode);
+    journal_end(fs, false);
+}
+
+
+/** Drop every kernel reference, e.g. on unmount. */
+void core_forget_all(fs_ctx *fs) {
+    a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+    for (a1fs_ino_t ino = 0; ino < sp->max_inodes_count; ino++) {
+        if (fs->lookups[ino] > 0) core_forget(fs, ino, fs->lookups[ino]);
+    }
+}
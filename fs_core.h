@@ -0,0 +1,282 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "readahead.h"
+
+
+/**
+ * File system operations on inodes.
+ *
+ * Everything here works on inodes and names inside a parent directory, never
+ * on full paths, so that it can be shared by the path based front end
+ * (a1fs.c) and the inode number based front end (a1fs_ll.c).
+ *
+ * The core_* operations may be called from several threads at once. Each
+ * inode has a read-write lock; the bitmaps, the directory indexes and the
+ * cached extent maps have their own locks (see fs_ctx.h). Locks are always
+ * taken in this order, so that no two threads can wait for each other:
+ *
+ *   1. fs->rename_lock (renames only);
+ *   2. directory inode locks, parent before child;
+ *   3. the inode of the entry being removed or replaced;
+ *   4. fs->dindex_lock;
+ *   5. fs->block_lock or fs->ialloc_lock (never both);
+ *   6. the extmap slot locks;
+ *   7. fs->writeback->lock or fs->journal->lock, which only record changed
+ *      blocks (see dirty.h and journal.h).
+ *
+ * On an image with a journal, an operation that changes the image waits in
+ * journal_begin() for a commit to copy its blocks before it takes any lock,
+ * and commits are made with no lock held.
+ *
+ * Only a rename locks two directories that may not be parent and child; it
+ * waits for the first and backs off if the second is busy, and renames are
+ * serialized by fs->rename_lock.
+ */
+
+
+/** A contiguous run of file data inside the image. */
+typedef struct a1fs_run {
+	/** Inode the data belongs to. */
+	a1fs_inode *inode;
+	/** Extent that contains the run; NULL for inline data. */
+	a1fs_extent *extent;
+	/** Number of the extent in the inode (see extree.h). */
+	uint32_t index;
+	/** Pointer to the first byte of the run. */
+	char *ptr;
+	/** Number of bytes in the run. */
+	size_t len;
+	/** Logical block of the file the extent starts at. */
+	uint64_t lblk;
+} a1fs_run;
+
+/**
+ * Extent where the last read or write through an open file ended.
+ *
+ * Sequential I/O continues in that extent or in the next one, so it is found
+ * without an extent lookup. The cursor is only trusted while the inode has not
+ * dropped any extent since it was saved (fs->extent_gens).
+ */
+typedef struct a1fs_cursor {
+	/** Protects the cursor; reads through the same handle may run in parallel. */
+	pthread_mutex_t lock;
+	/** Index of the extent. */
+	uint32_t index;
+	/** Logical block of the file the extent starts at. */
+	uint64_t start;
+	/** fs->extent_gens[] of the inode when the cursor was saved. */
+	uint32_t gen;
+	/** Read-ahead of the handle, see readahead.h. */
+	a1fs_readahead ra;
+} a1fs_cursor;
+
+/** An open file or directory, stored in fuse_file_info::fh. */
+typedef struct a1fs_handle {
+	/** The open inode. */
+	a1fs_inode *inode;
+	/** Extent cursor of the inode. */
+	a1fs_cursor cursor;
+} a1fs_handle;
+
+/** A directory entry, whatever the on-disk format of its directory (see dir.h). */
+typedef struct a1fs_dirent {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Null-terminated name, inside the image. */
+	const char *name;
+	/** Position of the entry in its directory. */
+	uint64_t pos;
+	/** Position where iteration continues after the entry. */
+	uint64_t next;
+} a1fs_dirent;
+
+/**
+ * Called by core_readdir() for each directory entry.
+ *
+ * @param buf     buffer passed to core_readdir().
+ * @param dirent  the directory entry.
+ * @return        0 to continue; non-zero to stop.
+ */
+typedef int (*core_filler_t)(void *buf, const a1fs_dirent *dirent);
+
+
+/** Allocate the kernel reference counts and the locks; return false on failure. */
+bool core_init(fs_ctx *fs);
+
+/** Free the kernel reference counts and the locks. */
+void core_destroy(fs_ctx *fs);
+
+a1fs_inode *get_inode(fs_ctx *fs, a1fs_ino_t ino);
+
+void rdlock_inode(fs_ctx *fs, a1fs_inode *inode);
+
+void wrlock_inode(fs_ctx *fs, a1fs_inode *inode);
+
+void unlock_inode(fs_ctx *fs, a1fs_inode *inode);
+
+a1fs_ino_t get_ino(fs_ctx *fs, a1fs_inode *inode);
+
+size_t inline_capacity(fs_ctx *fs);
+
+char *inline_data(a1fs_inode *inode);
+
+void find_run(fs_ctx *fs, a1fs_inode *inode, uint64_t offset, uint64_t size, a1fs_run *run);
+
+void next_run(fs_ctx *fs, a1fs_run *run, uint64_t size);
+
+void seek_run(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, uint64_t offset, uint64_t size, a1fs_run *run);
+
+void save_cursor(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, const a1fs_run *run);
+
+int alloc_data(fs_ctx *fs, a1fs_inode *p_inode, uint64_t size, uint32_t reserved);
+
+void zero_data(fs_ctx *fs, a1fs_inode *inode, uint64_t offset, uint64_t size);
+
+int add_data(fs_ctx *fs, a1fs_inode *p_inode, char** pos, size_t size);
+
+void delete_data(fs_ctx *fs, a1fs_inode* inode, uint64_t offset, uint64_t size);
+
+
+/** Fill in st with the file system statistics. */
+void core_statfs(fs_ctx *fs, struct statvfs *st);
+
+/** Fill in st with the attributes of inode. */
+void core_getattr(fs_ctx *fs, a1fs_inode *inode, struct stat *st);
+
+/**
+ * Find the entry called name in directory p_inode.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name is too long.
+ *   ENOENT        there is no such entry.
+ */
+int core_lookup(fs_ctx *fs, a1fs_inode *p_inode, const char *name, a1fs_inode **result);
+
+/**
+ * Create a file or directory (depending on mode) called name in p_inode.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name is too long.
+ *   ENOSPC        not enough free space in the file system.
+ */
+int core_mknod(fs_ctx *fs, a1fs_inode *p_inode, const char *name, mode_t mode, a1fs_inode **result);
+
+/**
+ * Remove the empty directory called name from p_inode.
+ *
+ * Errors:
+ *   ENOENT     there is no such entry.
+ *   ENOTDIR    the entry is not a directory.
+ *   ENOTEMPTY  the directory is not empty.
+ */
+int core_rmdir(fs_ctx *fs, a1fs_inode *p_inode, const char *name);
+
+/**
+ * Remove the file called name from p_inode.
+ *
+ * Errors:
+ *   ENOENT  there is no such entry.
+ *   EISDIR  the entry is a directory.
+ */
+int core_unlink(fs_ctx *fs, a1fs_inode *p_inode, const char *name);
+
+/**
+ * Move entry name_from of p_from to name_to of p_to, replacing it if it exists.
+ *
+ * Errors:
+ *   ENAMETOOLONG  name_to is too long.
+ *   ENOENT        there is no entry called name_from.
+ *   ENOTEMPTY     name_to is a non-empty directory.
+ *   ENOSPC        not enough free space in the file system.
+ */
+int core_rename(fs_ctx *fs, a1fs_inode *p_from, const char *name_from,
+                a1fs_inode *p_to, const char *name_to);
+
+/**
+ * Call filler for each entry of directory inode, starting from the one at pos.
+ *
+ * pos is 0 or the next position of an entry passed to filler (see dir.h).
+ * @param cursor  extent cursor of an open handle; NULL if there is none.
+ * @return        0 after the last entry; the non-zero value that stopped filler.
+ */
+int core_readdir(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, uint64_t pos, core_filler_t filler, void *buf);
+
+/**
+ * Change the size of the file inode; new data is filled with zeros.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ */
+int core_truncate(fs_ctx *fs, a1fs_inode *inode, uint64_t size);
+
+/** Set the modification time of inode to mtime, or to the current time if mtime is NULL. */
+void core_set_mtime(fs_ctx *fs, a1fs_inode *inode, const struct timespec *mtime);
+
+/**
+ * Read up to size bytes at offset of the file inode into buf.
+ *
+ * @param cursor  extent cursor of an open handle; NULL if there is none.
+ * @return        number of bytes read; 0 if offset is beyond EOF.
+ */
+int core_read(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, char *buf, size_t size, uint64_t offset);
+
+/**
+ * Write size bytes from buf at offset of the file inode, extending it if needed.
+ *
+ * Appends to a regular file are buffered, and only get their blocks when the
+ * file is flushed (see dalloc.h).
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param cursor  extent cursor of an open handle; NULL if there is none.
+ * @return        number of bytes written; -errno on error.
+ */
+int core_write(fs_ctx *fs, a1fs_inode *inode, a1fs_cursor *cursor, const char *buf, size_t size, uint64_t offset);
+
+/** Open inode; return NULL if out of memory. */
+a1fs_handle *core_open(fs_ctx *fs, a1fs_inode *inode);
+
+/** Close a handle returned by core_open(); buffered appends are written out. */
+void core_release(fs_ctx *fs, a1fs_handle *handle);
+
+/**
+ * Allocate and write out the appends buffered for inode (see dalloc.h).
+ *
+ * Errors:
+ *   ENOSPC  not enough free space for the extents the data needs.
+ */
+int core_flush(fs_ctx *fs, a1fs_inode *inode);
+
+/** Write out the buffered appends of every inode, e.g. on unmount. */
+void core_flush_all(fs_ctx *fs);
+
+/**
+ * Write out the buffered appends of inode, then sync to disk the parts of the
+ * image it changed and the metadata (see dirty.h), rather than all of it.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space for the extents the data needs.
+ *   EIO     the data could not be written.
+ */
+int core_fsync(fs_ctx *fs, a1fs_inode *inode);
+
+/** Record that the kernel holds one more reference (FUSE lookup) to ino. */
+void core_ref(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Drop nlookup kernel references to ino.
+ * An inode that was unlinked while referenced is freed with its last reference.
+ */
+void core_forget(fs_ctx *fs, a1fs_ino_t ino, uint64_t nlookup);
+
+/** Drop every kernel reference, e.g. on unmount. */
+void core_forget_all(fs_ctx *fs);
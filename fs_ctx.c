@@ -18,6 +18,14 @@
 
 #include "fs_ctx.h"
 #include "a1fs.h"
+#include "extmap.h"
+#include "dindex.h"
+#include "dcache.h"
+#include "dalloc.h"
+#include "dirty.h"
+#include "group.h"
+#include "journal.h"
+#include "fs_core.h"
 
 /**
  * Initialize file system context.
@@ -38,7 +46,7 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
 		return false;
 	}
 
-	return true;
+	return journal_init(fs) && group_init(fs) && extmap_init(fs) && dindex_init(fs) && dcache_init(fs) && dalloc_init(fs) && dirty_init(fs) && core_init(fs);
 }
 
 /**
@@ -48,6 +56,12 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
  */
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	//nothing need to be clean up;
-	(void)fs;
+	extmap_destroy(fs);
+	dindex_destroy(fs);
+	dcache_destroy(fs);
+	dalloc_destroy(fs);
+	dirty_destroy(fs);
+	core_destroy(fs);
+	group_destroy(fs);
+	journal_destroy(fs);
 }
@@ -18,7 +18,10 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "options.h"
 
@@ -31,11 +34,67 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** How the image is written, see bdev.h; set before fs_ctx_init(), or NULL for msync(). */
+	struct a1fs_bdev *bdev;
 	/** Command line options. */
 	a1fs_opts *opts;
 
-	//TODO: useful runtime state of the mounted file system should be cached
-	// here (NOT in global variables in a1fs.c)
+	/** Block group descriptors, see group.h; flat_group for an image without groups. */
+	struct a1fs_group_desc *groups;
+	/** The only group of an image without block groups, described by the superblock; NULL with groups. */
+	struct a1fs_group_desc *flat_group;
+	/** Number of block groups. */
+	uint32_t group_count;
+	/** Number of blocks in a group; the last one may have fewer. */
+	uint32_t blocks_per_group;
+	/** Number of inodes in a group. */
+	uint32_t inodes_per_group;
+	/** Index of the free blocks, see freemap.h; NULL if the bitmaps are scanned instead. */
+	struct a1fs_freemap *freemap;
+
+	/** Cached cumulative extent lengths, see extmap.h. */
+	struct a1fs_extmap *extmaps;
+	/** Block number where the search for a free block starts (next fit). */
+	uint32_t block_hint;
+	/** Inode number where the search for a free inode starts (next fit). */
+	uint32_t inode_hint;
+	/** Cached name indexes of large directories, see dindex.h. */
+	struct a1fs_dindex *dindexes;
+	/** Counter used to find the least recently used directory index. */
+	uint64_t dindex_clock;
+	/** Path to inode cache, see dcache.h. */
+	struct a1fs_dcache *dcache;
+	/** Number of kernel references (FUSE lookups) to each inode, see fs_core.h. */
+	uint64_t *lookups;
+	/** Whether lookups are counted; only the low-level driver forgets them. */
+	bool track_lookups;
+	/** Bumped when an inode drops extents; invalidates the cursors of its handles. */
+	uint32_t *extent_gens;
+	/** Position of each directory from which dir_add() looks for an unused record, see dir.h. */
+	uint64_t *dir_hints;
+	/** Appends of each inode that have no blocks yet, see dalloc.h. */
+	struct a1fs_dalloc **dallocs;
+	/** Number of entries in dallocs; the image may be unmapped when they are freed. */
+	uint32_t dalloc_count;
+	/** Number of free blocks reserved for the appends; protected by block_lock. */
+	uint64_t reserved_blocks;
+	/** Ranges of the image changed since they were synced, see dirty.h. */
+	struct a1fs_writeback *writeback;
+	/** Metadata journal, see journal.h; NULL if the image has none. */
+	struct a1fs_journal *journal;
+
+	/** One reader/writer lock per inode, see fs_core.h for the lock order. */
+	pthread_rwlock_t *inode_locks;
+	/** Number of inode locks; the image may be unmapped when they are destroyed. */
+	uint32_t inode_lock_count;
+	/** Protects the block bitmaps, freemap, the block counters, block_hint and reserved_blocks. */
+	pthread_mutex_t block_lock;
+	/** Protects the inode bitmaps, the inode counters, the zeroed part of the inode tables and inode_hint. */
+	pthread_mutex_t ialloc_lock;
+	/** Held by rename() while it locks two directories. */
+	pthread_mutex_t rename_lock;
+	/** Protects dindexes and dindex_clock. */
+	pthread_mutex_t dindex_lock;
 
 } fs_ctx;
 
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "group.h"
+#include "extree.h"
+#include "dirty.h"
+#include "freemap.h"
+#include "journal.h"
+#include "helper.h"
+
+
+/** Get block blk of the image. */
+static char *get_block(fs_ctx *fs, a1fs_blk_t blk){
+	return (char*)fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** First block of group g. */
+static a1fs_blk_t group_first(fs_ctx *fs, uint32_t g){
+	return g * fs->blocks_per_group;
+}
+
+/** Number of blocks in group g; the last group may be short. */
+static uint32_t group_blocks(fs_ctx *fs, uint32_t g){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	uint64_t left = sp->max_block_count - group_first(fs, g);
+	return left < fs->blocks_per_group ? left : fs->blocks_per_group;
+}
+
+
+/**
+ * Build the index of the free blocks from the bitmaps; without the memory for
+ * it, the bitmaps are scanned for free blocks instead
+ */
+static void build_freemap(fs_ctx *fs){
+	if (!freemap_init(fs)) return;
+	for (uint32_t g = 0; g < fs->group_count && fs->freemap; g++){
+		char *bitmap = get_block(fs, fs->groups[g].block_bitmap);
+		size_t nbits = group_blocks(fs, g);
+		size_t pos = 0;
+		while (pos < nbits){
+			long bit = find_free_bit(bitmap, nbits, pos);
+			// find_free_bit() wraps around
+			if (bit < 0 || (size_t)bit < pos) break;
+			size_t len = free_run_length(bitmap, bit, nbits);
+			if (!freemap_put(fs, group_first(fs, g) + bit, len)) break;
+			pos = bit + len;
+		}
+	}
+}
+
+/** Set up the groups of the image; return false if they are invalid. */
+static bool init_groups(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (!(sp->features & A1FS_FEATURE_BLOCK_GROUPS)){
+		// the whole image is one group, described by the superblock
+		fs->flat_group = calloc(1, sizeof(a1fs_group_desc));
+		if (!fs->flat_group) return false;
+		fs->flat_group->block_bitmap = sp->block_bitmap;
+		fs->flat_group->inode_bitmap = sp->inode_bitmap;
+		fs->flat_group->inode_table = sp->inode_table;
+		fs->flat_group->free_blocks_count = sp->free_blocks_count;
+		fs->flat_group->free_inodes_count = sp->free_inodes_count;
+		fs->flat_group->itable_zeroed = sp->itable_zeroed;
+		fs->groups = fs->flat_group;
+		fs->group_count = 1;
+		fs->blocks_per_group = sp->max_block_count;
+		fs->inodes_per_group = sp->max_inodes_count;
+		return true;
+	}
+	if (sp->groups_count == 0 || sp->blocks_per_group == 0 || sp->blocks_per_group > A1FS_MAX_GROUP_BLOCKS ||
+	    (uint64_t)sp->groups_count * sp->inodes_per_group != sp->max_inodes_count){
+		return false;
+	}
+	fs->flat_group = NULL;
+	fs->groups = (a1fs_group_desc*)get_block(fs, sp->group_desc);
+	fs->group_count = sp->groups_count;
+	fs->blocks_per_group = sp->blocks_per_group;
+	fs->inodes_per_group = sp->inodes_per_group;
+	return true;
+}
+
+bool group_init(fs_ctx *fs){
+	fs->freemap = NULL;
+	if (!init_groups(fs)) return false;
+	build_freemap(fs);
+	return true;
+}
+
+void group_destroy(fs_ctx *fs){
+	freemap_destroy(fs);
+	free(fs->flat_group);
+	fs->flat_group = NULL;
+	fs->groups = NULL;
+}
+
+a1fs_inode *group_get_inode(fs_ctx *fs, a1fs_ino_t ino){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	a1fs_group_desc *gd = &fs->groups[ino / fs->inodes_per_group];
+	return (a1fs_inode*)(get_block(fs, gd->inode_table) + (size_t)(ino % fs->inodes_per_group) * sp->inode_size);
+}
+
+a1fs_ino_t group_get_ino(fs_ctx *fs, const a1fs_inode *inode){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	size_t offset = (const char*)inode - (const char*)fs->image;
+	// the inode table of a group is inside the group
+	uint32_t g = offset / A1FS_BLOCK_SIZE / fs->blocks_per_group;
+	size_t index = (offset - (size_t)fs->groups[g].inode_table * A1FS_BLOCK_SIZE) / sp->inode_size;
+	return g * fs->inodes_per_group + index;
+}
+
+
+a1fs_blk_t group_block_goal(fs_ctx *fs, a1fs_inode *inode){
+	if (fs->group_count == 1) return fs->block_hint;
+	if (inode->blocks > 0 && inode->extent_count > 0){
+		// right after the end of the file
+		a1fs_extent *last = extree_get(fs, inode, inode->extent_count - 1);
+		return last->start + last->count;
+	}
+	return group_first(fs, group_get_ino(fs, inode) / fs->inodes_per_group);
+}
+
+long group_find_block(fs_ctx *fs, a1fs_blk_t goal){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (goal >= sp->max_block_count) goal = 0;
+	if (fs->freemap){
+		uint32_t len;
+		return freemap_find(fs, goal, 1, &len);
+	}
+	uint32_t first = goal / fs->blocks_per_group;
+	for (uint32_t i = 0; i < fs->group_count; i++){
+		uint32_t g = (first + i) % fs->group_count;
+		a1fs_group_desc *gd = &fs->groups[g];
+		if (gd->free_blocks_count == 0) continue;
+		size_t start = i == 0 ? goal - group_first(fs, g) : 0;
+		long bit = find_free_bit(get_block(fs, gd->block_bitmap), group_blocks(fs, g), start);
+		if (bit >= 0) return group_first(fs, g) + bit;
+	}
+	return -1;
+}
+
+long group_find_run(fs_ctx *fs, a1fs_blk_t goal, size_t want, size_t *len){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (goal >= sp->max_block_count) goal = 0;
+	if (fs->freemap){
+		uint32_t run_len;
+		long start = freemap_find(fs, goal, want < UINT32_MAX ? want : UINT32_MAX, &run_len);
+		*len = run_len;
+		return start;
+	}
+	uint32_t first = goal / fs->blocks_per_group;
+	long best = -1;
+	*len = 0;
+	for (uint32_t i = 0; i < fs->group_count; i++){
+		uint32_t g = (first + i) % fs->group_count;
+		a1fs_group_desc *gd = &fs->groups[g];
+		// a group that can't beat the longest run so far is not worth a look
+		if (gd->free_blocks_count <= *len) continue;
+		size_t start = i == 0 ? goal - group_first(fs, g) : 0;
+		size_t run_len;
+		long bit = find_free_run(get_block(fs, gd->block_bitmap), group_blocks(fs, g), start, want, &run_len);
+		if (bit >= 0 && run_len > *len){
+			best = group_first(fs, g) + bit;
+			*len = run_len;
+			if (run_len >= want) break;
+		}
+	}
+	return best;
+}
+
+size_t group_run_length(fs_ctx *fs, a1fs_blk_t blk, size_t limit){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (blk >= sp->max_block_count) return 0;
+	uint32_t g = blk / fs->blocks_per_group;
+	a1fs_blk_t first = group_first(fs, g);
+	size_t end = first + group_blocks(fs, g);
+	if (limit > end) limit = end;
+	if (fs->freemap) return freemap_run_length(fs, blk, limit);
+	return free_run_length(get_block(fs, fs->groups[g].block_bitmap), blk - first, limit - first);
+}
+
+/** Record that the bits of count blocks or inodes from bit on in bitmap, and the counters of group g, changed. */
+static void mark_bitmap(fs_ctx *fs, char *bitmap, size_t bit, size_t count, uint32_t g){
+	dirty_mark_meta(fs, bitmap + bit / 8, (bit + count - 1) / 8 - bit / 8 + 1);
+	dirty_mark_meta(fs, &fs->groups[g], sizeof(a1fs_group_desc));
+}
+
+void group_take_blocks(fs_ctx *fs, a1fs_blk_t blk, size_t count){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (count == 0) return;
+	uint32_t g = blk / fs->blocks_per_group;
+	set_bitmap_range(get_block(fs, fs->groups[g].block_bitmap), blk - group_first(fs, g), count);
+	mark_bitmap(fs, get_block(fs, fs->groups[g].block_bitmap), blk - group_first(fs, g), count, g);
+	if (fs->freemap) freemap_take(fs, blk, count);
+	fs->groups[g].free_blocks_count -= count;
+	sp->free_blocks_count -= count;
+	sp->blocks_count += count;
+}
+
+void group_put_blocks(fs_ctx *fs, a1fs_blk_t blk, size_t count){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (count == 0) return;
+	uint32_t g = blk / fs->blocks_per_group;
+	free_bitmap_range(get_block(fs, fs->groups[g].block_bitmap), blk - group_first(fs, g), count);
+	mark_bitmap(fs, get_block(fs, fs->groups[g].block_bitmap), blk - group_first(fs, g), count, g);
+	if (fs->journal) journal_revoke(fs, blk, count);
+	if (fs->freemap) freemap_put(fs, blk, count);
+	fs->groups[g].free_blocks_count += count;
+	sp->free_blocks_count += count;
+	sp->blocks_count -= count;
+}
+
+
+a1fs_ino_t group_inode_goal(fs_ctx *fs, a1fs_inode *parent, mode_t mode){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (fs->group_count == 1) return fs->inode_hint;
+	uint32_t parent_group = group_get_ino(fs, parent) / fs->inodes_per_group;
+	uint32_t best = parent_group;
+	if (S_ISDIR(mode)){
+		// spread directories: of the groups with at least the average number
+		// of free inodes, the one with the most free blocks
+		uint32_t average = sp->free_inodes_count / fs->group_count;
+		uint32_t best_free = 0;
+		for (uint32_t i = 1; i <= fs->group_count; i++){
+			uint32_t g = (parent_group + i) % fs->group_count;
+			a1fs_group_desc *gd = &fs->groups[g];
+			if (gd->free_inodes_count == 0 || gd->free_inodes_count < average) continue;
+			if (gd->free_blocks_count > best_free){
+				best = g;
+				best_free = gd->free_blocks_count;
+			}
+		}
+	}
+	return best * fs->inodes_per_group;
+}
+
+long group_find_inode(fs_ctx *fs, a1fs_ino_t goal){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (goal >= sp->max_inodes_count) goal = 0;
+	uint32_t first = goal / fs->inodes_per_group;
+	for (uint32_t i = 0; i < fs->group_count; i++){
+		uint32_t g = (first + i) % fs->group_count;
+		a1fs_group_desc *gd = &fs->groups[g];
+		if (gd->free_inodes_count == 0) continue;
+		size_t start = i == 0 ? goal % fs->inodes_per_group : 0;
+		long bit = find_free_bit(get_block(fs, gd->inode_bitmap), fs->inodes_per_group, start);
+		if (bit >= 0) return (long)g * fs->inodes_per_group + bit;
+	}
+	return -1;
+}
+
+/** Zero the inode table of the group of ino up to the block of ino, if mkfs left that to be done. */
+static void zero_itable(fs_ctx *fs, a1fs_ino_t ino){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	if (!(sp->features & A1FS_FEATURE_LAZY_ITABLE)) return;
+	a1fs_group_desc *gd = &fs->groups[ino / fs->inodes_per_group];
+	uint32_t blk = (uint64_t)(ino % fs->inodes_per_group) * sp->inode_size / A1FS_BLOCK_SIZE;
+	if (blk < gd->itable_zeroed) return;
+	memset(get_block(fs, gd->inode_table + gd->itable_zeroed), 0, (size_t)(blk + 1 - gd->itable_zeroed) * A1FS_BLOCK_SIZE);
+	dirty_mark_meta(fs, get_block(fs, gd->inode_table + gd->itable_zeroed), (size_t)(blk + 1 - gd->itable_zeroed) * A1FS_BLOCK_SIZE);
+	gd->itable_zeroed = blk + 1;
+	if (fs->flat_group) sp->itable_zeroed = gd->itable_zeroed;
+}
+
+void group_take_inode(fs_ctx *fs, a1fs_ino_t ino){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	a1fs_group_desc *gd = &fs->groups[ino / fs->inodes_per_group];
+	zero_itable(fs, ino);
+	set_bitmap(get_block(fs, gd->inode_bitmap), ino % fs->inodes_per_group);
+	mark_bitmap(fs, get_block(fs, gd->inode_bitmap), ino % fs->inodes_per_group, 1, ino / fs->inodes_per_group);
+	gd->free_inodes_count -= 1;
+	sp->free_inodes_count -= 1;
+	sp->inodes_count += 1;
+}
+
+void group_put_inode(fs_ctx *fs, a1fs_ino_t ino){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	a1fs_group_desc *gd = &fs->groups[ino / fs->inodes_per_group];
+	free_bitmap(get_block(fs, gd->inode_bitmap), ino % fs->inodes_per_group);
+	mark_bitmap(fs, get_block(fs, gd->inode_bitmap), ino % fs->inodes_per_group, 1, ino / fs->inodes_per_group);
+	gd->free_inodes_count += 1;
+	sp->free_inodes_count += 1;
+	sp->inodes_count -= 1;
+}
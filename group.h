@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Block groups: where the bitmaps and the inodes are, and where new blocks
+ * and inodes go.
+ *
+ * An image formatted with mkfs.a1fs -g is divided into groups, each with its
+ * own bitmaps and inode table (see a1fs_group_desc). A new file gets an inode
+ * in the group of its directory, a new directory one in a group with many
+ * free blocks, and data goes after the last extent of the file, or into the
+ * group of its inode, so that a directory, its inodes and their data stay
+ * close together. An image without groups is one group described by the
+ * superblock, and its blocks and inodes are allocated next fit from
+ * fs->block_hint and fs->inode_hint, as they always have been.
+ *
+ * No free run spans two groups, since every group but the first starts with
+ * its bitmaps, so an extent is always in one group. Free blocks are looked up
+ * in the index of freemap.h, built at mount, rather than in the bitmaps.
+ *
+ * The block functions need fs->block_lock, the inode ones fs->ialloc_lock.
+ * They keep the counters of the superblock and of the groups up to date.
+ */
+
+
+/** Read the group descriptors and index the free blocks; return false if the descriptors are invalid. */
+bool group_init(fs_ctx *fs);
+
+/** Free what group_init() allocated. */
+void group_destroy(fs_ctx *fs);
+
+/** Get the inode with inode number ino. */
+a1fs_inode *group_get_inode(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Get the inode number of inode. */
+a1fs_ino_t group_get_ino(fs_ctx *fs, const a1fs_inode *inode);
+
+
+/** Block where the search for a new block of inode starts. */
+a1fs_blk_t group_block_goal(fs_ctx *fs, a1fs_inode *inode);
+
+/** Find a free block, next fit from goal; -1 if there is none. */
+long group_find_block(fs_ctx *fs, a1fs_blk_t goal);
+
+/**
+ * Find a run of free blocks, next fit from goal; like find_free_run() in
+ * helper.h, the first one of at least want blocks, or else the longest one.
+ *
+ * @param len  receives the length of the run.
+ * @return     the first block of the run; -1 if no block is free.
+ */
+long group_find_run(fs_ctx *fs, a1fs_blk_t goal, size_t want, size_t *len);
+
+/** Number of free blocks from blk on, but not past limit or the end of the group of blk. */
+size_t group_run_length(fs_ctx *fs, a1fs_blk_t blk, size_t limit);
+
+/** Mark count free blocks from blk on, all in one group, used. */
+void group_take_blocks(fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+/** Mark count used blocks from blk on, all in one group, free. */
+void group_put_blocks(fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+
+/** Inode number where the search for a new inode of given mode in parent starts. */
+a1fs_ino_t group_inode_goal(fs_ctx *fs, a1fs_inode *parent, mode_t mode);
+
+/** Find a free inode, next fit from goal; -1 if there is none. */
+long group_find_inode(fs_ctx *fs, a1fs_ino_t goal);
+
+/** Mark the free inode ino used, zeroing its part of the inode table if it never was. */
+void group_take_inode(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Mark the used inode ino free. */
+void group_put_inode(fs_ctx *fs, a1fs_ino_t ino);
@@ -28,55 +28,137 @@ bool read_bitmap(char *bit_map, int index){
 	return 1 && (*byte & (1 << (index % 8)));
 }
 
-/** find first free inode by given superblock sp **/
-int find_first_free_inode_num(struct a1fs_superblock *sp){
-	int inuse;
-	unsigned int byte;
-	char *inode_bits = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_bitmap);
-	for(byte = 0; byte <  sp->max_inodes_count/8; byte++ ){
-		for(int bit = 0; bit < 8; bit++){
-			inuse = 1 && (inode_bits[byte] & (1 << bit));
-			if (! inuse){
-				return 8 * byte + bit;
-			}
-		}
-	}
-	if(sp->max_inodes_count/8 == 0){
-		for(unsigned int bit = 0; bit < sp->max_inodes_count%8; bit++){
-			inuse = 1 && (inode_bits[byte] & (1 << bit));
-			if (! inuse){
-				return 8 * byte + bit;
-			}
+/** find the first free bit in [from, to) scanning 64 bits at a time; -1 if none **/
+static long scan_free_bit(const char *bit_map, size_t from, size_t to){
+	const uint64_t *words = (const uint64_t *)bit_map;
+	size_t word = from / 64;
+	// bits before from in the first word are treated as used
+	uint64_t used = le64toh(words[word]) | ((1ull << (from % 64)) - 1);
+	while (word * 64 < to){
+		if (~used){
+			size_t bit = word * 64 + __builtin_ctzll(~used);
+			return bit < to ? (long)bit : -1;
 		}
+		word++;
+		if (word * 64 >= to) break;
+		used = le64toh(words[word]);
 	}
-	
 	return -1;
 }
 
-/** find first free block by given superblock sp **/
-int find_first_free_block_num(struct a1fs_superblock *sp){
-	int inuse;
-	unsigned int byte;
-	char *block_bitmap = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->block_bitmap);
-	for( byte = 0; byte <  sp->max_block_count/8; byte++ ){
-		for(int bit = 0; bit < 8; bit++){
-			inuse = 1 && (block_bitmap[byte] & (1 << bit));
-			if (! inuse){
-				return 8 * byte + bit;
-			}
+/** find the first free bit in bit_map at or after start, wrapping around to 0 **/
+long find_free_bit(const char *bit_map, size_t nbits, size_t start){
+	if (start >= nbits) start = 0;
+	long bit = scan_free_bit(bit_map, start, nbits);
+	if (bit < 0 && start > 0){
+		bit = scan_free_bit(bit_map, 0, start);
+	}
+	return bit;
+}
+
+/** find the first used bit in [from, to) scanning 64 bits at a time; to if none **/
+static size_t scan_used_bit(const char *bit_map, size_t from, size_t to){
+	const uint64_t *words = (const uint64_t *)bit_map;
+	size_t word = from / 64;
+	// bits before from in the first word are treated as free
+	uint64_t used = le64toh(words[word]) & ~((1ull << (from % 64)) - 1);
+	while (word * 64 < to){
+		if (used){
+			size_t bit = word * 64 + __builtin_ctzll(used);
+			return bit < to ? bit : to;
 		}
+		word++;
+		if (word * 64 >= to) break;
+		used = le64toh(words[word]);
+	}
+	return to;
+}
+
+/** set count bits of bit_map starting at index **/
+void set_bitmap_range(char *bit_map, size_t index, size_t count){
+	size_t end = index + count;
+	// leading bits up to a byte boundary
+	while (index < end && index % 8){
+		set_bitmap(bit_map, index++);
+	}
+	// whole bytes
+	if (end - index >= 8){
+		memset(bit_map + index / 8, 0xff, (end - index) / 8);
+		index += (end - index) / 8 * 8;
+	}
+	while (index < end){
+		set_bitmap(bit_map, index++);
+	}
+}
+
+/** clear count bits of bit_map starting at index **/
+void free_bitmap_range(char *bit_map, size_t index, size_t count){
+	size_t end = index + count;
+	// leading bits up to a byte boundary
+	while (index < end && index % 8){
+		free_bitmap(bit_map, index++);
+	}
+	// whole bytes
+	if (end - index >= 8){
+		memset(bit_map + index / 8, 0, (end - index) / 8);
+		index += (end - index) / 8 * 8;
 	}
-	if(sp->max_block_count/8 == 0){
-		for(unsigned int bit = 0; bit < sp->max_block_count%8; bit++){
-				inuse = 1 && (block_bitmap[byte] & (1 << bit));
-				if (! inuse){
-					return 8 * byte + bit;
-				}
-			}
+	while (index < end){
+		free_bitmap(bit_map, index++);
+	}
+}
+
+/** number of consecutive free bits in bit_map starting at index, but not past limit **/
+size_t free_run_length(const char *bit_map, size_t index, size_t limit){
+	if (index >= limit) return 0;
+	return scan_used_bit(bit_map, index, limit) - index;
+}
+
+/** find the first run of want free bits in [from, to); keep track of the longest one **/
+static long scan_free_run(const char *bit_map, size_t from, size_t to, size_t want,
+                          long *best, size_t *best_len){
+	while (from < to){
+		long run = scan_free_bit(bit_map, from, to);
+		if (run < 0) break;
+		size_t end = scan_used_bit(bit_map, run, to);
+		if (end - run >= want){
+			*best = run;
+			*best_len = end - run;
+			return run;
+		}
+		if (end - run > *best_len){
+			*best = run;
+			*best_len = end - run;
+		}
+		from = end;
 	}
 	return -1;
 }
 
+/** find a run of free bits in bit_map, next fit from start, wrapping around to 0 **/
+long find_free_run(const char *bit_map, size_t nbits, size_t start, size_t want, size_t *len){
+	long best = -1;
+	size_t best_len = 0;
+	if (start >= nbits) start = 0;
+	if (scan_free_run(bit_map, start, nbits, want, &best, &best_len) < 0 && start > 0){
+		scan_free_run(bit_map, 0, start, want, &best, &best_len);
+	}
+	*len = best_len;
+	return best;
+}
+
+/** find free inode by given superblock sp, starting at hint **/
+int find_free_inode_num(struct a1fs_superblock *sp, uint32_t hint){
+	char *inode_bits = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_bitmap);
+	return find_free_bit(inode_bits, sp->max_inodes_count, hint);
+}
+
+/** find free block by given superblock sp, starting at hint **/
+int find_free_block_num(struct a1fs_superblock *sp, uint32_t hint){
+	char *block_bitmap = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->block_bitmap);
+	return find_free_bit(block_bitmap, sp->max_block_count, hint);
+}
+
 /* whether inode replaceable */
 bool replaceable(a1fs_inode *inode){
 	if (S_ISDIR(inode->mode)){
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <endian.h>
 
 #include "a1fs.h"
 #include "map.h"
@@ -23,17 +24,41 @@ void free_bitmap(char *bit_map, int index);
 /** read bit_map at index **/
 bool read_bitmap(char *bit_map, int index);
 
+/**
+ * find the first free bit in bit_map at or after start, wrapping around to 0
+ * bit_map must be 8-byte aligned and padded to a multiple of 64 bits
+ * return -1 if every bit of the nbits is set
+ */
+long find_free_bit(const char *bit_map, size_t nbits, size_t start);
+
+/** set count bits of bit_map starting at index **/
+void set_bitmap_range(char *bit_map, size_t index, size_t count);
+
+/** clear count bits of bit_map starting at index **/
+void free_bitmap_range(char *bit_map, size_t index, size_t count);
+
+/** number of consecutive free bits in bit_map starting at index, but not past limit **/
+size_t free_run_length(const char *bit_map, size_t index, size_t limit);
+
+/**
+ * find a run of free bits in bit_map, next fit from start, wrapping around to 0
+ * returns the first run of at least want free bits; if there is none, the
+ * longest free run instead. len receives the length of the run found
+ * return -1 if every bit of the nbits is set
+ */
+long find_free_run(const char *bit_map, size_t nbits, size_t start, size_t want, size_t *len);
+
 /** 
- * find first free inode by given superblock sp
+ * find free inode by given superblock sp, starting at hint
  * return -1 on error
  */
-int find_first_free_inode_num(struct a1fs_superblock *sp);
+int find_free_inode_num(struct a1fs_superblock *sp, uint32_t hint);
 
 /** 
- * find first free block by given superblock sp
+ * find free block by given superblock sp, starting at hint
  * return -1 on error
  */
-int find_first_free_block_num(struct a1fs_superblock *sp);
+int find_free_block_num(struct a1fs_superblock *sp, uint32_t hint);
 
 /* whether inode replaceable */
 bool replaceable(a1fs_inode *inode);
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <string.h>
+
+#include "htree.h"
+#include "dirty.h"
+#include "group.h"
+
+
+/** Get the index node in block blk. */
+static a1fs_hnode *get_node(fs_ctx *fs, a1fs_blk_t blk){
+	return (a1fs_hnode*)((char*)fs->image + (size_t)blk * A1FS_BLOCK_SIZE);
+}
+
+/** Record that the index node in block blk of dir changed. */
+static void mark_node(fs_ctx *fs, a1fs_inode *dir, a1fs_blk_t blk){
+	dirty_mark(fs, dir, get_node(fs, blk), A1FS_BLOCK_SIZE);
+}
+
+/** Keys compare as this number: hash first, then position. */
+static uint64_t key_value(a1fs_hkey key){
+	return (uint64_t)key.hash << 32 | key.pos;
+}
+
+/** Number of keys or children a node of given level holds. */
+static uint32_t node_capacity(uint32_t level){
+	return level ? A1FS_HNODE_CHILDREN : A1FS_HNODE_KEYS;
+}
+
+bool htree_enabled(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	return sp->features & A1FS_FEATURE_DIR_INDEX;
+}
+
+
+/**
+ * Allocate count blocks for the index of dir; return false if there are not enough
+ * Index blocks are kept near the root of the index, the first one half way into
+ * the disk, rather than at fs->block_hint where the directory itself grows, so
+ * that they split its extents less often
+ */
+static bool alloc_blocks(fs_ctx *fs, a1fs_inode *dir, a1fs_blk_t *blks, uint32_t count){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	pthread_mutex_lock(&fs->block_lock);
+	if (sp->free_blocks_count - fs->reserved_blocks < count){
+		pthread_mutex_unlock(&fs->block_lock);
+		return false;
+	}
+	uint32_t hint = dir->dir_index ? dir->dir_index : sp->max_block_count / 2;
+	for (uint32_t i = 0; i < count; i++){
+		blks[i] = group_find_block(fs, hint);
+		group_take_blocks(fs, blks[i], 1);
+		hint = blks[i] + 1;
+	}
+	pthread_mutex_unlock(&fs->block_lock);
+	dir->blocks += count;
+	return true;
+}
+
+/** Free the index block blk of dir. */
+static void free_block(fs_ctx *fs, a1fs_inode *dir, a1fs_blk_t blk){
+	pthread_mutex_lock(&fs->block_lock);
+	group_put_blocks(fs, blk, 1);
+	pthread_mutex_unlock(&fs->block_lock);
+	dir->blocks -= 1;
+}
+
+
+int htree_create(fs_ctx *fs, a1fs_inode *dir){
+	a1fs_blk_t blk;
+	if (!alloc_blocks(fs, dir, &blk, 1)) return -ENOSPC;
+	a1fs_hnode *root = get_node(fs, blk);
+	root->level = 0;
+	root->count = 0;
+	root->next = 0;
+	dir->dir_index = blk;
+	mark_node(fs, dir, blk);
+	dirty_mark_inode(fs, dir);
+	return 0;
+}
+
+/** Free the subtree of the index of dir rooted at blk. */
+static void free_subtree(fs_ctx *fs, a1fs_inode *dir, a1fs_blk_t blk){
+	a1fs_hnode *node = get_node(fs, blk);
+	if (node->level > 0){
+		for (uint32_t i = 0; i < node->count; i++) free_subtree(fs, dir, node->children[i].child);
+	}
+	free_block(fs, dir, blk);
+}
+
+void htree_drop(fs_ctx *fs, a1fs_inode *dir){
+	if (!dir->dir_index) return;
+	free_subtree(fs, dir, dir->dir_index);
+	dir->dir_index = 0;
+	dirty_mark_inode(fs, dir);
+}
+
+
+/** Index of the first key of leaf that is not less than value. */
+static uint32_t lower_bound(const a1fs_hnode *leaf, uint64_t value){
+	uint32_t lo = 0, hi = leaf->count;
+	while (lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if (key_value(leaf->keys[mid]) < value) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/** Index of the child of an inner node that holds value. */
+static uint32_t find_child(const a1fs_hnode *node, uint64_t value){
+	// the last child whose key is not greater than value; the first key is not used
+	uint32_t lo = 1, hi = node->count;
+	while (lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if (key_value(node->children[mid].key) <= value) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+/** Put key (and child, for an inner node) at index at of node, which is not full. */
+static void put(a1fs_hnode *node, uint32_t at, a1fs_hkey key, a1fs_blk_t child){
+	if (node->level == 0){
+		memmove(&node->keys[at + 1], &node->keys[at], (node->count - at) * sizeof(node->keys[0]));
+		node->keys[at] = key;
+	} else {
+		memmove(&node->children[at + 1], &node->children[at], (node->count - at) * sizeof(node->children[0]));
+		node->children[at].key = key;
+		node->children[at].child = child;
+	}
+	node->count++;
+}
+
+bool htree_insert(fs_ctx *fs, a1fs_inode *dir, uint32_t hash, uint32_t pos){
+	a1fs_hkey key = { hash, pos };
+	// walk down to the leaf, remembering the node and the child taken at each level
+	a1fs_blk_t path[A1FS_HTREE_MAX_LEVELS];
+	uint32_t slots[A1FS_HTREE_MAX_LEVELS];
+	a1fs_blk_t blk = dir->dir_index;
+	a1fs_hnode *node = get_node(fs, blk);
+	uint32_t height = node->level;
+	for (uint32_t level = height; level > 0; level--){
+		path[level] = blk;
+		slots[level] = find_child(node, key_value(key));
+		blk = node->children[slots[level]].child;
+		node = get_node(fs, blk);
+	}
+	path[0] = blk;
+
+	// every full node on the way up splits, and a new root is needed if the
+	// old one does; take all the blocks first, so that nothing fails halfway
+	uint32_t need = 0;
+	for (uint32_t level = 0; level <= height; level++){
+		if (get_node(fs, path[level])->count < node_capacity(level)) break;
+		need += level == height ? 2 : 1;
+	}
+	a1fs_blk_t spare[A1FS_HTREE_MAX_LEVELS + 1];
+	if (need > 0 && (height + 1 >= A1FS_HTREE_MAX_LEVELS || !alloc_blocks(fs, dir, spare, need))){
+		htree_drop(fs, dir);
+		return false;
+	}
+
+	// put the key into the leaf, then the new right half of each split into the parent
+	a1fs_blk_t child = 0;
+	for (uint32_t level = 0; level <= height; level++){
+		node = get_node(fs, path[level]);
+		uint32_t at = level ? slots[level] + 1 : lower_bound(node, key_value(key));
+		if (node->count < node_capacity(level)){
+			put(node, at, key, child);
+			mark_node(fs, dir, path[level]);
+			return true;
+		}
+		a1fs_blk_t right_blk = spare[--need];
+		a1fs_hnode *right = get_node(fs, right_blk);
+		uint32_t half = node->count / 2;
+		right->level = level;
+		right->count = node->count - half;
+		if (level == 0){
+			memcpy(right->keys, &node->keys[half], right->count * sizeof(node->keys[0]));
+			right->next = node->next;
+			node->next = right_blk;
+		} else {
+			memcpy(right->children, &node->children[half], right->count * sizeof(node->children[0]));
+			right->next = 0;
+		}
+		node->count = half;
+		if (at <= half) put(node, at, key, child);
+		else put(right, at - half, key, child);
+		mark_node(fs, dir, path[level]);
+		mark_node(fs, dir, right_blk);
+		key = level ? right->children[0].key : right->keys[0];
+		child = right_blk;
+	}
+
+	// the root has split, so the tree grows by one level
+	a1fs_blk_t root_blk = spare[--need];
+	a1fs_hnode *root = get_node(fs, root_blk);
+	root->level = height + 1;
+	root->count = 2;
+	root->next = 0;
+	root->children[0].key = (a1fs_hkey){ 0, 0 };
+	root->children[0].child = dir->dir_index;
+	root->children[1].key = key;
+	root->children[1].child = child;
+	dir->dir_index = root_blk;
+	mark_node(fs, dir, root_blk);
+	dirty_mark_inode(fs, dir);
+	return true;
+}
+
+/** Get the leaf of the index of dir that holds value. */
+static a1fs_blk_t find_leaf(fs_ctx *fs, const a1fs_inode *dir, uint64_t value){
+	a1fs_blk_t blk = dir->dir_index;
+	a1fs_hnode *node = get_node(fs, blk);
+	while (node->level > 0){
+		blk = node->children[find_child(node, value)].child;
+		node = get_node(fs, blk);
+	}
+	return blk;
+}
+
+void htree_remove(fs_ctx *fs, a1fs_inode *dir, uint32_t hash, uint32_t pos){
+	uint64_t value = key_value((a1fs_hkey){ hash, pos });
+	a1fs_blk_t blk = find_leaf(fs, dir, value);
+	a1fs_hnode *leaf = get_node(fs, blk);
+	uint32_t at = lower_bound(leaf, value);
+	if (at == leaf->count || key_value(leaf->keys[at]) != value) return;
+	memmove(&leaf->keys[at], &leaf->keys[at + 1], (leaf->count - at - 1) * sizeof(leaf->keys[0]));
+	leaf->count--;
+	mark_node(fs, dir, blk);
+}
+
+
+void htree_seek(fs_ctx *fs, const a1fs_inode *dir, uint32_t hash, a1fs_hiter *it){
+	uint64_t value = key_value((a1fs_hkey){ hash, 0 });
+	it->hash = hash;
+	it->leaf = find_leaf(fs, dir, value);
+	it->index = lower_bound(get_node(fs, it->leaf), value);
+}
+
+long htree_next(fs_ctx *fs, a1fs_hiter *it){
+	// the keys with one hash may go on in the next leaves, some of which may be empty
+	while (it->leaf){
+		a1fs_hnode *leaf = get_node(fs, it->leaf);
+		if (it->index < leaf->count){
+			a1fs_hkey key = leaf->keys[it->index++];
+			if (key.hash == it->hash) return key.pos;
+			it->leaf = 0;
+			break;
+		}
+		it->leaf = leaf->next;
+		it->index = 0;
+	}
+	return -1;
+}
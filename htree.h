@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * On-disk name index of large directories, a B+tree of (name hash, position)
+ * in blocks of its own (see a1fs_hnode).
+ *
+ * Unlike the cached index of dindex.h, it survives a remount, so a cold lookup
+ * reads one block per level instead of the whole directory. Directories get an
+ * index once they reach A1FS_HTREE_MIN_SIZE, and lose it when they shrink below
+ * half of that; directories without an index are searched as before.
+ *
+ * The index blocks are counted in the blocks of the directory. Nodes are never
+ * merged, a leaf may even be empty. Callers hold the write lock of the
+ * directory to change the index and the read lock to search it.
+ */
+
+
+/** Directories at least this large, in bytes, get an on-disk index. */
+#define A1FS_HTREE_MIN_SIZE (4 * A1FS_BLOCK_SIZE)
+
+/** Maximum height of an index; enough for any 32-bit position. */
+#define A1FS_HTREE_MAX_LEVELS 8
+
+/** Position of a search in the leaves of an index. */
+typedef struct a1fs_hiter {
+	/** Name hash being searched for. */
+	uint32_t hash;
+	/** Current leaf; 0 when there are no more keys. */
+	a1fs_blk_t leaf;
+	/** Index of the next key in the leaf. */
+	uint32_t index;
+} a1fs_hiter;
+
+/** Whether the image keeps on-disk directory indexes. */
+bool htree_enabled(fs_ctx *fs);
+
+/**
+ * Give dir an empty index.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ */
+int htree_create(fs_ctx *fs, a1fs_inode *dir);
+
+/** Free every block of the index of dir, if it has one. */
+void htree_drop(fs_ctx *fs, a1fs_inode *dir);
+
+/**
+ * Add the entry with given name hash and position to the index of dir.
+ *
+ * @return  true on success; false if there is not enough free space for the
+ *          blocks a split needs, in which case the index has been dropped.
+ */
+bool htree_insert(fs_ctx *fs, a1fs_inode *dir, uint32_t hash, uint32_t pos);
+
+/** Remove the entry with given name hash and position from the index of dir. */
+void htree_remove(fs_ctx *fs, a1fs_inode *dir, uint32_t hash, uint32_t pos);
+
+/** Start a search for the entries of dir whose name hash is hash. */
+void htree_seek(fs_ctx *fs, const a1fs_inode *dir, uint32_t hash, a1fs_hiter *it);
+
+/** Position of the next entry with the hash of it; -1 if there are no more. */
+long htree_next(fs_ctx *fs, a1fs_hiter *it);
@@ -0,0 +1,542 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdev.h"
+#include "journal.h"
+
+
+static void *get_block(fs_ctx *fs, a1fs_blk_t blk){
+	return (char*)fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** Block of the log at log offset off. */
+static a1fs_blk_t log_block(a1fs_journal *j, uint64_t off){
+	return j->start + 1 + off % j->capacity;
+}
+
+static bool test_bit(const uint64_t *bits, size_t bit){
+	return bits[bit / 64] >> (bit % 64) & 1;
+}
+
+/** The first set bit of bits from bit on; words * 64 if there is none. */
+static size_t next_bit(const uint64_t *bits, size_t words, size_t bit){
+	size_t w = bit / 64;
+	if (w >= words) return words * 64;
+	uint64_t word = bits[w] & (~0ull << (bit % 64));
+	while (word == 0){
+		if (++w == words) return words * 64;
+		word = bits[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+/** The first word of the block bitmaps from word w on that may have bits set; j->words if there is none. */
+static size_t next_word(a1fs_journal *j, size_t w){
+	size_t next = next_bit(j->touched, j->touched_words, w);
+	return next < j->words ? next : j->words;
+}
+
+/** The first block from blk on with its bit set in bits, one of the block bitmaps of j. */
+static size_t next_block(a1fs_journal *j, const uint64_t *bits, size_t blk){
+	size_t w = blk / 64;
+	if (w >= j->words) return j->words * 64;
+	uint64_t word = bits[w] & (~0ull << (blk % 64));
+	while (word == 0){
+		w = next_word(j, w + 1);
+		if (w == j->words) return j->words * 64;
+		word = bits[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+static size_t count_bits(a1fs_journal *j, const uint64_t *bits){
+	size_t count = 0;
+	for (size_t w = next_word(j, 0); w < j->words; w = next_word(j, w + 1)) count += __builtin_popcountll(bits[w]);
+	return count;
+}
+
+
+/** 64-bit FNV-1a over the words of a block; torn writes are what it has to catch. */
+#define CHECKSUM_SEED 0xcbf29ce484222325ull
+
+static uint64_t checksum_block(uint64_t sum, const void *block){
+	const uint64_t *words = block;
+	for (size_t i = 0; i < A1FS_BLOCK_SIZE / sizeof(uint64_t); i++) sum = (sum ^ words[i]) * 0x100000001b3ull;
+	return sum;
+}
+
+static uint32_t fold(uint64_t sum){
+	return (uint32_t)(sum ^ sum >> 32);
+}
+
+
+/** Sync the log from offset from up to offset to. */
+static int sync_log(fs_ctx *fs, uint64_t from, uint64_t to){
+	a1fs_journal *j = fs->journal;
+	if (from == to) return 0;
+	a1fs_blk_t first = log_block(j, from), last = log_block(j, to - 1);
+	if (first <= last) return bdev_sync(fs, first, last + 1);
+	// it wraps around the end of the journal
+	int result = bdev_sync(fs, first, j->start + 1 + j->capacity);
+	int rest = bdev_sync(fs, j->start + 1, last + 1);
+	return result < 0 ? result : rest;
+}
+
+/** Record the head of the log in the journal superblock and sync it. */
+static int set_head(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	a1fs_journal_super *jsb = get_block(fs, j->start);
+	jsb->head = j->head;
+	jsb->head_seq = j->seq;
+	return bdev_sync(fs, j->start, j->start + 1);
+}
+
+
+/** Whether blk may be a target of the journal: in the image, and not in the journal. */
+static bool valid_target(fs_ctx *fs, a1fs_blk_t blk){
+	a1fs_journal *j = fs->journal;
+	return (size_t)blk < fs->size / A1FS_BLOCK_SIZE && (blk < j->start || blk > j->start + j->capacity);
+}
+
+/**
+ * Check the transaction at log offset off, which must have sequence number
+ * seq and be whole
+ *
+ * @return  its number of log blocks, the commit block included; 0 if it is missing or torn.
+ */
+static uint32_t check_txn(fs_ctx *fs, uint64_t off, uint64_t seq){
+	a1fs_journal *j = fs->journal;
+	uint64_t sum = CHECKSUM_SEED;
+	uint32_t len = 0;
+	while (len < j->capacity){
+		a1fs_journal_header *h = get_block(fs, log_block(j, off + len));
+		if (h->magic != A1FS_JOURNAL_MAGIC || h->seq != seq) return 0;
+		if (h->type == A1FS_JOURNAL_COMMIT){
+			return len > 0 && h->count == len && h->checksum == fold(sum) ? len + 1 : 0;
+		}
+		if (h->type != A1FS_JOURNAL_DESC || h->count > A1FS_JOURNAL_ENTRIES ||
+		    h->revokes > A1FS_JOURNAL_ENTRIES - h->count || len + 1 + h->count >= j->capacity){
+			return 0;
+		}
+		for (uint32_t i = 0; i < h->count + h->revokes; i++){
+			if (!valid_target(fs, h->blocks[i])) return 0;
+		}
+		for (uint32_t i = 0; i <= h->count; i++) sum = checksum_block(sum, get_block(fs, log_block(j, off + len + i)));
+		len += 1 + h->count;
+	}
+	return 0;
+}
+
+/** A block revoked by a transaction, found by replay. */
+typedef struct a1fs_revoke {
+	a1fs_blk_t blk;
+	uint64_t seq;
+} a1fs_revoke;
+
+static int compare_revokes(const void *a, const void *b){
+	const a1fs_revoke *x = a, *y = b;
+	if (x->blk != y->blk) return x->blk < y->blk ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/** Sequence number of the last transaction that revokes blk; 0 if none does. */
+static uint64_t revoked_by(const a1fs_revoke *revokes, size_t count, a1fs_blk_t blk){
+	size_t lo = 0, hi = count;
+	// the first entry past blk; the one before it is the last one of blk
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if (revokes[mid].blk <= blk){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 && revokes[lo - 1].blk == blk ? revokes[lo - 1].seq : 0;
+}
+
+/**
+ * Copy the blocks of the committed transactions in the log to their places
+ * and sync them, then empty the log. The revoked copies are skipped, so every
+ * block gets its last copy that no transaction revoked since.
+ */
+static bool replay(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	a1fs_journal_super *jsb = get_block(fs, j->start);
+	a1fs_revoke *revokes = NULL;
+	size_t revoke_count = 0, revoke_cap = 0, txns = 0;
+	uint64_t off = jsb->head, seq = jsb->head_seq;
+	uint32_t len;
+	// find the committed transactions, and what they revoke
+	while ((len = check_txn(fs, off, seq)) > 0 && off + len - jsb->head <= j->capacity){
+		for (uint32_t pos = 0; pos + 1 < len;){
+			a1fs_journal_header *h = get_block(fs, log_block(j, off + pos));
+			for (uint32_t i = h->count; i < h->count + h->revokes; i++){
+				if (revoke_count == revoke_cap){
+					revoke_cap = revoke_cap ? revoke_cap * 2 : 64;
+					a1fs_revoke *grown = realloc(revokes, revoke_cap * sizeof(a1fs_revoke));
+					if (!grown){
+						free(revokes);
+						return false;
+					}
+					revokes = grown;
+				}
+				revokes[revoke_count++] = (a1fs_revoke){ h->blocks[i], seq };
+			}
+			pos += 1 + h->count;
+		}
+		off += len;
+		seq += 1;
+		txns += 1;
+	}
+	if (revoke_count > 0) qsort(revokes, revoke_count, sizeof(a1fs_revoke), compare_revokes);
+
+	// then copy them, oldest first
+	uint64_t end = off;
+	off = jsb->head;
+	for (uint64_t s = jsb->head_seq; s < seq; s++){
+		uint32_t pos = 0;
+		while (1){
+			a1fs_journal_header *h = get_block(fs, log_block(j, off + pos));
+			if (h->type == A1FS_JOURNAL_COMMIT) break;
+			for (uint32_t i = 0; i < h->count; i++){
+				if (revoked_by(revokes, revoke_count, h->blocks[i]) >= s) continue;
+				memcpy(get_block(fs, h->blocks[i]), get_block(fs, log_block(j, off + pos + 1 + i)), A1FS_BLOCK_SIZE);
+			}
+			pos += 1 + h->count;
+		}
+		off += pos + 1;
+	}
+	free(revokes);
+	if (txns > 0 && bdev_sync_all(fs) < 0){
+		fprintf(stderr, "Failed to sync the replayed journal\n");
+		return false;
+	}
+	j->head = j->tail = end;
+	j->seq = seq;
+	if (txns > 0){
+		if (set_head(fs) < 0) return false;
+		if (fs->opts->verbose) fprintf(stderr, "journal: replayed %zu transactions\n", txns);
+	}
+	return true;
+}
+
+
+bool journal_init(fs_ctx *fs){
+	a1fs_superblock *sp = (a1fs_superblock*)fs->image;
+	fs->journal = NULL;
+	if (!(sp->features & A1FS_FEATURE_JOURNAL)) return true;
+	size_t blocks = fs->size / A1FS_BLOCK_SIZE;
+	if (sp->journal_blocks < 4 || sp->journal_start == 0 || (size_t)sp->journal_start + sp->journal_blocks > blocks) return false;
+	a1fs_journal_super *jsb = get_block(fs, sp->journal_start);
+	if (jsb->magic != A1FS_JOURNAL_MAGIC) return false;
+
+	fs->journal = calloc(1, sizeof(a1fs_journal));
+	if (!fs->journal) return false;
+	a1fs_journal *j = fs->journal;
+	j->start = sp->journal_start;
+	j->capacity = sp->journal_blocks - 1;
+	j->words = (blocks + 63) / 64;
+	j->running = calloc(j->words, sizeof(uint64_t));
+	j->revoked = calloc(j->words, sizeof(uint64_t));
+	j->logged = calloc(j->words, sizeof(uint64_t));
+	j->freed = calloc(j->words, sizeof(uint64_t));
+	j->touched_words = (j->words + 63) / 64;
+	j->touched = calloc(j->touched_words, sizeof(uint64_t));
+	if (!j->running || !j->revoked || !j->logged || !j->freed || !j->touched) return false;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->idle, NULL);
+	pthread_cond_init(&j->done, NULL);
+	j->tid = 1;
+	return replay(fs);
+}
+
+void journal_destroy(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	if (!j) return;
+	if (j->running && j->revoked && j->logged && j->freed && j->touched){
+		pthread_mutex_destroy(&j->lock);
+		pthread_cond_destroy(&j->idle);
+		pthread_cond_destroy(&j->done);
+	}
+	free(j->running);
+	free(j->revoked);
+	free(j->logged);
+	free(j->freed);
+	free(j->touched);
+	free(j);
+	fs->journal = NULL;
+}
+
+
+void journal_begin(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	if (!j) return;
+	pthread_mutex_lock(&j->lock);
+	while (j->frozen) pthread_cond_wait(&j->done, &j->lock);
+	j->handles += 1;
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_end(fs_ctx *fs, bool durable){
+	a1fs_journal *j = fs->journal;
+	if (!j) return 0;
+	pthread_mutex_lock(&j->lock);
+	j->handles -= 1;
+	if (j->handles == 0 && j->frozen) pthread_cond_signal(&j->idle);
+	// a transaction of a quarter of the log still fits once the log is
+	// checkpointed at half full
+	size_t estimate = j->pending + j->pending / A1FS_JOURNAL_ENTRIES + 2;
+	bool full = estimate > j->capacity / 4;
+	pthread_mutex_unlock(&j->lock);
+	return durable || full ? journal_commit(fs) : 0;
+}
+
+void journal_mark(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	for (a1fs_blk_t blk = start; blk < end; blk++){
+		uint64_t bit = 1ull << (blk % 64);
+		if (!(j->running[blk / 64] & bit)){
+			j->running[blk / 64] |= bit;
+			j->touched[blk / 64 / 64] |= 1ull << (blk / 64 % 64);
+			j->pending += 1;
+		}
+		// used again, so the copy is the one to replay
+		j->revoked[blk / 64] &= ~bit;
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_revoke(fs_ctx *fs, a1fs_blk_t blk, size_t count){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	for (size_t b = blk; b < blk + count;){
+		// the block must not be reused in place before the free is committed
+		size_t n = 64 - b % 64 < blk + count - b ? 64 - b % 64 : blk + count - b;
+		j->freed[b / 64] |= (n == 64 ? ~0ull : (1ull << n) - 1) << (b % 64);
+		j->touched[b / 64 / 64] |= 1ull << (b / 64 % 64);
+		b += n;
+	}
+	for (size_t b = blk; b < blk + count; b++){
+		if (!(j->running[b / 64] | j->logged[b / 64])){
+			// nothing to drop in this word
+			b |= 63;
+			continue;
+		}
+		uint64_t bit = 1ull << (b % 64);
+		// a free block is not copied, and no copy of it is replayed
+		j->running[b / 64] &= ~bit;
+		if ((j->logged[b / 64] & bit) && !(j->revoked[b / 64] & bit)){
+			j->revoked[b / 64] |= bit;
+			j->pending += 1;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+a1fs_blk_t journal_next_pending(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	// a commit changes the bitmaps without the lock
+	while (j->frozen) pthread_cond_wait(&j->done, &j->lock);
+	size_t blk = next_block(j, j->running, start);
+	pthread_mutex_unlock(&j->lock);
+	return blk < end ? blk : end;
+}
+
+bool journal_freed(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	while (j->frozen) pthread_cond_wait(&j->done, &j->lock);
+	size_t blk = next_block(j, j->freed, start);
+	pthread_mutex_unlock(&j->lock);
+	return blk < end;
+}
+
+
+/**
+ * Copy the running transaction, with copies blocks and revokes revoked
+ * blocks, to the log at its tail
+ * No operation may be in progress
+ */
+static void write_txn(fs_ctx *fs, size_t copies, size_t revokes){
+	a1fs_journal *j = fs->journal;
+	uint64_t sum = CHECKSUM_SEED;
+	size_t blk = 0, rblk = 0;
+	uint32_t len = 0;
+	do {
+		a1fs_journal_header *h = get_block(fs, log_block(j, j->tail + len));
+		memset(h, 0, A1FS_BLOCK_SIZE);
+		h->magic = A1FS_JOURNAL_MAGIC;
+		h->seq = j->seq;
+		h->type = A1FS_JOURNAL_DESC;
+		h->count = copies < A1FS_JOURNAL_ENTRIES ? copies : A1FS_JOURNAL_ENTRIES;
+		h->revokes = revokes < A1FS_JOURNAL_ENTRIES - h->count ? revokes : A1FS_JOURNAL_ENTRIES - h->count;
+		for (uint32_t i = 0; i < h->count; i++){
+			blk = next_block(j, j->running, blk);
+			h->blocks[i] = blk;
+			memcpy(get_block(fs, log_block(j, j->tail + len + 1 + i)), get_block(fs, blk), A1FS_BLOCK_SIZE);
+			blk++;
+		}
+		for (uint32_t i = 0; i < h->revokes; i++){
+			rblk = next_block(j, j->revoked, rblk);
+			h->blocks[h->count + i] = rblk++;
+		}
+		for (uint32_t i = 0; i <= h->count; i++) sum = checksum_block(sum, get_block(fs, log_block(j, j->tail + len + i)));
+		copies -= h->count;
+		revokes -= h->revokes;
+		len += 1 + h->count;
+		j->logged_blocks += h->count;
+	} while (copies + revokes > 0);
+
+	a1fs_journal_header *commit = get_block(fs, log_block(j, j->tail + len));
+	memset(commit, 0, A1FS_BLOCK_SIZE);
+	commit->magic = A1FS_JOURNAL_MAGIC;
+	commit->seq = j->seq;
+	commit->type = A1FS_JOURNAL_COMMIT;
+	commit->count = len;
+	commit->checksum = fold(sum);
+
+	for (size_t w = next_word(j, 0); w < j->words; w = next_word(j, w + 1)){
+		j->logged[w] |= j->running[w];
+		j->running[w] = 0;
+		j->revoked[w] = 0;
+		j->freed[w] = 0;
+	}
+	j->tail += len + 1;
+	j->seq += 1;
+	j->commits += 1;
+}
+
+/**
+ * Sync every block with a copy in the log, and every block of the running
+ * transaction, in place, and empty the log
+ * No operation may be in progress
+ */
+static int write_back(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	size_t blocks = j->words * 64;
+	int result = 0;
+	size_t blk = 0;
+	while (blk < blocks){
+		// the next run of blocks that are logged or changed
+		size_t logged = next_block(j, j->logged, blk), running = next_block(j, j->running, blk);
+		blk = logged < running ? logged : running;
+		if (blk >= blocks) break;
+		size_t end = blk + 1;
+		while (end < blocks && (test_bit(j->logged, end) || test_bit(j->running, end))) end++;
+		int synced = bdev_sync(fs, blk, end);
+		if (synced < 0) result = synced;
+		blk = end;
+	}
+	if (result < 0) return result;
+	for (size_t w = next_word(j, 0); w < j->words; w = next_word(j, w + 1)){
+		j->logged[w] = 0;
+		j->running[w] = 0;
+		j->revoked[w] = 0;
+		j->freed[w] = 0;
+	}
+	memset(j->touched, 0, j->touched_words * sizeof(uint64_t));
+	j->head = j->tail;
+	j->checkpoints += 1;
+	result = set_head(fs);
+	// nothing is changed until the operations go on
+	if (result == 0 && bdev_cache_full(fs)) result = bdev_release(fs);
+	return result;
+}
+
+/**
+ * Close the running transaction and write it to the log, or with checkpoint
+ * set, also write back the whole log
+ * The caller must have set fs->journal->committing
+ */
+static int commit(fs_ctx *fs, bool checkpoint){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	j->frozen = true;
+	while (j->handles > 0) pthread_cond_wait(&j->idle, &j->lock);
+	uint64_t tid = j->tid++;
+	bool changed = j->pending > 0;
+	j->pending = 0;
+	pthread_mutex_unlock(&j->lock);
+
+	// no operation runs until the blocks are copied; the counters of the
+	// superblock change along with the bitmaps, and are never recorded
+	if (changed){
+		j->running[0] |= 1;
+		j->touched[0] |= 1;
+	}
+	size_t copies = count_bits(j, j->running), revokes = count_bits(j, j->revoked);
+	size_t len = (copies + revokes + A1FS_JOURNAL_ENTRIES - 1) / A1FS_JOURNAL_ENTRIES + copies + 1;
+	uint64_t from = j->tail;
+	int result = 0;
+	if (copies + revokes > 0 && j->tail + len - j->head <= j->capacity){
+		write_txn(fs, copies, revokes);
+	}
+	bool unfit = copies + revokes > 0 && from == j->tail;
+	if (checkpoint || j->broken || unfit || j->tail - j->head > j->capacity / 2 || bdev_cache_full(fs)){
+		// the log is synced first, so that a crash while the blocks are
+		// synced in place leaves them to replay
+		result = sync_log(fs, from, j->tail);
+		if (result == 0) result = write_back(fs);
+		from = j->tail;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->frozen = false;
+	pthread_cond_broadcast(&j->done);
+	pthread_mutex_unlock(&j->lock);
+	if (result == 0) result = sync_log(fs, from, j->tail);
+	// a transaction that may be torn ends the log for replay
+	j->broken = result < 0;
+
+	pthread_mutex_lock(&j->lock);
+	j->done_tid = tid;
+	if (result < 0){
+		j->error_tid = tid;
+		j->error = result;
+	}
+	pthread_cond_broadcast(&j->done);
+	pthread_mutex_unlock(&j->lock);
+	return result;
+}
+
+int journal_commit(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	// the changes so far are in the running transaction, or in the one being
+	// committed; a full cache of the backend takes a checkpoint to empty
+	uint64_t target = j->pending > 0 || bdev_cache_full(fs) ? j->tid : j->tid - 1;
+	uint64_t since = j->done_tid;
+	while (j->done_tid < target){
+		if (j->committing){
+			pthread_cond_wait(&j->done, &j->lock);
+			continue;
+		}
+		j->committing = true;
+		pthread_mutex_unlock(&j->lock);
+		commit(fs, false);
+		pthread_mutex_lock(&j->lock);
+		j->committing = false;
+		pthread_cond_broadcast(&j->done);
+	}
+	int result = j->error_tid > since && j->error_tid <= target ? j->error : 0;
+	pthread_mutex_unlock(&j->lock);
+	return result;
+}
+
+int journal_checkpoint(fs_ctx *fs){
+	a1fs_journal *j = fs->journal;
+	pthread_mutex_lock(&j->lock);
+	while (j->committing) pthread_cond_wait(&j->done, &j->lock);
+	j->committing = true;
+	pthread_mutex_unlock(&j->lock);
+	int result = commit(fs, true);
+	pthread_mutex_lock(&j->lock);
+	j->committing = false;
+	pthread_cond_broadcast(&j->done);
+	pthread_mutex_unlock(&j->lock);
+	return result;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Metadata write-ahead journal, on images formatted with mkfs.a1fs -j.
+ *
+ * Every core_* operation that changes the image is a transaction: it runs
+ * between journal_begin() and journal_end(), and the blocks of metadata it
+ * changes (the superblock, the bitmaps and group descriptors, the inodes,
+ * directory blocks, extent tree and directory index nodes) are recorded in
+ * the running transaction, through the dirty_mark*() calls of dirty.h. File
+ * data is not journaled; it is synced in place as before.
+ *
+ * A commit waits until no operation is in progress, so that the image holds
+ * whole operations only, copies the recorded blocks into the log with their
+ * block numbers and a commit block, lets the operations go on, and syncs the
+ * log with one msync() - two where it wraps. Everything recorded since the
+ * last commit goes in the same transaction, so any number of fsync() calls,
+ * or operations of a --sync mount, that arrive while a commit is being synced
+ * share the next one (group commit). The blocks are synced in place only by a
+ * checkpoint, by the commit that fills more than half of the log, or on
+ * unmount: it syncs every block with a copy in the log in place before the
+ * operations go on, and empties the log. A transaction that grows to a
+ * quarter of the log is committed when its operation ends, so that it always
+ * fits; one that does not fit even so, from a single huge operation, is
+ * synced in place along with the log, which is then not atomic. On mount,
+ * the committed transactions still in the log are copied to their blocks
+ * (replayed), in order.
+ *
+ * A block that is freed while a copy of it is in the log is revoked by the
+ * next transaction, so that the copy does not overwrite the file data it may
+ * hold by then. With the image mapped shared, the kernel may still write a
+ * changed block in place before it is committed; the journal only makes sure
+ * that a committed transaction reaches the disk whole. With --io=pwrite (see
+ * bdev.h) nothing is written in place before a checkpoint, which also empties
+ * the block cache of the backend once it is full.
+ *
+ * The recorded blocks are bitmaps over the image, protected by
+ * fs->journal->lock, which is taken after every other lock. Operations wait
+ * in journal_begin() before they take any lock of fs_core.h, and commits are
+ * made with none held.
+ */
+typedef struct a1fs_journal {
+	/** Protects everything below, and the block bitmaps while no commit waits. */
+	pthread_mutex_t lock;
+	/** Signalled when the last operation ends while a commit waits. */
+	pthread_cond_t idle;
+	/** Signalled when a commit lets the operations go on, and when it is over. */
+	pthread_cond_t done;
+	/** Number of operations in progress. */
+	uint32_t handles;
+	/** Set while a commit waits for the operations to end, and copies the blocks. */
+	bool frozen;
+	/** Set while a thread makes a commit or a checkpoint. */
+	bool committing;
+	/** Set when the log could not be synced; the next commit is a checkpoint. */
+	bool broken;
+
+	/** Number of the running transaction; every commit or checkpoint closes one. */
+	uint64_t tid;
+	/** Number of the last transaction on disk, in the log or in place. */
+	uint64_t done_tid;
+	/** Number of the last transaction that failed, and its error. */
+	uint64_t error_tid;
+	int error;
+	/** Number of blocks recorded or revoked by the running transaction. */
+	uint32_t pending;
+
+	/** First block of the journal (its superblock), and the number of log blocks after it. */
+	a1fs_blk_t start;
+	uint32_t capacity;
+	/** Log offsets of the first transaction not yet in place, and of the next one. */
+	uint64_t head;
+	uint64_t tail;
+	/** Sequence number of the next transaction written to the log. */
+	uint64_t seq;
+
+	/** Blocks changed by the running transaction. */
+	uint64_t *running;
+	/** Blocks freed by the running transaction that have copies in the log. */
+	uint64_t *revoked;
+	/** Blocks with copies in the log. */
+	uint64_t *logged;
+	/** Blocks freed by the running transaction. */
+	uint64_t *freed;
+	/** Number of 64-bit words of each bitmap. */
+	size_t words;
+	/** Words of the bitmaps above that may have bits set, one bit each, cleared by a checkpoint. */
+	uint64_t *touched;
+	size_t touched_words;
+
+	/** Number of transactions committed, blocks copied to the log, and checkpoints. */
+	uint64_t commits;
+	uint64_t logged_blocks;
+	uint64_t checkpoints;
+} a1fs_journal;
+
+
+/**
+ * Replay the committed transactions of the journal, if the image has one,
+ * and set up the running transaction; fs->journal is NULL without one.
+ *
+ * Must be called before anything else reads the image.
+ *
+ * @return  true on success; false if the journal is invalid or out of memory.
+ */
+bool journal_init(fs_ctx *fs);
+
+/** Free what journal_init() allocated; the log must have been checkpointed. */
+void journal_destroy(fs_ctx *fs);
+
+/** Start an operation; waits while a commit copies the blocks. Calls must not nest. */
+void journal_begin(fs_ctx *fs);
+
+/**
+ * End an operation started by journal_begin(). The running transaction is
+ * committed if durable is set, or if it has grown to a quarter of the log.
+ *
+ * @return  0 on success; the error of journal_commit() otherwise.
+ */
+int journal_end(fs_ctx *fs, bool durable);
+
+/** Record that blocks [start, end) were changed by the running transaction; fs->journal->lock must not be held. */
+void journal_mark(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end);
+
+/** Record that count blocks from blk on were freed by the running transaction. */
+void journal_revoke(fs_ctx *fs, a1fs_blk_t blk, size_t count);
+
+/** The first block of [start, end) changed by the running transaction; end if there is none. */
+a1fs_blk_t journal_next_pending(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end);
+
+/**
+ * Whether a block of [start, end) was freed by the running transaction. It
+ * must not be synced in place, for another file, before the free is
+ * committed: a crash would leave it to the old owner with the new data.
+ */
+bool journal_freed(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t end);
+
+/**
+ * Make every change recorded so far durable, in a commit that may be shared
+ * with other callers. No lock of fs_core.h may be held, nor a transaction.
+ *
+ * Errors:
+ *   EIO  the log could not be written (or another error of msync()).
+ */
+int journal_commit(fs_ctx *fs);
+
+/**
+ * Sync every block in the log and every recorded change in place and empty
+ * the log, e.g. on unmount. Same conditions and errors as journal_commit().
+ */
+int journal_checkpoint(fs_ctx *fs);
@@ -27,6 +27,11 @@
 
 
 void *map_file(const char *path, size_t block_size, size_t *size)
+{
+	return map_file_fd(path, block_size, size, MAP_SHARED, NULL);
+}
+
+void *map_file_fd(const char *path, size_t block_size, size_t *size, int flags, int *fd_out)
 {
 	// Open the file for reading and writing
 	int fd = open(path, O_RDWR);
@@ -54,7 +59,7 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 	}
 
 	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
 	if (addr == MAP_FAILED) {
 		perror("mmap");
 		addr = NULL;
@@ -64,6 +69,10 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 	*size = s.st_size;
 
 end:
+	if (addr && fd_out) {
+		*fd_out = fd;
+		return addr;
+	}
 	//NOTE: memory mapping keeps a reference to the open file; can safely close
 	// the file descriptor now; a future munmap() will close the file
 	close(fd);
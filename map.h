@@ -33,3 +33,9 @@
  *                    NULL on failure.
  */
 void *map_file(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Same as map_file(), with the given mmap() flags, e.g. MAP_PRIVATE. If fd is
+ * not NULL, the file is kept open and its descriptor is stored there.
+ */
+void *map_file_fd(const char *path, size_t block_size, size_t *size, int flags, int *fd);
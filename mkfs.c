@@ -16,6 +16,8 @@
  * CSC369 Assignment 1 - a1fs formatting tool.
  */
  
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +37,12 @@ typedef struct mkfs_opts {
     const char *img_path;
     /** Number of inodes. */
     size_t n_inodes;
+    /** Size of an inode table slot in bytes; 0 for sizeof(a1fs_inode). */
+    size_t inode_size;
+    /** Number of blocks in a block group; 0 for no block groups. */
+    size_t group_blocks;
+    /** Number of journal blocks; 0 for no journal. */
+    size_t journal_blocks;
  
     /** Print help and exit. */
     bool help;
@@ -46,9 +54,16 @@ typedef struct mkfs_opts {
     bool verbose;
     /** Zero out image contents. */
     bool zero;
+    /** Use compact variable-length directory entries. */
+    bool compact;
+    /** Keep on-disk name indexes of large directories. */
+    bool index;
  
 } mkfs_opts;
  
+/** Smallest journal; with less, the log may not hold a large operation whole (see journal.h). */
+#define A1FS_MIN_JOURNAL_BLOCKS 32
+
 static const char *help_str = "\
 Usage: %s options image\n\
 \n\
@@ -57,31 +72,49 @@ its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -I size inode size in bytes, a power of 2 up to the block size; files\n\
+            and directories that fit into the rest keep their data inline\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -s      sync image file contents to disk\n\
     -v      verbose output\n\
-    -z      zero out image contents\n\
+    -z      zero out image contents (punches holes where the file system\n\
+            supports it)\n\
+    -c      use compact variable-length directory entries\n\
+    -x      keep on-disk name indexes of large directories\n\
+    -g num  divide the image into block groups of num blocks, up to %d,\n\
+            each with its own bitmaps and inode table\n\
+    -j num  keep a write-ahead journal of num blocks, at least %d, for\n\
+            the metadata; in group 0 with -g\n\
 ";
  
 static void print_help(FILE *f, const char *progname)
 {
-    fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+    fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_MAX_GROUP_BLOCKS, A1FS_MIN_JOURNAL_BLOCKS);
 }
  
  
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
     char o;
-    while ((o = getopt(argc, argv, "i:hfsvz")) != -1) {
+    while ((o = getopt(argc, argv, "i:I:g:j:hfsvzcx")) != -1) {
         switch (o) {
             case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+            case 'I': opts->inode_size = strtoul(optarg, NULL, 10); break;
+            case 'g': opts->group_blocks = strtoul(optarg, NULL, 10);
+                      if (opts->group_blocks == 0) return false;
+                      break;
+            case 'j': opts->journal_blocks = strtoul(optarg, NULL, 10);
+                      if (opts->journal_blocks < A1FS_MIN_JOURNAL_BLOCKS) return false;
+                      break;
  
             case 'h': opts->help    = true; return true;// skip other arguments
             case 'f': opts->force   = true; break;
             case 's': opts->sync    = true; break;
             case 'v': opts->verbose = true; break;
             case 'z': opts->zero    = true; break;
+            case 'c': opts->compact = true; break;
+            case 'x': opts->index   = true; break;
  
             case '?': return false;
             default : assert(false);
@@ -98,6 +131,17 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
         fprintf(stderr, "Missing or invalid number of inodes\n");
         return false;
     }
+
+    if (opts->inode_size == 0) opts->inode_size = sizeof(a1fs_inode);
+    if (opts->inode_size < sizeof(a1fs_inode) || opts->inode_size > A1FS_BLOCK_SIZE ||
+        (opts->inode_size & (opts->inode_size - 1)) != 0) {
+        fprintf(stderr, "Invalid inode size\n");
+        return false;
+    }
+    if (opts->group_blocks > A1FS_MAX_GROUP_BLOCKS) {
+        fprintf(stderr, "Invalid block group size\n");
+        return false;
+    }
     return true;
 }
  
@@ -110,6 +154,148 @@ static bool a1fs_is_present(void *image)
 }
  
  
+/**
+ * Zero out the image file at path, mapped at image.
+ *
+ * Holes are punched into the file instead where its file system supports
+ * that, so that the blocks are neither written nor kept allocated.
+ */
+static void zero_image(const char *path, void *image, size_t size)
+{
+    int fd = open(path, O_RDWR);
+    if (fd >= 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+        close(fd);
+        return;
+    }
+    if (fd >= 0) close(fd);
+    memset(image, 0, size);
+}
+
+
+/** Initialize the inode of the empty root directory. */
+static void init_root(struct a1fs_inode *iroot)
+{
+   iroot->mode = S_IFDIR;
+   iroot->links = 2; // one for '.', one for '..'
+   iroot->size = 0; // the size of the dentry
+   clock_gettime(CLOCK_REALTIME, &iroot->mtime);
+   iroot->blocks = 0;
+   iroot->extent_count = 0;
+   iroot->extent_depth = 0;
+   iroot->dir_index = 0;
+}
+
+
+/**
+ * Create an empty journal of opts->journal_blocks blocks from block start on,
+ * see a1fs_journal_super.
+ */
+static void init_journal(struct a1fs_superblock *sp, a1fs_blk_t start, mkfs_opts *opts)
+{
+   sp->features |= A1FS_FEATURE_JOURNAL;
+   sp->journal_start = start;
+   sp->journal_blocks = opts->journal_blocks;
+   // the superblock and the first log block, so that nothing is replayed
+   a1fs_journal_super *jsb = (a1fs_journal_super*)((void*)sp + A1FS_BLOCK_SIZE * start);
+   memset(jsb, 0, A1FS_BLOCK_SIZE * 2);
+   jsb->magic = A1FS_JOURNAL_MAGIC;
+   jsb->head = 0;
+   // records left by an earlier file system in the image must not pass for new ones
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   jsb->head_seq = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * Lay out the image in block groups of opts->group_blocks blocks, see
+ * a1fs_group_desc, and create the root directory in group 0.
+ *
+ * The superblock fields that don't depend on the layout must be set already.
+ *
+ * @return  true on success; false if the groups don't fit into the image.
+ */
+static bool mkfs_groups(struct a1fs_superblock *sp, mkfs_opts *opts) {
+   size_t bpg = opts->group_blocks;
+   size_t max_blocks = sp->max_block_count;
+   // a last group too short for its bitmaps, its inode table and a data block is left out
+   size_t groups, ipg, gdt_blocks, itable_blocks;
+   for (groups = (max_blocks + bpg - 1) / bpg; ; groups--) {
+       if (groups == 0) return false;
+       ipg = (opts->n_inodes + groups - 1) / groups;
+       if (ipg < 2) ipg = 2;// the root is in group 0
+       itable_blocks = calculate_blocks_needed(ipg * opts->inode_size, A1FS_BLOCK_SIZE);
+       gdt_blocks = calculate_blocks_needed(groups * sizeof(a1fs_group_desc), A1FS_BLOCK_SIZE);
+       size_t last = max_blocks - (groups - 1) * bpg;
+       size_t overhead = 2 + itable_blocks + (groups == 1 ? 1 + gdt_blocks + opts->journal_blocks : 0);
+       if (last > overhead) break;
+       max_blocks = (groups - 1) * bpg;
+   }
+   if (ipg > A1FS_BLOCK_SIZE * 8) return false;// one inode bitmap block per group
+   size_t first_group = bpg < max_blocks ? bpg : max_blocks;
+   if (1 + gdt_blocks + 2 + itable_blocks + opts->journal_blocks >= first_group) return false;
+
+   sp->features |= A1FS_FEATURE_BLOCK_GROUPS;
+   sp->max_block_count = max_blocks;
+   sp->max_inodes_count = groups * ipg;
+   sp->blocks_per_group = bpg;
+   sp->inodes_per_group = ipg;
+   sp->groups_count = groups;
+   sp->group_desc = 1;
+   a1fs_group_desc *gdt = (a1fs_group_desc*)((void*)sp + A1FS_BLOCK_SIZE * sp->group_desc);
+   memset(gdt, 0, A1FS_BLOCK_SIZE * gdt_blocks);
+
+   sp->blocks_count = 0;
+   for (size_t g = 0; g < groups; g++) {
+       a1fs_group_desc *gd = &gdt[g];
+       size_t first = g * bpg;
+       size_t blocks = max_blocks - first < bpg ? max_blocks - first : bpg;
+       // group 0 starts with the superblock and the descriptors
+       gd->block_bitmap = first + (g == 0 ? 1 + gdt_blocks : 0);
+       gd->inode_bitmap = gd->block_bitmap + 1;
+       gd->inode_table = gd->inode_bitmap + 1;
+       size_t used = gd->inode_table + itable_blocks - first;
+       // the journal follows the inode table of group 0
+       if (g == 0 && opts->journal_blocks) {
+           init_journal(sp, gd->inode_table + itable_blocks, opts);
+           used += opts->journal_blocks;
+       }
+
+       char *block_bits = (char *)((void*)sp + A1FS_BLOCK_SIZE * gd->block_bitmap);
+       memset(block_bits, 0, A1FS_BLOCK_SIZE);
+       set_bitmap_range(block_bits, 0, used);
+       memset((void*)sp + A1FS_BLOCK_SIZE * gd->inode_bitmap, 0, A1FS_BLOCK_SIZE);
+       gd->free_blocks_count = blocks - used;
+       gd->free_inodes_count = ipg;
+       sp->blocks_count += used;
+
+       // inode tables are zeroed lazily as in a single group layout
+       if (opts->zero) {
+           gd->itable_zeroed = itable_blocks;
+       } else {
+           gd->itable_zeroed = g == 0 ? calculate_blocks_needed(2 * opts->inode_size, A1FS_BLOCK_SIZE) : 0;
+           memset((void*)sp + A1FS_BLOCK_SIZE * gd->inode_table, 0, A1FS_BLOCK_SIZE * gd->itable_zeroed);
+       }
+   }
+   // the superblock points to the bitmaps and the inode table of group 0
+   sp->block_bitmap = gdt[0].block_bitmap;
+   sp->inode_bitmap = gdt[0].inode_bitmap;
+   sp->inode_table = gdt[0].inode_table;
+   sp->itable_zeroed = gdt[0].itable_zeroed;
+
+   char *inode_bitmap = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_bitmap);
+   set_bitmap(inode_bitmap, 0);// for error handle
+   set_bitmap(inode_bitmap, 1); //for root
+   init_root((struct a1fs_inode*)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table + 1 * sp->inode_size));
+   gdt[0].free_inodes_count -= 2;
+
+   sp->inodes_count = 2;
+   sp->free_blocks_count = sp->max_block_count - sp->blocks_count;
+   sp->free_inodes_count = sp->max_inodes_count - sp->inodes_count;
+   return true;
+}
+
+
 /**
  * Format the image into a1fs.
  *
@@ -127,6 +313,23 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts) {
    sp->magic = A1FS_MAGIC;
    sp->size = size;
    sp->max_inodes_count = opts->n_inodes;
+   sp->max_block_count = size / A1FS_BLOCK_SIZE;
+
+   sp->inode_size = opts->inode_size;
+   sp->features = A1FS_FEATURE_EXTENT_TREE;
+   if (sp->inode_size > sizeof(a1fs_inode)) sp->features |= A1FS_FEATURE_INLINE_DATA;
+   if (opts->compact) sp->features |= A1FS_FEATURE_COMPACT_DIRS;
+   if (opts->index) sp->features |= A1FS_FEATURE_DIR_INDEX;
+   sp->features |= A1FS_FEATURE_LAZY_ITABLE;
+
+   if (opts->group_blocks) {
+       if (!mkfs_groups(sp, opts)) {
+           sp->state = 2;
+           return false;
+       }
+       sp->state = 1;
+       return true;
+   }
   
    // Block number of inode bitmap
    sp->inode_bitmap = 1;
@@ -137,13 +340,12 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts) {
    memset((void*)sp + sp->inode_bitmap * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE * num_blocks_for_inode_bitmap);
  
    // space needed to include all inode struct
-   int inode_total_space = sizeof(a1fs_inode) * sp->max_inodes_count;
+   size_t inode_total_space = opts->inode_size * sp->max_inodes_count;
    unsigned int num_blocks_for_inode_table =  calculate_blocks_needed(inode_total_space, A1FS_BLOCK_SIZE);
    if(num_blocks_for_inode_table > sp->max_block_count - 1 - num_blocks_for_inode_bitmap) return false;
  
    // Block number of block bitmap
    sp->block_bitmap = 1 + num_blocks_for_inode_bitmap;
-   sp->max_block_count = size / A1FS_BLOCK_SIZE;
    unsigned int num_blocks_for_block_bitmap = calculate_blocks_needed(sp->max_block_count, A1FS_BLOCK_SIZE * 8);
    if(num_blocks_for_block_bitmap > sp->max_block_count - 1 - num_blocks_for_inode_bitmap) return false;
    
@@ -152,8 +354,21 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts) {
  
    // Block number of inode table
    sp->inode_table = sp->block_bitmap + num_blocks_for_block_bitmap;
+
+   // the journal follows the inode table
+   if (opts->journal_blocks) {
+       if (sp->inode_table + num_blocks_for_inode_table + opts->journal_blocks >= sp->max_block_count) return false;
+       init_journal(sp, sp->inode_table + num_blocks_for_inode_table, opts);
+   }
  
-   sp->inode_size = sizeof(struct a1fs_inode);
+   // only the block with the root inode is zeroed now, the rest of the
+   // inode table as inodes are allocated; a zeroed image needs none of it
+   if (opts->zero) {
+       sp->itable_zeroed = num_blocks_for_inode_table;
+   } else {
+       sp->itable_zeroed = calculate_blocks_needed(2 * opts->inode_size, A1FS_BLOCK_SIZE);
+       memset((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table, 0, A1FS_BLOCK_SIZE * sp->itable_zeroed);
+   }
  
    // create empty root directory (only inode is needed)
    // set inode bitmap 0 to 1
@@ -161,24 +376,16 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts) {
    set_bitmap(inode_bitmap, 0);// for error handle
    set_bitmap(inode_bitmap, 1); //for root
   
-   struct a1fs_inode *iroot = (struct a1fs_inode*)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table + 1 * sizeof(a1fs_inode));
- 
-   iroot->mode = S_IFDIR;
-   iroot->links = 2; // one for '.', one for '..'
-   iroot->size = 0; // the size of the dentry
-   clock_gettime(CLOCK_REALTIME, &iroot->mtime);
-   iroot->blocks = 0;
+   init_root((struct a1fs_inode*)((void*)sp + A1FS_BLOCK_SIZE * sp->inode_table + 1 * sp->inode_size));
  
    sp->inodes_count = 2;
-   sp->blocks_count = 1 + num_blocks_for_block_bitmap + num_blocks_for_inode_bitmap + num_blocks_for_inode_table;
+   sp->blocks_count = 1 + num_blocks_for_block_bitmap + num_blocks_for_inode_bitmap + num_blocks_for_inode_table + opts->journal_blocks;
    sp->free_blocks_count = sp->max_block_count - sp->blocks_count;
    sp->free_inodes_count = sp->max_inodes_count - sp->inodes_count;
    
    // set block bitmap of all reserved block to 1
    char *block_bits = (char *)((void*)sp + A1FS_BLOCK_SIZE * sp->block_bitmap);
-   for (size_t i = 0; i < sp->blocks_count; i++){
-       set_bitmap(block_bits, i);
-   }
+   set_bitmap_range(block_bits, 0, sp->blocks_count);
 
    if (sp->max_block_count < sp->blocks_count || sp->max_inodes_count < sp->inodes_count){
        sp->state = 2;// 1 for valid; 2 for error
@@ -217,11 +424,19 @@ int main(int argc, char *argv[])
         goto end;
     }
  
-    if (opts.zero) memset(image, 0, size);
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (opts.zero) zero_image(opts.img_path, image, size);
     if (!mkfs(image, size, &opts)) {
         fprintf(stderr, "Failed to format the image\n");
         goto end;
     }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (opts.verbose) {
+        a1fs_superblock *sp = (a1fs_superblock*)image;
+        printf("Formatted %zu blocks, %zu inodes in %.3f s\n", sp->max_block_count, sp->max_inodes_count,
+               (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9);
+    }
  
     // Sync to disk if requested
     if (opts.sync && (msync(image, size, MS_SYNC) < 0)) {
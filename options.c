@@ -37,6 +37,10 @@ static const struct fuse_opt opt_spec[] = {
 
 	A1FS_OPT("--sync"   , sync   ),
 	A1FS_OPT("--verbose", verbose),
+	A1FS_OPT("--mt"     , mt     ),
+	{ "--flush=%u", offsetof(a1fs_opts, flush), 0 },
+	{ "--io=%s"   , offsetof(a1fs_opts, io   ), 0 },
+	{ "--cache=%u", offsetof(a1fs_opts, cache), 0 },
 
 	FUSE_OPT_END
 };
@@ -45,7 +49,7 @@ static const char *help_str = "\
 Usage: %s image dir [options]\n\
 \n\
 Mount a1fs image file at given mount point. Use fusermount(1) to unmount.\n\
-Only single-threaded mount is supported; -s FUSE option is implied.\n\
+The mount is single-threaded (-s FUSE option is implied) unless --mt is given.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
@@ -53,8 +57,21 @@ general options:\n\
     -V   --version         print version\n\
 \n\
 a1fs options:\n\
-    --sync                 sync image file contents to disk on unmount\n\
+    --sync                 sync image file contents to disk on unmount, and\n\
+                           the changes to a file when it is closed; with a\n\
+                           journal, also commit every namespace change and\n\
+                           truncate before it returns\n\
+    --flush=<ms>           sync the changed parts of the image every <ms> ms\n\
+    --io=<backend>         how the image is written: mmap (default), or pwrite\n\
+                           to write only what is synced, in that order; the\n\
+                           flush interval then defaults to 5000 ms; or uring,\n\
+                           which is pwrite with the writes batched on an\n\
+                           io_uring; both need an image with a journal\n\
+    --cache=<MiB>          with --io=pwrite or uring, drop the changed blocks kept in\n\
+                           memory after this many are written (default 256);\n\
+                           only a journal checkpoint or unmount drops them\n\
     --verbose              verbose output; only useful in foreground mode (-f)\n\
+    --mt                   serve requests from multiple threads\n\
 \n\
 ";
 
@@ -91,7 +108,7 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
+	// Single-threaded mount unless asked otherwise
+	if (!opts->mt) fuse_opt_add_arg(args, "-s");
 	return true;
 }
@@ -33,10 +33,18 @@ typedef struct a1fs_opts {
 	/** Print version and exit. FUSE option. */
 	int version;
 
-	/** Sync memory-mapped image file contents to disk on unmount. */
+	/** Sync memory-mapped image file contents to disk on unmount, files on close, and journaled metadata changes as they are made. */
 	int sync;
 	/** Verbose output. Only print logging/debug info if this flag is set. */
 	int verbose;
+	/** Multithreaded mount. Single-threaded (-s) unless this flag is set. */
+	int mt;
+	/** Milliseconds between background syncs of the changed ranges; 0 for none. */
+	unsigned int flush;
+	/** I/O backend, see bdev.h; NULL for mmap. */
+	const char *io;
+	/** MiB of changed blocks the pwrite backend keeps before it drops them; 0 for the default. */
+	unsigned int cache;
 
 } a1fs_opts;
 
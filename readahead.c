@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fs_core.h"
+#include "readahead.h"
+
+
+/** Collect the memory of the data [offset, offset + size) of inode into runs, merging adjacent extents. */
+static void collect(fs_ctx *fs, a1fs_inode *inode, uint64_t offset, uint64_t size, a1fs_ra_runs *runs){
+	a1fs_run run;
+	find_run(fs, inode, offset, size, &run);
+	uintptr_t start = (uintptr_t)run.ptr, end = start + run.len;
+	for (uint64_t done = run.len; done < size; done += run.len){
+		next_run(fs, &run, size - done);
+		if ((uintptr_t)run.ptr == end){
+			end += run.len;
+			continue;
+		}
+		runs->run[runs->count].start = start;
+		runs->run[runs->count].end = end;
+		// the rest of a window in more pieces is left to the faults
+		if (++runs->count == A1FS_RA_RUNS) return;
+		start = (uintptr_t)run.ptr;
+		end = start + run.len;
+	}
+	runs->run[runs->count].start = start;
+	runs->run[runs->count].end = end;
+	runs->count++;
+}
+
+void readahead_update(fs_ctx *fs, a1fs_inode *inode, struct a1fs_cursor *cursor, uint64_t offset, uint64_t size, a1fs_ra_runs *runs){
+	runs->count = 0;
+	if (!cursor || inode->blocks == 0 || size == 0) return;
+	a1fs_readahead *ra = &cursor->ra;
+	uint64_t end = offset + size, from = 0, to = 0;
+	pthread_mutex_lock(&cursor->lock);
+	bool sequential = offset == ra->next || (ra->window > 0 && offset < ra->ahead && offset + ra->window >= ra->next);
+	if (!sequential){
+		ra->window /= 2;
+		if (ra->window < A1FS_RA_MIN){
+			ra->window = 0;
+			ra->ahead = 0;
+		}
+	} else {
+		if (ra->window == 0){
+			ra->window = 2 * size > A1FS_RA_MIN ? 2 * size : A1FS_RA_MIN;
+			if (ra->window > A1FS_RA_MAX) ra->window = A1FS_RA_MAX;
+			ra->ahead = offset;
+		}
+		if (end + ra->window / 2 >= ra->ahead){
+			from = ra->ahead > offset ? ra->ahead : offset;
+			to = (ra->ahead > end ? ra->ahead : end) + ra->window;
+			if (to > inode->size) to = inode->size;
+			ra->ahead = to;
+			ra->window = 2 * ra->window < A1FS_RA_MAX ? 2 * ra->window : A1FS_RA_MAX;
+		}
+	}
+	if (end > ra->next || !sequential) ra->next = end;
+	pthread_mutex_unlock(&cursor->lock);
+	if (to > from) collect(fs, inode, from, to - from, runs);
+}
+
+void readahead_advise(const a1fs_ra_runs *runs){
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < runs->count; i++){
+		// madvise() wants a page aligned address
+		uintptr_t start = runs->run[i].start / page * page;
+		madvise((void*)start, runs->run[i].end - start, MADV_WILLNEED);
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Read-ahead window of a new sequential stream, and the largest one, in bytes. */
+#define A1FS_RA_MIN (128 * 1024)
+#define A1FS_RA_MAX (1024 * 1024)
+/** Most runs of adjacent extents a window is asked for in. */
+#define A1FS_RA_RUNS 16
+
+/**
+ * Read-ahead of an open file.
+ *
+ * Reads of the image fault its pages in one at a time, or a few around the
+ * fault, so a cold sequential read waits for the disk on every few pages.
+ * When the reads through a handle are sequential, the data ahead of them is
+ * asked for with madvise(MADV_WILLNEED), extent by extent, which reads it
+ * into the page cache in the background, so that the faults find it there.
+ *
+ * The data is asked for a window at a time, when the reads come within half
+ * a window of the end of what was asked for; the window doubles with every
+ * one, up to A1FS_RA_MAX. A read elsewhere halves the window, and once it is
+ * below A1FS_RA_MIN, the handle is no longer read ahead until its reads are
+ * sequential again. Reads through the same handle in parallel may come out of
+ * order; a read inside the window still counts as sequential.
+ *
+ * The state is kept in the extent cursor of the handle (see fs_core.h), under
+ * its lock. The memory of a window is found under the inode lock, and asked
+ * for after it is released, so that madvise() does not hold up writers.
+ */
+typedef struct a1fs_readahead {
+	/** Offset right after the last read. */
+	uint64_t next;
+	/** Offset up to which the data was asked for. */
+	uint64_t ahead;
+	/** Size of the next window, in bytes; 0 while the reads are not sequential. */
+	uint64_t window;
+} a1fs_readahead;
+
+/** Memory to ask for, found by readahead_update(). */
+typedef struct a1fs_ra_runs {
+	size_t count;
+	struct {
+		uintptr_t start;
+		uintptr_t end;
+	} run[A1FS_RA_RUNS];
+} a1fs_ra_runs;
+
+struct a1fs_cursor;
+
+/**
+ * Account for a read of size bytes at offset of inode through the handle of
+ * cursor, and collect into runs the memory to read ahead if it continues a
+ * sequential stream. Nothing is collected without a cursor, or for inline
+ * data. The inode must be locked, and offset + size must not be past
+ * inode->size.
+ */
+void readahead_update(fs_ctx *fs, a1fs_inode *inode, struct a1fs_cursor *cursor, uint64_t offset, uint64_t size, a1fs_ra_runs *runs);
+
+/**
+ * Ask for the memory collected by readahead_update() with madvise(MADV_WILLNEED).
+ * Called without the inode lock; the memory stays mapped even if the data
+ * was freed since, so at worst a few blocks are read in for nothing.
+ */
+void readahead_advise(const a1fs_ra_runs *runs);
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+
+/** A queued write, to finish it if the kernel cuts it short. */
+typedef struct uring_req {
+	int fd;
+	const char *buf;
+	size_t len;
+	off_t off;
+} uring_req;
+
+struct a1fs_uring {
+	int fd;
+	unsigned int entries;
+	/** The mappings of the submission queue, of its entries, and of the completion queue. */
+	void *sq_ring;
+	size_t sq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	void *cq_ring;
+	size_t cq_size;
+	/** Fields of the rings shared with the kernel. */
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Writes queued and not submitted yet, and submitted and not done yet. */
+	unsigned int queued;
+	unsigned int inflight;
+	/** The writes, by submission queue entry. */
+	uring_req *reqs;
+	uint64_t submits;
+};
+
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+a1fs_uring *uring_open(unsigned int entries){
+	a1fs_uring *ring = calloc(1, sizeof(a1fs_uring));
+	if (!ring) return NULL;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0){
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	// newer kernels share one mapping between both rings
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                     ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	if (ring->sq_ring == MAP_FAILED) goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                     ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) goto fail;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto fail;
+	ring->reqs = calloc(p.sq_entries, sizeof(uring_req));
+	if (!ring->reqs) goto fail;
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return ring;
+
+fail:;
+	int error = errno;
+	uring_close(ring);
+	errno = error;
+	return NULL;
+}
+
+void uring_close(a1fs_uring *ring){
+	if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_size);
+	if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_size);
+	close(ring->fd);
+	free(ring->reqs);
+	free(ring);
+}
+
+bool uring_full(const a1fs_uring *ring){
+	return ring->queued + ring->inflight >= ring->entries;
+}
+
+void uring_write(a1fs_uring *ring, int fd, const void *buf, size_t len, off_t off){
+	// only this thread moves the tail; the kernel reads it on io_uring_enter()
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	// the kernel writes at most this much at once anyway, and the rest is finished below
+	sqe->len = len < 0x7ffff000 ? len : 0x7ffff000;
+	sqe->off = off;
+	sqe->user_data = index;
+	ring->reqs[index] = (uring_req){ .fd = fd, .buf = buf, .len = len, .off = off };
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued += 1;
+}
+
+/** Finish a write that the kernel cut short after done bytes, with pwrite(). */
+static int finish(const uring_req *req, size_t done){
+	while (done < req->len){
+		ssize_t written = pwrite(req->fd, req->buf + done, req->len - done, req->off + done);
+		if (written < 0){
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		done += written;
+	}
+	return 0;
+}
+
+/** Take the completed writes off the completion queue; return the first error. */
+static int reap(a1fs_uring *ring){
+	int result = 0;
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++){
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		const uring_req *req = &ring->reqs[cqe->user_data];
+		int res = cqe->res, error = 0;
+		if (res >= 0){
+			if ((size_t)res < req->len) error = finish(req, res);
+		} else if (res == -EINVAL || res == -EOPNOTSUPP || res == -EAGAIN || res == -EINTR){
+			// not a failed write, but one the ring could not do
+			error = finish(req, 0);
+		} else {
+			error = res;
+		}
+		if (result == 0) result = error;
+		ring->inflight -= 1;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return result;
+}
+
+int uring_wait(a1fs_uring *ring){
+	int result = 0;
+	while (ring->queued + ring->inflight > 0){
+		int submitted = io_uring_enter(ring->fd, ring->queued, ring->queued + ring->inflight,
+		                               IORING_ENTER_GETEVENTS);
+		if (submitted < 0){
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return -errno;
+			// the completion queue may need room first
+			submitted = 0;
+		} else {
+			ring->submits += 1;
+		}
+		ring->queued -= submitted;
+		ring->inflight += submitted;
+		int error = reap(ring);
+		if (result == 0) result = error;
+	}
+	return result;
+}
+
+uint64_t uring_submits(const a1fs_uring *ring){
+	return ring->submits;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/**
+ * A small io_uring for batches of writes, set up with the system calls
+ * themselves (liburing is not needed).
+ *
+ * Writes are queued with uring_write() and submitted all at once by
+ * uring_wait(), which waits for them in the same io_uring_enter(). A write
+ * the kernel cuts short, or that it can't do (a kernel without
+ * IORING_OP_WRITE), is finished with pwrite(). A ring is used by one thread
+ * at a time.
+ */
+typedef struct a1fs_uring a1fs_uring;
+
+
+/**
+ * Set up a ring for up to entries writes at a time.
+ *
+ * @return  the ring; NULL with errno set if io_uring is not available (an
+ *          older kernel, or disabled by the kernel.io_uring_disabled sysctl).
+ */
+a1fs_uring *uring_open(unsigned int entries);
+
+/** Tear down a ring; no write may be queued. */
+void uring_close(a1fs_uring *ring);
+
+/** Whether the ring has no room for another write until uring_wait() is called. */
+bool uring_full(const a1fs_uring *ring);
+
+/** Queue a write of len bytes of buf at offset off of fd; the ring must not be full. */
+void uring_write(a1fs_uring *ring, int fd, const void *buf, size_t len, off_t off);
+
+/**
+ * Submit the queued writes and wait until they are all done.
+ *
+ * @return  0 on success; the -errno of the first write that failed.
+ */
+int uring_wait(a1fs_uring *ring);
+
+/** Number of io_uring_enter() calls made. */
+uint64_t uring_submits(const a1fs_uring *ring);